@@ -1,14 +1,33 @@
 #include <kernel/panic.h>
+#include <kernel/sched/kstack.h>
 #include <kernel/sched/task.h>
 #include <kernel/syscall.h>
 #include <kernel/types.h>
+#include <mm/vmm.h>
 
 #define ESR_EC_SHIFT 26
 #define ESR_EC_MASK 0x3F
 
+#define EC_DATA_ABORT_LOWER 0x24
 #define EC_DATA_ABORT_SAME 0x25
 #define EC_INSTR_ABORT_SAME 0x21
 
+// Data abort ISS fields
+#define ESR_DFSC_MASK 0x3F
+#define ESR_WNR (1u << 6)  // Write not Read
+#define ESR_FNV (1u << 10) // FAR not valid
+// Translation fault, level 0-3
+#define DFSC_IS_TRANSLATION(dfsc) (((dfsc) & 0x3C) == 0x04)
+// Access flag fault, level 0-3
+#define DFSC_IS_ACCESS_FLAG(dfsc) (((dfsc) & 0x3C) == 0x08)
+// Permission fault, level 0-3
+#define DFSC_IS_PERMISSION(dfsc) (((dfsc) & 0x3C) == 0x0C)
+
+#define PSTATE_I (1u << 7) // IRQs masked
+
+// Dedicated stack for aborts (exception.S)
+extern char abort_stack[], abort_stack_top[];
+
 void handle_svc(cpu_context_t *ctx) {
     uint64_t syscall_num = ctx->x8;
     uint64_t ret = do_syscall(syscall_num, ctx->x0, ctx->x1, ctx->x2, ctx->x3,
@@ -21,16 +40,52 @@ int should_reschedule(void) {
     return (curr && curr->state == TASK_ZOMBIE) ? 1 : 0;
 }
 
-void handle_sync_exception(void) {
-    uint64_t esr, far, elr;
+// Try to resolve a data abort as a stack growth, demand-paging, copy-on-write
+// or page-aging fault
+static int handle_data_abort(cpu_context_t *ctx, uint64_t esr, uint64_t far) {
+    uint32_t dfsc = esr & ESR_DFSC_MASK;
+    if (esr & ESR_FNV)
+        return -1;
+    uint32_t flags = (esr & ESR_WNR) ? VMM_FAULT_WRITE : 0;
+    if (DFSC_IS_PERMISSION(dfsc))
+        flags |= VMM_FAULT_PRESENT;
+    else if (DFSC_IS_ACCESS_FLAG(dfsc))
+        flags |= VMM_FAULT_ACCESS;
+    else if (!DFSC_IS_TRANSLATION(dfsc))
+        return -1;
+    if (DFSC_IS_TRANSLATION(dfsc)) {
+        // Growth of the current task's stack must not wait for vmm_lock
+        int ret = kstack_handle_fault(far, !(ctx->pstate & PSTATE_I));
+        if (ret != -1)
+            return ret;
+    }
+    return vmm_handle_fault(far, flags);
+}
+
+void handle_sync_exception(cpu_context_t *ctx) {
+    uint64_t esr, far;
     __asm__ volatile("mrs %0, esr_el1" : "=r"(esr));
     __asm__ volatile("mrs %0, far_el1" : "=r"(far));
-    __asm__ volatile("mrs %0, elr_el1" : "=r"(elr));
 
     uint32_t ec = (esr >> ESR_EC_SHIFT) & ESR_EC_MASK;
 
-    panic("Sync exception: EC=0x%x FAR=%p ELR=%p", ec, (void *)far,
-          (void *)elr);
+    // A fault taken while already on the abort stack has overwritten the
+    // outer frame: there is nothing left to return to.
+    if (ctx->sp > (uint64_t)abort_stack && ctx->sp <= (uint64_t)abort_stack_top)
+        panic("Nested abort: EC=0x%x FAR=%p ELR=%p", ec, (void *)far,
+              (void *)ctx->pc);
+
+    int ret = -1;
+    if (ec == EC_DATA_ABORT_SAME || ec == EC_DATA_ABORT_LOWER)
+        ret = handle_data_abort(ctx, esr, far);
+    if (ret == 0)
+        return;
+    if (ret == -4)
+        panic("Out of memory populating %p (ELR=%p)", (void *)far,
+              (void *)ctx->pc);
+
+    panic("Sync exception: EC=0x%x ESR=0x%x FAR=%p ELR=%p SP=%p", ec,
+          (unsigned)esr, (void *)far, (void *)ctx->pc, (void *)ctx->sp);
 }
 
 void handle_fiq(void) { panic("Unexpected FIQ"); }
@@ -1,6 +1,7 @@
 #include <drivers/gic.h>
 #include <dtb.h>
 #include <kernel/printk.h>
+#include <mm/ioremap.h>
 
 // GICv2 registers
 #define GICD_CTLR 0x000
@@ -11,6 +12,11 @@
 #define GICD_ITARGETSR 0x800
 #define GICD_ICFGR 0xC00
 
+// QEMU virt GIC layout
+#define GICD_PHYS 0x08000000ULL
+#define GICC_PHYS 0x08010000ULL
+#define GIC_MMIO_SIZE 0x10000
+
 #define GICC_CTLR 0x000
 #define GICC_PMR 0x004
 #define GICC_IAR 0x00C
@@ -110,7 +116,11 @@ void gic_init(void) {
 
     if (gic_version == 3) {
         printk("GIC: Detected GICv3\n");
-        gicd_base = (volatile uint32_t *)0x08000000ULL;
+        gicd_base = ioremap(GICD_PHYS, GIC_MMIO_SIZE);
+        if (!gicd_base) {
+            printk("GIC: cannot map distributor\n");
+            return;
+        }
 
         gicd_write(GICD_CTLR, 0);
         gicd_write(GICD_CTLR, 0x37);
@@ -121,8 +131,12 @@ void gic_init(void) {
         __asm__ volatile("msr daifclr, #2" ::: "memory");
     } else {
         printk("GIC: Detected GICv2\n");
-        gicd_base = (volatile uint32_t *)0x08000000ULL;
-        gicc_base = (volatile uint32_t *)0x08010000ULL;
+        gicd_base = ioremap(GICD_PHYS, GIC_MMIO_SIZE);
+        gicc_base = ioremap(GICC_PHYS, GIC_MMIO_SIZE);
+        if (!gicd_base || !gicc_base) {
+            printk("GIC: cannot map distributor/CPU interface\n");
+            return;
+        }
 
         gicd_write(GICD_CTLR, 0);
         for (int i = 0; i < 32; i++) {
@@ -1,11 +1,16 @@
 #include <drivers/serial.h>
 #include <dtb.h>
 #include <kernel/types.h>
+#include <mm/ioremap.h>
 
 // Default PL011 UART base for QEMU virt machine (fallback)
 #define DEFAULT_UART_BASE 0x09000000ULL
 
-// Runtime UART base (may be overridden by DTB)
+// PL011 register window
+#define UART_MMIO_SIZE 0x1000
+
+// Runtime UART base (may be overridden by DTB). Physical until
+// serial_remap() switches it to a device mapping.
 static uint64_t uart_base = DEFAULT_UART_BASE;
 
 // PL011 UART register offsets
@@ -50,6 +55,12 @@ void serial_init() {
     mb();
 }
 
+void serial_remap(void) {
+    void *regs = ioremap(uart_base, UART_MMIO_SIZE);
+    if (regs)
+        uart_base = (uint64_t)regs;
+}
+
 // A very small spin timeout to avoid hard-lock if UART isn't ready
 #define UART_SPIN_MAX 1000000
 
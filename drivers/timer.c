@@ -1,13 +1,39 @@
+// ARM generic timer: the periodic tick and the preemption timer
+//
+// One comparator (CNTP_CVAL) serves three deadlines: the next periodic
+// tick, which keeps jiffies, the running task's slice expiry, which the
+// scheduler sets on every switch, and the earliest timed wakeup of a
+// sleeping task. The comparator is always programmed for whichever comes
+// first, so a task is preempted when its slice runs out, not at the next
+// tick, and a tick that arrives mid-slice just counts.
+//
+// When the CPU goes idle with nothing to run the tick is stopped altogether
+// (NO_HZ idle): the comparator is left with only real deadlines, and jiffies
+// are caught up from the counter when the CPU wakes.
+
 #include <drivers/timer.h>
 #include <kernel/irq.h>
 #include <kernel/printk.h>
+#include <kernel/rcu.h>
 #include <kernel/sched/task.h>
+#include <kernel/seqlock.h>
+#include <kernel/smp.h>
 #include <kernel/types.h>
 
 #define TIMER_IRQ 30
 
 static volatile uint64_t jiffies = 0;
 static uint32_t timer_freq = 0;
+static uint64_t tick_period; // counter cycles per tick
+static uint64_t next_tick;   // CNTPCT of the next periodic tick
+static uint64_t slice_end;   // CNTPCT at which to preempt, 0 if none
+static uint64_t event_end;   // CNTPCT of the next wakeup, 0 if none
+static int tick_stopped;     // idle with the periodic tick off
+static uint64_t idle_start;  // CNTPCT when the tick was stopped
+static timer_stats_t stats;
+// Stats are only written with IRQs masked (the IRQ handler, the idle entry
+// and exit); readers retry instead of masking IRQs themselves
+static seqcount_t stats_seq = SEQCNT_ZERO;
 
 uint64_t read_cntpct(void) {
     uint64_t val;
@@ -21,29 +47,133 @@ uint64_t read_cntfrq(void) {
     return val;
 }
 
-uint64_t get_ns(void) { return read_cntpct() * 1000000000ULL / read_cntfrq(); }
+// Split at whole seconds so the products stay within 64 bits however long
+// the machine has been up
+static uint64_t cnt_to_ns(uint64_t cnt, uint64_t freq) {
+    return cnt / freq * 1000000000ULL + cnt % freq * 1000000000ULL / freq;
+}
+
+static uint64_t ns_to_cnt(uint64_t ns) {
+    return ns / 1000000000ULL * timer_freq +
+           ns % 1000000000ULL * timer_freq / 1000000000ULL;
+}
+
+uint64_t get_ns(void) { return cnt_to_ns(read_cntpct(), read_cntfrq()); }
 
-static inline void write_cntp_tval(uint32_t val) {
-    __asm__ volatile("msr cntp_tval_el0, %0" ::"r"((uint64_t)val));
+static inline void write_cntp_cval(uint64_t val) {
+    __asm__ volatile("msr cntp_cval_el0, %0" ::"r"(val));
 }
 
 static inline void write_cntp_ctl(uint32_t val) {
     __asm__ volatile("msr cntp_ctl_el0, %0" ::"r"((uint64_t)val));
 }
 
+// Point the comparator at the earliest of the next tick, the slice end and
+// the next wakeup. Called with IRQs masked.
+static void timer_program(void) {
+    uint64_t cval = tick_stopped ? UINT64_MAX : next_tick;
+    if (slice_end && slice_end < cval)
+        cval = slice_end;
+    if (event_end && event_end < cval)
+        cval = event_end;
+    write_cntp_cval(cval);
+}
+
+// Account for the ticks that are due by now
+static void tick_catch_up(uint64_t now) {
+    if (now < next_tick)
+        return;
+    uint64_t n = (now - next_tick) / tick_period + 1;
+    next_tick += n * tick_period;
+    jiffies += n;
+}
+
 static void timer_irq_handler(cpu_context_t *ctx, int irq, void *dev) {
     (void)irq;
     (void)dev;
 
-    jiffies++;
-
-    schedule_preempt(ctx);
+    uint64_t now = read_cntpct();
+    // Any timer IRQ that did not interrupt a reader is a quiescent state
+    rcu_sched_clock_irq(task_current());
+
+    if (now >= next_tick && !tick_stopped) {
+        // Catch up on ticks missed with IRQs masked
+        uint64_t before = jiffies;
+        tick_catch_up(now);
+        write_seqcount_begin(&stats_seq);
+        stats.ticks++;
+        write_seqcount_end(&stats_seq);
+        if (jiffies / 10 != before / 10) {
+            printk(".");
+        }
+    }
 
-    write_cntp_tval(timer_freq / 100);
+    if (event_end && now >= event_end) {
+        event_end = 0;
+        write_seqcount_begin(&stats_seq);
+        stats.wakeups++;
+        write_seqcount_end(&stats_seq);
+        // Re-arms the event for the next sleeper through timer_set_event()
+        task_wake_sleepers();
+    }
 
-    if (jiffies % 10 == 0) {
-        printk(".");
+    if (slice_end && now >= slice_end) {
+        slice_end = 0;
+        write_seqcount_begin(&stats_seq);
+        stats.preemptions++;
+        write_seqcount_end(&stats_seq);
+        // Arms the next task's slice through timer_set_slice()
+        schedule_preempt(ctx);
     }
+
+    timer_program();
+}
+
+void timer_set_slice(uint64_t ns) {
+    uint64_t flags = local_irq_save();
+    slice_end = ns ? read_cntpct() + ns_to_cnt(ns) : 0;
+    timer_program();
+    local_irq_restore(flags);
+}
+
+void timer_set_event(uint64_t when) {
+    uint64_t flags = local_irq_save();
+    // Never 0, which means no event: a time already past fires at once
+    event_end = when ? ns_to_cnt(when) | 1 : 0;
+    timer_program();
+    local_irq_restore(flags);
+}
+
+void timer_nohz_enter(void) {
+    if (tick_stopped)
+        return;
+    tick_stopped = 1;
+    slice_end = 0;
+    idle_start = read_cntpct();
+    write_seqcount_begin(&stats_seq);
+    stats.idle_entries++;
+    write_seqcount_end(&stats_seq);
+    timer_program();
+}
+
+void timer_nohz_exit(void) {
+    if (!tick_stopped)
+        return;
+    uint64_t now = read_cntpct();
+    tick_catch_up(now);
+    write_seqcount_begin(&stats_seq);
+    stats.idle_ns += cnt_to_ns(now - idle_start, timer_freq);
+    write_seqcount_end(&stats_seq);
+    tick_stopped = 0;
+    timer_program();
+}
+
+void timer_get_stats(timer_stats_t *out) {
+    uint32_t seq;
+    do {
+        seq = read_seqcount_begin(&stats_seq);
+        *out = stats;
+    } while (read_seqcount_retry(&stats_seq, seq));
 }
 
 void timer_init(uint32_t freq_hz) {
@@ -54,8 +184,12 @@ void timer_init(uint32_t freq_hz) {
 
     irq_install_handler(TIMER_IRQ, timer_irq_handler, NULL);
 
+    tick_period = timer_freq / freq_hz;
     write_cntp_ctl(0);
-    write_cntp_tval(timer_freq / freq_hz);
+    next_tick = read_cntpct() + tick_period;
+    // The boot context gets the scheduler's attention at the first tick
+    slice_end = next_tick;
+    timer_program();
     write_cntp_ctl(1);
 
     irq_enable(TIMER_IRQ);
@@ -72,6 +206,6 @@ void timer_udelay(uint32_t us) {
         ;
 }
 
-void delay(uint32_t ms) { timer_udelay(ms * 1000); }
+void delay(uint32_t ms) { task_sleep_ns((uint64_t)ms * 1000000ULL); }
 
-void delay_sec(uint32_t s) { timer_udelay(s * 1000000); }
+void delay_sec(uint32_t s) { task_sleep_ns((uint64_t)s * 1000000000ULL); }
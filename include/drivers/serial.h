@@ -3,6 +3,9 @@
 #include <stdint.h>
 
 void serial_init();
+// Move the UART registers from the identity map to an ioremap() mapping;
+// call once the MMU and VMM are up.
+void serial_remap(void);
 void serial_putc(char c);
 void serial_puts(const char *s);
 void serial_print_hex(uint64_t val);
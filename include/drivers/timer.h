@@ -3,12 +3,34 @@
 
 #include <stdint.h>
 
+typedef struct {
+    uint64_t ticks;        // timer IRQs that advanced jiffies
+    uint64_t preemptions;  // timer IRQs that ended a slice
+    uint64_t wakeups;      // timer IRQs for a sleeping task's wakeup
+    uint64_t idle_entries; // times the tick was stopped for idle
+    uint64_t idle_ns;      // time spent with the tick stopped
+} timer_stats_t;
+
 void timer_init(uint32_t freq_hz);
 uint64_t timer_get_ticks(void);
+// Preempt the running task ns from now; 0 cancels. The scheduler calls this
+// each time it puts a task on the CPU.
+void timer_set_slice(uint64_t ns);
+// Call task_wake_sleepers() once get_ns() reaches when; 0 cancels. This
+// is the one real deadline that survives NO_HZ idle.
+void timer_set_event(uint64_t when);
+// NO_HZ idle, called by the idle loop with IRQs masked: stop the periodic
+// tick (and the idle task's slice) until timer_nohz_exit(), which brings
+// jiffies up to date.
+void timer_nohz_enter(void);
+void timer_nohz_exit(void);
+void timer_get_stats(timer_stats_t *out);
+// Busy-wait; for short waits and contexts that cannot sleep
 void timer_udelay(uint32_t us);
 uint64_t read_cntpct();
 uint64_t read_cntfrq();
 uint64_t get_ns();
+// Sleep via task_sleep_ns(), which busy-waits where sleeping is not possible
 void delay(uint32_t ms);
 void delay_sec(uint32_t seconds);
 
@@ -3,4 +3,5 @@
 #include <kernel/sched/task.h>
 
 extern void exception_init(void);
-void handle_svc(cpu_context_t *ctx);
\ No newline at end of file
+void handle_svc(cpu_context_t *ctx);
+void handle_sync_exception(cpu_context_t *ctx);
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef ARCLINE_MUTEX_H
+#define ARCLINE_MUTEX_H
+
+#include <kernel/sched/wait.h>
+#include <kernel/spinlock.h>
+#include <stdint.h>
+
+// Sleeping lock for long critical sections. A contended mutex_lock() spins
+// only while the owner is running on another CPU, then queues on the mutex
+// and blocks, so neither the wait nor the section itself keeps IRQs masked.
+// Waiters are served in FIFO order; a waiter that was woken and still lost
+// the race asks for a handoff, and the next unlock passes the mutex straight
+// to it instead of letting a running task barge in again.
+//
+// Task context only: not from IRQ handlers and not under a spinlock. Before
+// the scheduler is up there is a single thread and the lock never blocks.
+
+typedef struct {
+    volatile uint64_t owner; // owning task_t *, low bits MUTEX_FLAG_*
+    spinlock_t wait_lock;    // serializes waiters against slow unlocks
+    wait_queue_t wait;
+} mutex_t;
+
+#define MUTEX_INIT {0, SPINLOCK_INIT, WAIT_QUEUE_INIT}
+
+void mutex_init(mutex_t *m);
+void mutex_lock(mutex_t *m);
+// Returns 0 if the mutex was taken, -1 if it is held
+int mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+int mutex_is_locked(mutex_t *m);
+
+#endif
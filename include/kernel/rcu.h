@@ -0,0 +1,66 @@
+#ifndef ARCLINE_RCU_H
+#define ARCLINE_RCU_H
+
+#include <kernel/sched/task.h>
+#include <kernel/types.h>
+
+// Read-copy-update. Readers run between rcu_read_lock() and
+// rcu_read_unlock() without taking any lock or writing shared memory;
+// they may be preempted. A writer publishes a new version of an object
+// with rcu_assign_pointer() and frees the old one only once a grace period
+// has passed, i.e. once every reader that could still see it has finished:
+// synchronize_rcu() waits for that, call_rcu() queues a callback for it.
+//
+// A grace period ends when the CPU has passed a quiescent state (a context
+// switch, a tick that interrupted a task outside any read-side section, or
+// idle) and every task that was preempted inside a read-side section when
+// it began has left that section. Callbacks run in the rcu kthread.
+
+typedef struct {
+    uint64_t gp_completed;  // grace periods ended
+    uint64_t cbs_invoked;   // callbacks run by the kthread
+    uint64_t readers_blocked; // readers preempted inside a section
+} rcu_stats_t;
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_read_unlock_special(task_t *task);
+
+// Sections nest. Before the scheduler is up there is nothing to wait for.
+static inline void rcu_read_lock(void) {
+    task_t *task = task_current();
+    if (task)
+        task->rcu_nesting++;
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void rcu_read_unlock(void) {
+    __asm__ volatile("" ::: "memory");
+    task_t *task = task_current();
+    if (task && --task->rcu_nesting == 0 && task->rcu_blocked)
+        rcu_read_unlock_special(task);
+}
+
+// Run func(head) once a grace period has passed. Callable from any context.
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+// Block until a grace period has passed. Task context only, never inside a
+// read-side section.
+void synchronize_rcu(void);
+
+// Quiescent-state hooks, all with IRQs masked. prev is the task being
+// switched out (NULL if it has exited), curr the task the tick interrupted.
+void rcu_note_context_switch(task_t *prev);
+void rcu_sched_clock_irq(task_t *curr);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+// Forget task's read-side state when it exits or is killed
+void rcu_task_dead(task_t *task);
+
+// Start the callback kthread. Returns 0 on success, -4 if it could not be
+// created.
+int rcu_init(void);
+
+void rcu_get_stats(rcu_stats_t *out);
+
+#endif // ARCLINE_RCU_H
@@ -0,0 +1,108 @@
+#ifndef ARCLINE_RWLOCK_H
+#define ARCLINE_RWLOCK_H
+
+#include <stdint.h>
+
+// Reader-writer spinlock with writer preference. Any number of readers hold
+// it together; a writer holds it alone. Once a writer is waiting, new
+// readers wait behind it, so a steady stream of readers cannot starve
+// writers (the price is that readers can be starved by writers instead).
+// Waiters park in WFE until the lock word changes.
+//
+// Because of the preference, a reader must not nest a read_lock() it could
+// also take from an IRQ: a writer queued in between deadlocks both. Locks
+// that IRQ handlers take use the _irqsave variants everywhere.
+
+typedef struct {
+    volatile uint32_t cnts; // readers | waiting writers << 16 | RW_WRITER
+} rwlock_t;
+
+#define RWLOCK_INIT {0}
+
+#define RW_READER_MASK 0x0000FFFFu
+#define RW_WAITING_ONE 0x00010000u
+#define RW_WRITER 0x80000000u
+
+static inline void rwlock_init(rwlock_t *lock) { lock->cnts = 0; }
+
+// Wait for (cnts & mask) == 0
+static inline void rw_wait_clear(rwlock_t *lock, uint32_t mask) {
+    uint32_t tmp;
+    __asm__ volatile("   sevl\n"
+                     "1: wfe\n"
+                     "   ldaxr %w0, [%1]\n"
+                     "   tst %w0, %w2\n"
+                     "   b.ne 1b\n"
+                     : "=&r"(tmp)
+                     : "r"(&lock->cnts), "r"(mask)
+                     : "memory", "cc");
+}
+
+static inline void read_lock(rwlock_t *lock) {
+    for (;;) {
+        uint32_t old = __atomic_load_n(&lock->cnts, __ATOMIC_RELAXED);
+        if (!(old & ~RW_READER_MASK)) {
+            if (__atomic_compare_exchange_n(&lock->cnts, &old, old + 1, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
+        // A writer holds it or waits for it
+        rw_wait_clear(lock, ~RW_READER_MASK);
+    }
+}
+
+static inline void read_unlock(rwlock_t *lock) {
+    __atomic_sub_fetch(&lock->cnts, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t *lock) {
+    // Announce ourselves first: from here on no new reader gets in
+    __atomic_add_fetch(&lock->cnts, RW_WAITING_ONE, __ATOMIC_RELAXED);
+    for (;;) {
+        uint32_t old = __atomic_load_n(&lock->cnts, __ATOMIC_RELAXED);
+        if (!(old & (RW_WRITER | RW_READER_MASK))) {
+            uint32_t new = old - RW_WAITING_ONE + RW_WRITER;
+            if (__atomic_compare_exchange_n(&lock->cnts, &old, new, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
+        rw_wait_clear(lock, RW_WRITER | RW_READER_MASK);
+    }
+}
+
+static inline void write_unlock(rwlock_t *lock) {
+    // Other writers may be registering themselves meanwhile
+    __atomic_sub_fetch(&lock->cnts, RW_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t read_lock_irqsave(rwlock_t *lock) {
+    uint64_t flags;
+    __asm__ volatile("mrs %0, daif" : "=r"(flags));
+    __asm__ volatile("msr daifset, #2" ::: "memory");
+    read_lock(lock);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+    read_unlock(lock);
+    __asm__ volatile("msr daif, %0" ::"r"(flags) : "memory");
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t *lock) {
+    uint64_t flags;
+    __asm__ volatile("mrs %0, daif" : "=r"(flags));
+    __asm__ volatile("msr daifset, #2" ::: "memory");
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+    write_unlock(lock);
+    __asm__ volatile("msr daif, %0" ::"r"(flags) : "memory");
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef ARCLINE_KERNEL_COMPLETION_H
+#define ARCLINE_KERNEL_COMPLETION_H
+
+#include <kernel/sched/wait.h>
+
+// One-shot events: complete() lets one waiter through (or records that the
+// next wait need not block), complete_all() lets every present and future
+// waiter through.
+
+typedef struct {
+    uint32_t done;
+    wait_queue_t wait;
+} completion_t;
+
+#define COMPLETION_INIT {0, WAIT_QUEUE_INIT}
+
+void init_completion(completion_t *c);
+void wait_for_completion(completion_t *c);
+void complete(completion_t *c);
+void complete_all(completion_t *c);
+
+#endif // ARCLINE_KERNEL_COMPLETION_H
@@ -8,37 +8,63 @@
 #define EEVDF_TARGET_LATENCY 6000000
 #define EEVDF_WAKEUP_GRANULARITY 1000000
 #define EEVDF_NICE_0_LOAD 1024
+#define EEVDF_WMULT_SHIFT 32 // eevdf_nice_to_wmult[i] = 2^32 / weight[i]
 #define EEVDF_MIN_NICE (-20)
 #define EEVDF_MAX_NICE 19
 #define EEVDF_TIME_SLICE_NS (4 * 1000000)
 #define EEVDF_MAX_TIME_SLICE_NS (100 * 1000000)
+#define EEVDF_TICK_NS (10 * 1000000)
+
+// sched_entity_t.place
+#define EEVDF_PLACE_NONE 0    // requeue as is (preempted while running)
+#define EEVDF_PLACE_INITIAL 1 // new task: start at V with half a request
+#define EEVDF_PLACE_WAKEUP 2  // woken task: restore its lag
 
 extern const uint32_t eevdf_nice_to_weight[40];
 extern const uint32_t eevdf_nice_to_wmult[40];
 
-typedef struct eevdf_rb_node {
-    struct eevdf_rb_node *left;
-    struct eevdf_rb_node *right;
-    struct eevdf_rb_node *parent;
-    uint8_t color;
-    task_t *task;
-} eevdf_rb_node_t;
-
+// Earliest Eligible Virtual Deadline First. Every task asks for the CPU in
+// requests of se.slice ns; a request's virtual deadline is its vruntime
+// plus the slice scaled by the task's weight. A task is eligible while its
+// vruntime is at or below V, the load-weighted average vruntime, i.e. while
+// it has had no more than its fair share. The scheduler runs the eligible
+// task with the earliest deadline, so a short request gets the CPU sooner
+// without getting more of it. A task that sleeps keeps its lag (V -
+// vruntime) and gets it back when it wakes, so sleeping neither earns nor
+// forfeits service.
+//
+// Runqueue: a red-black tree of the sched_entity_t embedded in each READY
+// task, ordered by vruntime, with the leftmost entity cached and every
+// node caching its subtree's earliest deadline. The running task is not in
+// the tree but is tracked as curr and still counts towards V.
 typedef struct {
-    eevdf_rb_node_t *root;
-    eevdf_rb_node_t *leftmost;
+    sched_entity_t *root;
+    sched_entity_t *leftmost;
+    sched_entity_t *curr;
     uint64_t min_vruntime;
-    uint32_t load_weight;
+    int64_t avg_vruntime; // sum of (vruntime - min_vruntime) * weight
+    uint32_t load_weight; // sum of weight over queued entities
     uint32_t nr_running;
 } eevdf_rq_t;
 
 void eevdf_init(void);
 void eevdf_enqueue(task_t *task);
 void eevdf_dequeue(task_t *task);
+// Take task out of the competition for a sleep, remembering its lag for the
+// eevdf_enqueue() that wakes it. The lag is measured against a V the task is
+// still part of: as curr (even once marked TASK_BLOCKED) or queued.
+void eevdf_sleep(task_t *task, uint64_t now);
 task_t *eevdf_pick_next(void);
+// task is going on the CPU at now (the idle task clears curr)
+void eevdf_set_curr(task_t *task, uint64_t now);
 void eevdf_update_curr(task_t *task, uint64_t now);
+// Wall-clock ns task may run before its current request's deadline
 uint64_t eevdf_calc_slice(task_t *task);
 void eevdf_set_nice(task_t *task, int nice);
+// Set task's request size; shorter requests get earlier deadlines and so
+// lower latency, at the same share of the CPU
+void eevdf_set_slice(task_t *task, uint64_t slice);
+// O(1): reads the entity's on-rq flag
 int eevdf_is_queued(task_t *task);
 
 #endif
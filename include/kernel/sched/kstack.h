@@ -0,0 +1,34 @@
+#ifndef ARCLINE_KERNEL_KSTACK_H
+#define ARCLINE_KERNEL_KSTACK_H
+
+#include <stdint.h>
+
+// Kernel stacks are KERNEL_STACK_SIZE bytes of vmalloc memory between guard
+// pages. Only the top page is populated up front; the rest fills in as the
+// stack grows, so unused depth costs no memory. Freed stacks are kept mapped
+// in a small per-CPU cache and handed straight back to the next task,
+// skipping the vmalloc/VMM/PMM path.
+
+#define KSTACK_CACHE_SIZE 8
+
+typedef struct {
+    uint64_t hits;     // allocations served from the cache
+    uint64_t misses;   // allocations that went to vmalloc
+    uint64_t recycled; // frees kept in the cache
+    uint64_t released; // frees returned to vmalloc (cache full)
+    uint64_t faults;   // stack pages populated on first touch
+} kstack_stats_t;
+
+// Returns the lowest address of a ready-to-use stack, or NULL
+void *kstack_alloc(void);
+void kstack_free(void *stack);
+void kstack_get_stats(kstack_stats_t *out);
+
+// Populate the page at va if it lies in the current task's stack. Called by
+// the abort handler for translation faults, before vmm_handle_fault(), since
+// the faulting code may hold VMM/PMM locks; irqs_were_on is the interrupted
+// context's IRQ mask state. Returns 0 if the access can be retried, -1 if va
+// is not on the current stack, -4 if no frame is left.
+int kstack_handle_fault(uint64_t va, int irqs_were_on);
+
+#endif // ARCLINE_KERNEL_KSTACK_H
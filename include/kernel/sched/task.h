@@ -1,7 +1,7 @@
 #ifndef ARCLINE_KERNEL_TASK_H
 #define ARCLINE_KERNEL_TASK_H
 
-#include <stdint.h>
+#include <kernel/types.h>
 
 #define TASK_RUNNING 0
 #define TASK_READY 1
@@ -21,6 +21,28 @@ typedef struct cpu_context {
 } cpu_context_t;
 
 typedef struct task task_t;
+struct wait_queue;
+
+// Per-task scheduler state, embedded in task_t. The entity is its own
+// runqueue tree node, so queueing a task never allocates and finding it in
+// the tree is a pointer dereference.
+typedef struct sched_entity {
+    struct sched_entity *left;
+    struct sched_entity *right;
+    struct sched_entity *parent;
+    uint8_t color;
+    uint8_t on_rq;             // linked into the runqueue tree
+    uint8_t place;             // EEVDF_PLACE_*: how the next enqueue places it
+    uint32_t weight;           // load weight of the task's nice level
+    uint32_t wmult;            // 2^32 / weight, for divide-free scaling
+    uint64_t vruntime;
+    uint64_t deadline;         // virtual deadline of the current request
+    uint64_t min_deadline;     // earliest deadline in this tree subtree
+    int64_t vlag;              // V - vruntime when it went to sleep
+    uint64_t slice;            // request size: ns of CPU asked for at a time
+    uint64_t exec_start;       // get_ns() when the task last went on the CPU
+    uint64_t sum_exec_runtime; // total ns spent running
+} sched_entity_t;
 
 typedef struct {
     int argc;
@@ -32,8 +54,7 @@ struct task {
     int pid;
     int state;
     int priority;
-    uint64_t time_slice;
-    uint64_t vruntime;
+    sched_entity_t se;
 
     cpu_context_t context;
     void *kernel_stack;
@@ -41,6 +62,21 @@ struct task {
 
     task_t *next;
     task_t *prev;
+    task_t *reap_next; // on the reap list while the stack awaits reclaim
+    uint32_t usage;    // references: the task's own until reaped, task_get()s
+    rcu_head_t rcu;    // frees the task_t a grace period after reaping
+
+    // While TASK_BLOCKED
+    struct wait_queue *wq; // wait queue the task is on, if any
+    task_t *wq_next;
+    uint64_t wake_at;      // get_ns() deadline of a timed sleep
+    task_t *sleep_next;    // on the sleep list, earliest wake_at first
+
+    // RCU read side
+    int rcu_nesting;     // rcu_read_lock() depth
+    uint8_t rcu_blocked; // preempted inside a section, on the blocked list
+    uint8_t rcu_blocks_gp; // and holding up the current grace period
+    task_t *rcu_next;
 };
 
 void task_init(void);
@@ -51,7 +87,34 @@ task_t *task_current(void);
 void task_set_current(task_t *task);
 void schedule(void);
 void schedule_preempt(cpu_context_t *regs);
+// Find the live task with this PID; zombies are skipped. The caller must
+// be inside rcu_read_lock() or have IRQs masked (which holds off the RCU
+// kthread), and may use the result only there unless it takes task_get().
 task_t *task_find_by_pid(int pid);
 int task_kill(task_t *task);
+// Recycle the kernel stacks of zombie tasks that are no longer running and
+// take them off the task list; each task_t is freed after a grace period,
+// once no task_get() reference is left
+void task_reap(void);
+// Keep task's task_t around past its reaping. task_put() may free it, so
+// not from IRQ context.
+void task_get(task_t *task);
+void task_put(task_t *task);
+// Block the current task for at least ns. It leaves the runqueue until the
+// timer wakes it. The idle task, IRQ handlers and sections with IRQs masked
+// cannot block: there it waits in place (the idle task yielding meanwhile).
+void task_sleep_ns(uint64_t ns);
+// Make a TASK_BLOCKED task runnable (cancelling a timed sleep). Returns 1 if
+// it was blocked, 0 otherwise. Callable from IRQ context.
+int task_wake(task_t *task);
+// Wake every sleeper whose time has come; called from the timer IRQ
+void task_wake_sleepers(void);
+// Take a TASK_BLOCKED task off the sleep list and its wait queue without
+// waking it, for task_kill()
+void task_cancel_wait(task_t *task);
+// The idle loop, run by PID 0 once boot is done; never returns. Runs
+// whatever becomes runnable and otherwise sleeps in WFI with the tick
+// stopped.
+void cpu_idle(void);
 
 #endif // ARCLINE_KERNEL_TASK_H
@@ -0,0 +1,60 @@
+#ifndef ARCLINE_KERNEL_WAIT_H
+#define ARCLINE_KERNEL_WAIT_H
+
+#include <kernel/sched/task.h>
+#include <kernel/spinlock.h>
+#include <stddef.h>
+
+// Wait queues: tasks blocked until some condition holds. A waiter queues
+// itself and marks itself TASK_BLOCKED before re-checking the condition,
+// so a wake_up() that races with the check makes it runnable again instead
+// of being lost. Woken tasks are taken off the queue by the waker, in FIFO
+// order. Blocked tasks are off the runqueue and use no CPU.
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    task_t *head;
+    task_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {SPINLOCK_INIT, NULL, NULL}
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Queue the current task on wq (if it is not already) and mark it blocked.
+// The caller re-checks its condition and calls schedule() if it is still
+// false; once it is true, finish_wait() undoes the rest.
+void prepare_to_wait(wait_queue_t *wq);
+void finish_wait(wait_queue_t *wq);
+
+// Block until cond is true. cond is evaluated in the waiter's context each
+// time it is woken.
+#define wait_event(wq, cond)                                                   \
+    do {                                                                       \
+        for (;;) {                                                             \
+            prepare_to_wait(wq);                                               \
+            if (cond)                                                          \
+                break;                                                         \
+            schedule();                                                        \
+        }                                                                      \
+        finish_wait(wq);                                                       \
+    } while (0)
+
+// Wake the first waiter, or all of them. Callable from IRQ context. Return
+// the number of tasks woken.
+int wake_up(wait_queue_t *wq);
+int wake_up_all(wait_queue_t *wq);
+
+// First waiter on wq, or NULL. Only stable while the caller keeps other
+// waiters and wakers of wq out, e.g. under the lock the queue belongs to.
+task_t *wait_queue_first(wait_queue_t *wq);
+
+// Wake the first waiter but leave it queued: if it has to wait again it
+// keeps its place, and it leaves the queue through finish_wait(). For FIFO
+// locks. Returns the number of tasks woken.
+int wake_up_first(wait_queue_t *wq);
+
+// Take task off whatever queue it waits on, without waking it
+void wait_queue_remove(task_t *task);
+
+#endif // ARCLINE_KERNEL_WAIT_H
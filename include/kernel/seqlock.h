@@ -0,0 +1,94 @@
+#ifndef ARCLINE_SEQLOCK_H
+#define ARCLINE_SEQLOCK_H
+
+#include <kernel/spinlock.h>
+#include <stdint.h>
+
+// Sequence counter for read-mostly data. Writers (serialized by their own
+// lock, with IRQs off) bump the count to odd before modifying and back to
+// even afterwards; readers snapshot the count, read without locking and retry
+// if it changed or was odd. Readers must tolerate torn data until validated.
+
+typedef struct {
+    volatile uint32_t sequence;
+} seqcount_t;
+
+#define SEQCNT_ZERO {0}
+
+static inline void seqcount_init(seqcount_t *s) { s->sequence = 0; }
+
+static inline uint32_t read_seqcount_begin(const seqcount_t *s) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+        __asm__ volatile("yield" ::: "memory");
+    return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, uint32_t start) {
+    __asm__ volatile("dmb ishld" ::: "memory");
+    return s->sequence != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s) {
+    s->sequence++;
+    __asm__ volatile("dmb ishst" ::: "memory");
+}
+
+static inline void write_seqcount_end(seqcount_t *s) {
+    __asm__ volatile("dmb ishst" ::: "memory");
+    s->sequence++;
+}
+
+// Sequence lock: a seqcount with the spinlock its writers serialize on.
+// Readers never take the lock and never block writers; they just retry:
+//
+//     do {
+//         seq = read_seqbegin(&sl);
+//         ...copy the data...
+//     } while (read_seqretry(&sl, seq));
+//
+// A reader spins while a write is in progress, so if readers run in IRQ
+// context the writers must use the _irqsave variants.
+
+typedef struct {
+    seqcount_t seqcount;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT {SEQCNT_ZERO, SPINLOCK_INIT}
+
+static inline void seqlock_init(seqlock_t *sl) {
+    seqcount_init(&sl->seqcount);
+    spinlock_init(&sl->lock);
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t *sl) {
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline int read_seqretry(const seqlock_t *sl, uint32_t start) {
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+static inline void write_seqlock(seqlock_t *sl) {
+    spinlock_lock(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+static inline void write_sequnlock(seqlock_t *sl) {
+    write_seqcount_end(&sl->seqcount);
+    spinlock_unlock(&sl->lock);
+}
+
+static inline uint64_t write_seqlock_irqsave(seqlock_t *sl) {
+    uint64_t flags = spinlock_lock_irqsave(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t *sl, uint64_t flags) {
+    write_seqcount_end(&sl->seqcount);
+    spinlock_unlock_irqrestore(&sl->lock, flags);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef ARCLINE_KERNEL_SMP_H
+#define ARCLINE_KERNEL_SMP_H
+
+#include <stdint.h>
+
+// Number of CPUs per-CPU data is sized for. The kernel currently brings up
+// only the boot CPU.
+#ifndef NR_CPUS
+#define NR_CPUS 1
+#endif
+
+// Index of the executing CPU (MPIDR_EL1.Aff0), for per-CPU data. Only stable
+// while the caller cannot migrate, i.e. with IRQs masked.
+static inline unsigned smp_processor_id(void) {
+#if NR_CPUS == 1
+    return 0;
+#else
+    uint64_t mpidr;
+    __asm__ volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return (unsigned)(mpidr & 0xFF);
+#endif
+}
+
+// Mask IRQs on this CPU, returning the previous DAIF for local_irq_restore()
+static inline uint64_t local_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("mrs %0, daif" : "=r"(flags));
+    __asm__ volatile("msr daifset, #2" ::: "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(uint64_t flags) {
+    __asm__ volatile("msr daif, %0" ::"r"(flags) : "memory");
+}
+
+static inline int irqs_disabled(void) {
+    uint64_t flags;
+    __asm__ volatile("mrs %0, daif" : "=r"(flags));
+    return (flags & (1 << 7)) != 0;
+}
+
+#endif // ARCLINE_KERNEL_SMP_H
@@ -3,30 +3,48 @@
 
 #include <stdint.h>
 
+// Queued (MCS) spinlock. An uncontended lock is one exclusive store of 1 to
+// the whole word. Contended lockers queue up in arrival order: each one puts
+// a node on its own stack, swaps itself in as the tail and waits on its
+// node, parked in WFE, until its predecessor passes the head of the queue
+// on. Only the head watches the lock word itself, and the holder's release
+// store is what wakes it. See kernel/spinlock.c.
+
 typedef struct {
-    volatile uint32_t lock;
+    union {
+        volatile uint64_t val;
+        struct {
+            volatile uint32_t locked; // 1 while held
+            volatile uint32_t tail;   // last queued waiter, 0 if none
+        };
+    };
 } spinlock_t;
 
-#define SPINLOCK_INIT {0}
+#define SPINLOCK_INIT {{0}}
+
+void spinlock_lock_slow(spinlock_t *lock);
 
-static inline void spinlock_init(spinlock_t *lock) { lock->lock = 0; }
+static inline void spinlock_init(spinlock_t *lock) { lock->val = 0; }
 
 static inline void spinlock_lock(spinlock_t *lock) {
-    uint32_t tmp;
-    __asm__ volatile("1: ldaxr %w0, [%1]\n"
-                     "   cbnz %w0, 1b\n"
-                     "   stxr %w0, %w2, [%1]\n"
-                     "   cbnz %w0, 1b\n"
-                     : "=&r"(tmp)
-                     : "r"(&lock->lock), "r"(1)
+    uint64_t old;
+    uint32_t fail;
+    // Free and nobody queued: take it. Anything else joins the queue, so a
+    // newcomer cannot overtake the waiters.
+    __asm__ volatile("1: ldaxr %0, [%2]\n"
+                     "   cbnz %0, 2f\n"
+                     "   stxr %w1, %3, [%2]\n"
+                     "   cbnz %w1, 1b\n"
+                     "2:\n"
+                     : "=&r"(old), "=&r"(fail)
+                     : "r"(&lock->val), "r"(1ULL)
                      : "memory");
+    if (old)
+        spinlock_lock_slow(lock);
 }
 
 static inline void spinlock_unlock(spinlock_t *lock) {
-    __asm__ volatile("stlr %w1, [%0]\n"
-                     :
-                     : "r"(&lock->lock), "r"(0)
-                     : "memory");
+    __asm__ volatile("stlr wzr, [%0]\n" : : "r"(&lock->locked) : "memory");
 }
 
 static inline uint64_t spinlock_lock_irqsave(spinlock_t *lock) {
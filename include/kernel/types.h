@@ -5,4 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Callback node for call_rcu() (kernel/rcu.h), embedded in objects that are
+// freed once a grace period has passed
+typedef struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+} rcu_head_t;
+
 #endif // _KERNEL_TYPES_H
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <kernel/types.h>
+
+// LZ4 block format (no frame header): a greedy single-pass compressor with
+// a 4-byte hash of the input, and a bounds-checked decompressor. Output is
+// compatible with the reference LZ4 decoder. Inputs are limited to 64 KiB.
+
+#define LZ4_MAX_INPUT 65536
+#define LZ4_HASH_BITS 12
+// Scratch memory for lz4_compress(): one 16-bit position per hash bucket
+#define LZ4_WRKMEM_SIZE ((1 << LZ4_HASH_BITS) * sizeof(uint16_t))
+
+// Compress n bytes of src into dst (cap bytes). Returns the compressed size,
+// or 0 if it would not fit in cap or n is out of range.
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap,
+                    void *wrkmem);
+
+// Decompress n bytes of src into dst (cap bytes). Returns the decompressed
+// size, or -1 if the input is malformed or does not fit.
+int lz4_decompress(const void *src, size_t n, void *dst, size_t cap);
@@ -0,0 +1,31 @@
+#ifndef ARCLINE_MM_IOREMAP_H
+#define ARCLINE_MM_IOREMAP_H
+
+#include <stdint.h>
+
+// MMIO mappings in their own TTBR1 window, so drivers do not depend on the
+// TTBR0 identity map (which maps everything as Normal memory). Each mapping
+// is preceded by an unmapped guard page.
+#define IOREMAP_START 0xFFFFFF80C0000000ULL
+#define IOREMAP_END 0xFFFFFF8100000000ULL
+
+// Map [pa, pa+size) and return the VA corresponding to pa, or NULL. The
+// range does not need to be page aligned. All mappings are execute-never.
+// May sleep: task context only.
+//
+// ioremap:    Device-nGnRE. Device registers; writes may be acknowledged
+//             early by the interconnect (posted), but never merged.
+// ioremap_nc: Device-nGnRnE. Non-posted: a write completes at the device,
+//             for registers whose side effects must land before the next
+//             access.
+// ioremap_wc: Normal non-cacheable. Writes may be merged and buffered
+//             (write-combining); for framebuffers and rings written in
+//             bulk, never for registers with side effects.
+void *ioremap(uint64_t pa, uint64_t size);
+void *ioremap_nc(uint64_t pa, uint64_t size);
+void *ioremap_wc(uint64_t pa, uint64_t size);
+
+// Tear down the mapping returned by any of the ioremap variants
+void iounmap(void *addr);
+
+#endif // ARCLINE_MM_IOREMAP_H
@@ -0,0 +1,53 @@
+#ifndef ARCLINE_MM_KSM_H
+#define ARCLINE_MM_KSM_H
+
+#include <stdint.h>
+
+// Samepage merging. A scanner walks demand memory marked mergeable, hashes
+// each populated page and looks for another page with the same contents;
+// pages that also compare equal byte-for-byte are remapped onto one
+// read-only frame, shared copy-on-write like vmm_clone() pages. Zero-filled
+// pages are merged into the VMM's shared zero page.
+//
+// Hashes index two tables: stable frames (already shared, never written
+// again) and an unstable table of candidates seen during the current pass,
+// which is emptied at the end of every pass over all mergeable memory.
+
+#define KSM_STABLE_CAP 256   // distinct shared frames
+#define KSM_UNSTABLE_CAP 256 // candidates per pass
+
+typedef struct {
+    uint32_t pages_to_scan; // pages ksmd examines per wakeup
+    uint32_t sleep_ms;      // ksmd sleep between wakeups
+} ksm_config_t;
+
+typedef struct {
+    uint64_t pages_scanned; // populated pages hashed
+    uint64_t pages_merged;  // pages remapped onto a shared frame
+    uint64_t zero_merged;   // of those, onto the zero page
+    uint64_t full_scans;    // passes over all mergeable memory
+    uint64_t pages_shared;  // shared frames in use right now
+    uint64_t pages_sharing; // mappings of them right now
+} ksm_stats_t;
+
+// Allow (or stop) merging of [addr, addr+size), which must be demand memory
+// such as a vmalloc() buffer; see vmm_set_flag(). Pages merged earlier stay
+// shared until written.
+int ksm_madvise(void *addr, uint64_t size, int mergeable);
+
+// Examine up to nr_pages pages from where the last call stopped, in the
+// caller's context. Returns the number of pages merged.
+unsigned ksm_scan(unsigned nr_pages);
+
+// Rate limit for the background scanner; takes effect at its next wakeup
+void ksm_set_config(const ksm_config_t *cfg);
+void ksm_get_config(ksm_config_t *out);
+
+// Start or stop the ksmd task. Returns 0 on success, -4 if the task could
+// not be created.
+int ksm_start(void);
+void ksm_stop(void);
+
+void ksm_get_stats(ksm_stats_t *out);
+
+#endif // ARCLINE_MM_KSM_H
@@ -0,0 +1,66 @@
+#ifndef ARCLINE_MM_LRU_H
+#define ARCLINE_MM_LRU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Page aging and reclaim. Frames of swappable demand memory sit on an active
+// or an inactive list, newest at the head. Aging tests and clears the Access
+// Flag of a page's mapping: a page found young since the last look is
+// rotated back to the head, an old one moves down a list. Reclaim swaps old
+// pages off the inactive tail out to zram (vmm_swap_out()) and frees their
+// frames. kswapd runs reclaim in the background whenever free memory drops
+// below the low watermark, until it is back above the high one.
+//
+// Entries are not removed when a frame is unmapped or freed; a stale entry
+// (the frame is no longer mapped at the recorded address) is dropped the
+// next time aging reaches it.
+
+typedef struct {
+    size_t min;  // reported as critical
+    size_t low;  // kswapd wakes up below this many free pages
+    size_t high; // and reclaims until this many are free
+} lru_watermarks_t;
+
+typedef struct {
+    uint64_t nr_active;    // entries on the active list
+    uint64_t nr_inactive;  // entries on the inactive list
+    uint64_t scanned;      // entries aged
+    uint64_t activated;    // inactive pages found young and promoted
+    uint64_t deactivated;  // active pages found old and demoted
+    uint64_t reclaimed;    // pages swapped out by reclaim
+    uint64_t stale;        // entries dropped as no longer mapped
+    uint64_t kswapd_runs;  // kswapd wakeups that found memory low
+} lru_stats_t;
+
+// Allocate the per-frame table. Call once the PMM is up; until then (or if
+// it fails) lru_add() ignores frames.
+int lru_init(void);
+
+// Put frame, mapped at va, at the head of the active list (moving it there
+// if it is already listed). Called by the VMM under vmm_lock when a page of
+// a VMM_ATTR_SWAPPABLE VMA gets a private frame.
+void lru_add(void *frame, uint64_t va);
+
+// Allow (or stop) reclaim of [addr, addr+size), which must be demand memory
+// such as a vmalloc() buffer; see vmm_set_flag(). Pages already populated
+// join the active list.
+int lru_madvise(void *addr, uint64_t size, int swappable);
+
+// Age up to nr pages from the active tail without reclaiming anything.
+// Returns the number of entries examined.
+unsigned lru_age(unsigned nr);
+
+// Reclaim up to nr pages in the caller's context, aging the active list as
+// needed to keep the inactive one fed. Returns the number of pages freed.
+unsigned lru_shrink(unsigned nr);
+
+void lru_set_watermarks(const lru_watermarks_t *wm);
+void lru_get_watermarks(lru_watermarks_t *out);
+
+// Start the kswapd task. Returns 0 on success, -4 if it could not be created.
+int kswapd_start(void);
+
+void lru_get_stats(lru_stats_t *out);
+
+#endif // ARCLINE_MM_LRU_H
@@ -14,15 +14,26 @@
 #define PTE_ATTR_IDX(x) ((uint64_t)(x) << 2) // MAIR index
 #define PTE_PXN (1ULL << 53)                 // Privileged eXecute-Never
 #define PTE_UXN (1ULL << 54)                 // Unprivileged eXecute-Never
+#define PTE_ADDR_MASK 0x0000FFFFFFFFF000ULL  // output address [47:12]
+
+// Swapped-out page: an invalid L3 descriptor, which the walker ignores,
+// holding the zram entry with the page's contents
+#define PTE_SWAP (1ULL << 1)
+#define PTE_SWAP_SHIFT 12
+#define pte_is_swap(d) (((d) & (PTE_VALID | PTE_SWAP)) == PTE_SWAP)
+#define pte_swap_entry(d) ((uint32_t)((d) >> PTE_SWAP_SHIFT))
+#define pte_mk_swap(e) (((uint64_t)(e) << PTE_SWAP_SHIFT) | PTE_SWAP)
 
 // Memory attribute indices (for MAIR_EL1)
 #define MAIR_DEVICE_nGnRnE 0x00ULL
-#define MAIR_NORMAL_NC 0x44ULL // Normal, non-cacheable
-#define MAIR_NORMAL 0xFFULL    // Normal, write-back cacheable
+#define MAIR_DEVICE_nGnRE 0x04ULL // Device, early write acknowledgement
+#define MAIR_NORMAL_NC 0x44ULL    // Normal, non-cacheable
+#define MAIR_NORMAL 0xFFULL       // Normal, write-back cacheable
 
-#define MAIR_IDX_DEVICE 0
+#define MAIR_IDX_DEVICE 0 // nGnRnE
 #define MAIR_IDX_NORMAL_NC 1
 #define MAIR_IDX_NORMAL 2
+#define MAIR_IDX_DEVICE_nGnRE 3
 
 // Helper to convert PA to higher-half VA
 #define PA_TO_VA(pa) ((pa) + VMM_KERNEL_VIRT_BASE)
@@ -41,6 +52,25 @@ int mmu_map_page(uint64_t *pgd, uint64_t va, uint64_t pa, uint64_t attrs);
 // Enable MMU (called from assembly or C after page tables ready)
 void mmu_enable(void);
 
+// End of the RAM covered by the EARLY_MMU block map in boot.S (must match
+// it). boot.S does not enable the MMU at all if the DTB lies above it.
+#define EARLY_MMU_RAM_END 0x80000000ULL
+
+// Called by the PMM once the RAM range is known, before it writes anything
+// outside the kernel image. If the early MMU is on and RAM ends past
+// EARLY_MMU_RAM_END, turn it off again: early boot runs uncached until
+// mmu_enable() rather than fault on the first frame above the window.
+void mmu_early_map_check(uint64_t ram_end);
+
+// Nonzero if the CPU sets the Access Flag itself (FEAT_HAFDBS, enabled by
+// mmu_enable()). Otherwise an access to a page with AF clear takes an Access
+// flag fault, which vmm_handle_fault() resolves by setting it.
+int mmu_hw_access_flag(void);
+
+// Translate va through the live stage-1 tables with AT S1E1R. Lockless and
+// IRQ-safe; returns 0 and the PA in *pa_out, or -1 if va is not mapped.
+int mmu_translate(uint64_t va, uint64_t *pa_out);
+
 // Switch to higher-half kernel execution
 void mmu_switch_to_higher_half(void);
 
@@ -57,11 +87,48 @@ int mmu_unmap_page(uint64_t *pgd, uint64_t va);
 // Update page permissions
 int mmu_update_page_attrs(uint64_t *pgd, uint64_t va, uint64_t attrs);
 
+// Raw L3 descriptor access, valid or not. mmu_get_pte() returns 0 if no L3
+// table covers va; mmu_set_pte() fails with -1 then (it never allocates).
+uint64_t mmu_get_pte(uint64_t *pgd, uint64_t va);
+int mmu_set_pte(uint64_t *pgd, uint64_t va, uint64_t desc);
+
+// Page aging. mmu_test_and_clear_young() clears AF on the valid L3 entry for
+// va and returns 1 if it was set, 0 if not, -1 if va is not mapped; the
+// caller flushes the TLB entry. mmu_mkyoung() sets AF (0, or -1 if
+// unmapped); an entry without AF is never cached, so no flush is needed.
+int mmu_test_and_clear_young(uint64_t *pgd, uint64_t va);
+int mmu_mkyoung(uint64_t *pgd, uint64_t va);
+
 // TLB maintenance
 void tlb_flush_all(void);
 void tlb_flush_page(uint64_t va);
 void tlb_flush_range(uint64_t va, uint64_t size);
 
+// Batched TLB invalidation (mmu_gather). Unmap paths record the VA ranges
+// they tore down and the frames (data pages and page-table pages) that became
+// unreferenced; a single dsb/tlbi/dsb/isb sequence is issued before any frame
+// is handed back to the PMM. VAs must not be reused until tlb_finish_mmu().
+#define MMU_GATHER_BATCH 64
+
+typedef struct mmu_gather {
+    uint64_t start; // lowest VA unmapped since the last flush
+    uint64_t end;   // one past the highest VA unmapped since the last flush
+    uint32_t nr_pages;
+    void *pages[MMU_GATHER_BATCH]; // frames released after the flush
+} mmu_gather_t;
+
+void tlb_gather_mmu(mmu_gather_t *tlb);
+void tlb_gather_range(mmu_gather_t *tlb, uint64_t va, uint64_t size);
+void tlb_remove_page(mmu_gather_t *tlb, void *page);
+void tlb_flush_mmu(mmu_gather_t *tlb);
+void tlb_finish_mmu(mmu_gather_t *tlb);
+
+// Unmap [va, va+size) without per-page TLB maintenance. The unmapped range
+// and any L3 tables left empty are recorded in the gather and released by
+// tlb_finish_mmu(). Returns the number of pages that were mapped.
+uint64_t mmu_unmap_range(uint64_t *pgd, uint64_t va, uint64_t size,
+                         mmu_gather_t *tlb);
+
 // Cache maintenance
 void cache_flush_range(uint64_t va, uint64_t size);
 void icache_invalidate_range(uint64_t va, uint64_t size);
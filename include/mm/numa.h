@@ -0,0 +1,49 @@
+#ifndef ARCLINE_MM_NUMA_H
+#define ARCLINE_MM_NUMA_H
+
+#include <stdint.h>
+
+// NUMA topology from the device tree: memory blocks (a memory node's reg
+// entries) tagged with their numa-node-id, the node distances from
+// /distance-map, and the node of the boot CPU. Without any of these the
+// machine is one node 0 with local distance everywhere.
+//
+// Every node has a fallback order: the nodes the PMM tries, in turn, when
+// an allocation for that node cannot be satisfied locally. By default it
+// is all nodes sorted by distance (nearest first, ties by node id); it can
+// be overridden per node.
+
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_MEMBLKS 16
+#define NUMA_NO_NODE (-1)
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    int node;
+} numa_memblk_t;
+
+// Parse the DTB. Returns the number of memory blocks found; 0 means the DTB
+// has no memory node and the caller picks the RAM range itself.
+int numa_init(void);
+
+int numa_nr_memblks(void);
+const numa_memblk_t *numa_memblk(int idx);
+
+// Number of nodes (highest node id with memory + 1, at least 1)
+int numa_nr_nodes(void);
+// Node of the running CPU
+int numa_node_id(void);
+int numa_distance(int from, int to);
+
+// Copy node's fallback order (node itself normally first) into
+// order[NUMA_MAX_NODES]. Returns the number of entries, 0 for a bad node.
+int numa_fallback_order(int node, int *order);
+// Replace node's fallback order with the n nodes in order; nodes left out
+// are never used for its allocations. Returns 0, or -1 if node or an entry
+// is out of range or repeated.
+int numa_set_fallback_order(int node, const int *order, int n);
+
+#endif // ARCLINE_MM_NUMA_H
@@ -2,6 +2,7 @@
 #define ARCLINE_MM_PMM_H
 
 #include <kernel/types.h>
+#include <mm/numa.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -9,11 +10,47 @@
 
 void pmm_init_from_dtb(void);
 
+// Allocations come from the running CPU's NUMA node, falling back to other
+// nodes in that node's fallback order (mm/numa.h) when it is exhausted.
 void *pmm_alloc_pages(size_t count);
 void *pmm_alloc_page(void);
+// Same, but starting from node (NUMA_NO_NODE: the running CPU's). Returns
+// NULL if no node in its fallback order has a free run of count frames, or
+// if node does not exist.
+void *pmm_alloc_pages_node(int node, size_t count);
+// Freeing drops one reference per page; a frame returns to the free pool
+// only when its last reference goes. Reserved frames (kernel image, DTB,
+// the refcount table...) are pinned: freeing one is ignored with a warning.
 void pmm_free_pages(void *addr, size_t count);
 void pmm_free_page(void *addr);
 
+// Per-frame reference counts. Allocation hands out frames at refcount 1;
+// pmm_page_get() adds a sharer (e.g. a copy-on-write mapping). Returns 0, or
+// -1 if addr is not an allocated frame or the count would overflow.
+int pmm_page_get(void *addr);
+// Current reference count; 0 for free or reserved frames.
+unsigned pmm_page_refcount(void *addr);
+
+// Frame <-> index in the managed range, for per-frame metadata kept outside
+// the PMM. pmm_page_index() returns (size_t)-1 for an address it does not
+// manage.
+size_t pmm_page_index(void *addr);
+void *pmm_index_to_page(size_t idx);
+
+// Node whose memory holds addr, or NUMA_NO_NODE if the PMM does not manage it
+int pmm_page_node(void *addr);
+
+typedef struct {
+    size_t total;     // frames in the node's memory blocks
+    size_t free;      // of those, free right now
+    uint64_t local;   // allocations that asked for this node and got it
+    uint64_t miss;    // allocations placed here that asked for another node
+    uint64_t foreign; // allocations that asked for this node, placed elsewhere
+} pmm_node_stats_t;
+
+// Returns 0, or -1 if node does not exist or has no memory.
+int pmm_get_node_stats(int node, pmm_node_stats_t *out);
+
 size_t pmm_total_pages(void);
 size_t pmm_free_pages_count(void);
 
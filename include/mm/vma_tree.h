@@ -0,0 +1,69 @@
+#ifndef ARCLINE_MM_VMA_TREE_H
+#define ARCLINE_MM_VMA_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Range B-tree (maple-tree style) indexing non-overlapping [start, end)
+// ranges. Nodes are wide: a lookup scans a few contiguous cache lines of
+// pivots per level instead of chasing one pointer per level, and every
+// internal slot records the largest free gap inside its child so free-range
+// search skips whole subtrees.
+//
+// The tree does no locking. Writers must be serialized by the caller.
+// Readers may run concurrently with a writer if the caller validates what
+// they read (e.g. with a seqcount): nodes are recycled through the tree's own
+// pool and never unmapped, and every reader loop is bounded.
+
+#define VMT_SLOTS 16
+#define VMT_MAX_HEIGHT 8
+
+typedef struct vmt_node {
+    uint64_t pivot[VMT_SLOTS]; // leaf: range start; internal: child min start
+    uint64_t last[VMT_SLOTS];  // leaf: range end; internal: child max end
+    uint64_t gap[VMT_SLOTS];   // internal: largest free gap inside child
+    void *slot[VMT_SLOTS];     // leaf: caller data; internal: child node
+    struct vmt_node *parent;
+    uint8_t count;
+    uint8_t leaf;
+} vmt_node_t;
+
+typedef struct {
+    vmt_node_t *root;
+    vmt_node_t *nodes; // backing array; readers reject pointers outside it
+    size_t nr_nodes;
+    vmt_node_t *free_list; // recycled nodes, linked through parent
+    uint32_t nr_free;
+    uint32_t nr_entries;
+} vma_tree_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    void *data;
+} vmt_entry_t;
+
+// Set up an empty tree drawing nodes from the caller-provided array.
+void vmt_init(vma_tree_t *tree, vmt_node_t *nodes, size_t nr_nodes);
+
+// Writers. Return 0 on success, -1 if the entry does not exist / overlaps,
+// -4 if the node pool cannot absorb the change. Erasing and resizing never
+// allocate; vmt_can_insert() tells whether nr inserts are guaranteed to fit.
+int vmt_can_insert(const vma_tree_t *tree, unsigned nr);
+int vmt_insert(vma_tree_t *tree, uint64_t start, uint64_t end, void *data);
+int vmt_erase(vma_tree_t *tree, uint64_t start);
+int vmt_set_end(vma_tree_t *tree, uint64_t start, uint64_t end);
+
+// Readers. Return 1 and fill *out if an entry was found, 0 otherwise.
+// Last entry with start <= addr
+int vmt_find_le(const vma_tree_t *tree, uint64_t addr, vmt_entry_t *out);
+// First entry with start >= addr
+int vmt_find_ge(const vma_tree_t *tree, uint64_t addr, vmt_entry_t *out);
+
+// Lowest address in [lo, hi) where 'size' bytes fit without touching any
+// range. The result inherits lo's alignment when all ranges share it.
+// Returns 0 and writes *out on success, -1 if no gap is large enough.
+int vmt_find_gap(const vma_tree_t *tree, uint64_t lo, uint64_t hi,
+                 uint64_t size, uint64_t *out);
+
+#endif // ARCLINE_MM_VMA_TREE_H
@@ -1,10 +1,19 @@
 #ifndef ARCLINE_MM_VMALLOC_H
 #define ARCLINE_MM_VMALLOC_H
 
+#include <mm/vmm.h>
 #include <stdint.h>
 
+// Attributes of every vmalloc() VMA
+#define VMALLOC_ATTRS                                                          \
+    (VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_NORMAL | VMM_ATTR_PXN |                \
+     VMM_ATTR_DEMAND)
+
 void *vmalloc(uint64_t size);
 void vfree(void *ptr, uint64_t size);
+// Copy-on-write duplicate of the vmalloc'd buffer src (size bytes, as
+// passed to vmalloc). Free with vfree() like any other allocation.
+void *vclone(const void *src, uint64_t size);
 void vmalloc_stats(void);
 
 #endif // ARCLINE_MM_VMALLOC_H
@@ -4,8 +4,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
-// VMM design choice: RB-tree for VMA management (kernel space for now)
-// Rationale: O(log n) insert/find/remove, good fragmentation control.
+// VMM design choice: range B-tree for VMA management (kernel space for now)
+// Rationale: O(log n) insert/find/remove with wide, cache-friendly nodes, and
+// per-subtree gap tracking for O(log n) free-range search.
 
 // Mapping attributes (subset; extended later when MMU is enabled)
 #define VMM_ATTR_R (1u << 0)
@@ -15,6 +16,26 @@
 #define VMM_ATTR_NORMAL (1u << 4) // Normal memory (cacheable)
 #define VMM_ATTR_UXN (1u << 5)    // Unprivileged eXecute-Never (future)
 #define VMM_ATTR_PXN (1u << 6)    // Privileged eXecute-Never (future)
+// Anonymous memory populated on first touch: vmm_map() only records the
+// VMA (pa is ignored) and the page-fault handler backs each page with a
+// zeroed frame when it is first accessed.
+#define VMM_ATTR_DEMAND (1u << 7)
+// Normal non-cacheable memory: writes may be merged and buffered
+// (write-combining), for framebuffers and DMA rings
+#define VMM_ATTR_WC (1u << 8)
+// With VMM_ATTR_DEVICE: Device-nGnRnE, every write acknowledged by the device
+#define VMM_ATTR_NP (1u << 9)
+// Demand memory the samepage scanner (mm/ksm.c) may merge with identical
+// pages elsewhere; see ksm_madvise()
+#define VMM_ATTR_MERGEABLE (1u << 10)
+// Demand memory whose pages page reclaim (mm/lru.c) may swap out under
+// memory pressure; see lru_madvise()
+#define VMM_ATTR_SWAPPABLE (1u << 11)
+
+// Fault flags for vmm_handle_fault()
+#define VMM_FAULT_WRITE (1u << 0)
+#define VMM_FAULT_PRESENT (1u << 1) // permission fault on a mapped page
+#define VMM_FAULT_ACCESS (1u << 2)  // Access flag fault on an aged page
 
 // Minimal VMM scaffolding (Stage 0): identity helpers
 
@@ -27,15 +48,124 @@ void vmm_init_identity(void);
 int vmm_init(
     void); // create kernel page tables and VMA tree (MMU kept off for now)
 int vmm_map(uint64_t va, uint64_t pa, uint64_t size, uint32_t attrs);
+// Unmapping a VMM_ATTR_DEMAND range also releases the frames and zram
+// entries behind it; other mappings leave their frames to the caller.
 int vmm_unmap(uint64_t va, uint64_t size);
+// Like vmm_unmap() but defers TLB invalidation, and the release of demand
+// frames, to tlb_finish_mmu(&tlb).
+struct mmu_gather;
+int vmm_unmap_gather(uint64_t va, uint64_t size, struct mmu_gather *tlb);
 int vmm_protect(uint64_t va, uint64_t size, uint32_t attrs);
+// Set (or clear) flag, such as VMM_ATTR_SWAPPABLE, on every VMA in
+// [va, va+size), splitting those that straddle the ends and leaving their
+// other attributes alone. The range must be demand memory. Returns 0, -1 if
+// size is 0 or part of the range is not demand memory, -2 if it is not page
+// aligned, -3 if it has a hole, -4 if the VMA pool or index is full.
+int vmm_set_flag(uint64_t va, uint64_t size, uint32_t flag, int set);
 void vmm_dump(void); // debug helper
 
-// Translate virtual to physical under identity-mapping assumption.
-// Returns 0 on success and writes to *pa_out.
-// For now, success is unconditional and pa = va.
+// Resolve a fault at va in a VMM_ATTR_DEMAND VMA: a translation fault
+// populates the page, a write permission fault (VMM_FAULT_PRESENT) breaks
+// copy-on-write sharing, an Access flag fault (VMM_FAULT_ACCESS) marks the
+// page young again. Returns 0 if the access can be retried, -1 if va is
+// not demand-paged memory (or the access is not permitted), -4 if out of
+// memory.
+int vmm_handle_fault(uint64_t va, uint32_t flags);
+
+// Copy-on-write clone of the demand-paged range [src, src+size) to dst,
+// which must be free VA. Populated frames are shared read-only by both
+// ranges and only copied when one side writes to them, so the cost is one
+// page-table update per populated page rather than a data copy; pages
+// never touched stay unpopulated in both. The new VMAs inherit the source
+// attributes. Returns 0 on success, -1 if the source is not demand-paged,
+// -2 if misaligned, -3 if the source is not fully mapped or dst is in use,
+// -4 if out of memory (dst may then be partially set up; unmap it).
+int vmm_clone(uint64_t src, uint64_t dst, uint64_t size);
+
+// Populate [va, va+size) of a demand VMA up front with writable frames,
+// e.g. memory that is sure to be written right away. Returns 0 on success
+// or vmm_handle_fault()'s error.
+int vmm_populate(uint64_t va, uint64_t size);
+
+// Map frame (zeroed, refcount 1) at the unpopulated page va of a demand VMA
+// with attrs, taking no lock and allocating nothing. Only for a caller that
+// owns the range outright and may hold vmm_lock or pmm_lock, i.e. a task
+// faulting on its own stack. The frame is released by vmm_unmap() like any
+// populated page. Returns -1 if the page is populated or no L3 table
+// covers it.
+int vmm_install_page(uint64_t va, void *frame, uint32_t attrs);
+
+// Swap the populated pages of [va, va+size) that belong to demand VMAs out
+// to the compressed store (mm/zram.c) and free their frames. Shared frames
+// and incompressible pages stay resident. The next access faults the page
+// back in. Returns the number of pages swapped out, a negative range error,
+// or -4 if zram was full before any page was stored.
+int vmm_swap_out(uint64_t va, uint64_t size);
+
+// Page aging and reclaim primitives for mm/lru.c. Both check under vmm_lock
+// that va lies in a VMM_ATTR_SWAPPABLE demand VMA and is still backed by
+// frame, and return -1 if not (the LRU entry is stale).
+// vmm_page_young() clears the page's Access Flag and returns 1 if it was
+// set (the page was used since the last call), 0 if not.
+// vmm_reclaim_page() swaps the page out like vmm_swap_out() and returns 0,
+// 1 if it has to stay resident (shared or incompressible), -4 if zram is
+// full.
+int vmm_page_young(uint64_t va, void *frame);
+int vmm_reclaim_page(uint64_t va, void *frame);
+
+// Shared zero page accounting. A read fault on an untouched demand page maps
+// one global zero frame read-only instead of allocating; the first write
+// replaces it with a private zeroed frame.
+typedef struct {
+    uint64_t read_faults; // read faults served by the zero page
+    uint64_t upgrades;    // of those, later written (got a private frame)
+    uint64_t mapped;      // zero-page mappings right now (frames saved)
+} vmm_zero_stats_t;
+
+void vmm_zero_page_stats(vmm_zero_stats_t *out);
+
+// Samepage merging primitive for mm/ksm.c. Under vmm_lock: checks that va
+// lies in a VMM_ATTR_MERGEABLE demand VMA and is still backed by pa,
+// write-protects it, compares it byte-for-byte with target (NULL means the
+// shared zero page) and, if equal, remaps va read-only onto target, which
+// gains a reference, and drops the old frame. target == the page's own frame
+// only write-protects it and takes a reference for the caller, which starts a
+// new shared frame. Returns 0 if merged, 1 if the page changed or differs (it
+// keeps its frame), -1 if va is not mergeable, -4 if out of memory.
+int vmm_ksm_merge(uint64_t va, uint64_t pa, void *target);
+
+// Snapshot of one VMA, as returned by the lockless lookup helpers. pa is
+// meaningless (0) for VMM_ATTR_DEMAND VMAs.
+typedef struct {
+    uint64_t va;
+    uint64_t pa;
+    uint64_t size;
+    uint32_t attrs;
+} vmm_area_t;
+
+// Find the VMA covering va without taking vmm_lock (seqcount-validated).
+// Returns 0 and fills *out on success, -1 if no VMA covers va.
+int vmm_find_area(uint64_t va, vmm_area_t *out);
+
+// Like vmm_find_area(), but if no VMA covers va return the first one above
+// it, for walking the VMAs in VA order. Returns -1 if there is none.
+int vmm_find_next_area(uint64_t va, vmm_area_t *out);
+
+// Lowest page-aligned va in [lo, hi) with size bytes free of VMAs, found
+// without taking vmm_lock. The result is only a hint: a concurrent vmm_map
+// may claim it first, in which case mapping it fails with -3.
+// Returns 0 and writes *va_out on success, -1 if no gap fits.
+int vmm_find_gap(uint64_t lo, uint64_t hi, uint64_t size, uint64_t *va_out);
+
+// Translate virtual to physical via the VMA tree, falling back to the page
+// tables for regions the VMM does not track (kernel image, linear map).
+// Returns 0 on success and writes to *pa_out, -1 if va is unmapped.
 int vmm_virt_to_phys(uint64_t va, uint64_t *pa_out);
 
+// Lockless translation through the hardware walker (AT S1E1R). Safe from IRQ
+// context; returns 0 on success, -1 if va is unmapped.
+int vmm_translate(uint64_t va, uint64_t *pa_out);
+
 // Translate physical to virtual under identity-mapping assumption.
 static inline uint64_t vmm_phys_to_virt(uint64_t pa) { return pa; }
 
@@ -0,0 +1,33 @@
+#ifndef ARCLINE_MM_ZRAM_H
+#define ARCLINE_MM_ZRAM_H
+
+#include <stdint.h>
+
+// Compressed in-RAM page store, the backing store for swapped-out anonymous
+// pages. Pages are LZ4-compressed into zsmalloc objects; pages filled with
+// one repeated 64-bit word (mostly zeroes) are recorded as that word and
+// take no memory. Pages that would not shrink to ZRAM_MAX_COMPRESSED bytes
+// are refused: storing them would save nothing.
+
+#define ZRAM_MAX_ENTRIES 4096
+#define ZRAM_MAX_COMPRESSED 3072
+
+typedef struct {
+    uint64_t stored;      // pages held right now
+    uint64_t same_filled; // of those, kept as a repeated word
+    uint64_t compr_bytes; // compressed bytes held
+    uint64_t pool_pages;  // frames backing the compressed objects
+    uint64_t stores;      // pages accepted since boot
+    uint64_t loads;       // pages read back since boot
+    uint64_t rejected;    // pages refused as incompressible
+} zram_stats_t;
+
+// Store a copy of page. Returns 0 and a nonzero entry id in *entry, 1 if the
+// page is incompressible, -4 if the store is full or out of memory.
+int zram_store(const void *page, uint32_t *entry);
+// Decompress entry into page. Returns 0, or -1 for a bad entry.
+int zram_load(uint32_t entry, void *page);
+void zram_free(uint32_t entry);
+void zram_get_stats(zram_stats_t *out);
+
+#endif // ARCLINE_MM_ZRAM_H
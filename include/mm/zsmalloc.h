@@ -0,0 +1,32 @@
+#ifndef ARCLINE_MM_ZSMALLOC_H
+#define ARCLINE_MM_ZSMALLOC_H
+
+#include <stdint.h>
+
+// Size-class allocator for small variable-sized objects (compressed pages).
+// Sizes are rounded up to ZS_ALIGN and each class carves fixed-size slots
+// out of "zspages": runs of 1-ZS_MAX_ZSPAGE_PAGES contiguous PMM frames,
+// sized per class to waste as little of the run as possible. Objects are
+// named by 32-bit handles rather than pointers; 0 is never a valid handle.
+
+#define ZS_ALIGN 32
+#define ZS_MAX_SIZE 4096
+#define ZS_MAX_ZSPAGE_PAGES 4
+#define ZS_MAX_ZSPAGES 1024
+
+typedef struct {
+    uint64_t objects;    // live objects
+    uint64_t zspages;    // zspages in use
+    uint64_t pages;      // PMM frames backing them
+    uint64_t used_bytes; // slot bytes handed out
+} zs_stats_t;
+
+// Returns a handle for an object of size bytes (1..ZS_MAX_SIZE), or 0 if
+// out of memory. Not thread-safe: callers serialize.
+uint32_t zs_malloc(uint32_t size);
+void zs_free(uint32_t handle);
+// Address of the object; valid until it is freed
+void *zs_map(uint32_t handle);
+void zs_get_stats(zs_stats_t *out);
+
+#endif // ARCLINE_MM_ZSMALLOC_H
@@ -0,0 +1,8 @@
+#ifndef ARCLINE_TEST_BENCH_SPINLOCK_H
+#define ARCLINE_TEST_BENCH_SPINLOCK_H
+
+// Spinlock microbenchmark (queued lock vs. test-and-set), reported via
+// printk. Creates tasks: call from the idle task with the scheduler running.
+void run_spinlock_benchmark(void);
+
+#endif // ARCLINE_TEST_BENCH_SPINLOCK_H
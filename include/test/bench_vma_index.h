@@ -0,0 +1,8 @@
+#ifndef ARCLINE_TEST_BENCH_VMA_INDEX_H
+#define ARCLINE_TEST_BENCH_VMA_INDEX_H
+
+// VMA index microbenchmark (range B-tree vs. RB-tree), reported via printk.
+// Returns -1 if the trees disagree or the B-tree misses a sanity bound.
+int run_vma_index_benchmark(void);
+
+#endif // ARCLINE_TEST_BENCH_VMA_INDEX_H
@@ -6,6 +6,16 @@ void test_timer_preemption(void);
 void test_task_termination(void);
 void test_killing_current_task(void);
 void test_stress(void);
+void test_stack_recycling(void);
+void test_many_tasks(void);
+void test_eevdf_latency(void);
+void test_nice_shares(void);
+void test_slice_timer(void);
+void test_nohz_idle(void);
+void test_wait_queues(void);
+void test_mutex(void);
+void test_rwlock_seqlock(void);
+void test_rcu(void);
 
 // Main test runner
 void run_scheduler_integration_tests(void);
@@ -6,7 +6,9 @@
 #include <kernel/irq.h>
 #include <kernel/panic.h>
 #include <kernel/printk.h>
+#include <kernel/rcu.h>
 #include <kernel/sched/task.h>
+#include <mm/lru.h>
 #include <mm/mmu.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
@@ -17,8 +19,12 @@
 #ifdef RUN_INTEGRATION_TESTS
 #include <test/test_scheduler_integration.h>
 #include <test/test_memory_integration.h>
+#include <test/bench_spinlock.h>
+#include <test/bench_vma_index.h>
 #endif
 
+extern uint64_t boot_cntpct; // boot.S: counter at _start
+
 void kmain(void) {
     serial_init();
     printk_init();
@@ -43,12 +49,12 @@ void kmain(void) {
     }
     printk("PMM: consistency check OK\n");
 
-    // Initialize VMM structures (RB-tree VMAs)
+    // Initialize VMM structures (range B-tree VMA index)
     vmm_init_identity();
     if (vmm_init() != 0) {
         panic("VMM initialization failed");
     }
-    printk("VMM: initialized RB-tree manager\n");
+    printk("VMM: initialized B-tree VMA manager\n");
 
     // Initialize and enable MMU
     mmu_init();
@@ -63,21 +69,49 @@ void kmain(void) {
                (int)(mem_size / (1024 * 1024)));
     }
 
+    // Vectors go in before anything can touch demand-paged memory
+    exception_init();
+
+    if (lru_init() != 0) {
+        printk("LRU: no memory for the page lists, reclaim disabled\n");
+    }
+
+    // Drivers reach MMIO through device mappings from here on
+    serial_remap();
+
     // Run memory tests
 #ifdef RUN_INTEGRATION_TESTS
     if (run_memory_integration_tests() != 0) {
         panic("Memory integration test failed");
     }
+    if (run_vma_index_benchmark() != 0) {
+        panic("VMA index benchmark failed");
+    }
 #endif
 
     // Initialize interrupt subsystem
-    exception_init();
     irq_init();
     gic_init();
     timer_init(100);
 
     vmm_dump();
     task_init();
+    if (rcu_init() != 0) {
+        printk("RCU: failed to start callback kthread\n");
+    }
+    if (kswapd_start() != 0) {
+        printk("LRU: failed to start kswapd\n");
+    }
+
+#ifdef EARLY_MMU
+    const char *early_mmu = "on";
+#else
+    const char *early_mmu = "off";
+#endif
+    printk("\nBOOT: kmain init took %llu us (early MMU %s)\n",
+           (unsigned long long)((read_cntpct() - boot_cntpct) * 1000000ULL /
+                                read_cntfrq()),
+           early_mmu);
 
     printk("\nIRQ: enabling interrupts...\n");
     __asm__ volatile("msr daifclr, #2" ::: "memory");
@@ -86,12 +120,11 @@ void kmain(void) {
     // Run integration tests
     printk("\nRunning scheduler integration tests...\n");
     run_scheduler_integration_tests();
+    run_spinlock_benchmark();
     printk("\nIntegration tests completed. System will now idle.\n");
     __asm__ volatile("msr daifclr, #2" ::: "memory");
 #endif
 
-    // Loop forever
-    while (1) {
-        __asm__ volatile("wfe");
-    }
+    // Become the idle task
+    cpu_idle();
 }
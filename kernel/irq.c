@@ -1,4 +1,5 @@
 #include <kernel/irq.h>
+#include <kernel/seqlock.h>
 #include <string.h>
 
 #include "drivers/gic.h"
@@ -9,34 +10,49 @@ typedef struct {
 } irq_desc_t;
 
 static irq_desc_t irq_table[MAX_IRQS];
+// Dispatch reads a handler and its dev as a pair without locking; changes
+// to the table are rare
+static seqlock_t irq_table_lock = SEQLOCK_INIT;
 
 void irq_init(void) { memset(irq_table, 0, sizeof(irq_table)); }
 
 int irq_install_handler(int irq, irq_handler_t handler, void *dev) {
     if (irq < 0 || irq >= MAX_IRQS || !handler)
         return -1;
-    if (irq_table[irq].handler)
-        return -2;
 
+    uint64_t flags = write_seqlock_irqsave(&irq_table_lock);
+    if (irq_table[irq].handler) {
+        write_sequnlock_irqrestore(&irq_table_lock, flags);
+        return -2;
+    }
     irq_table[irq].handler = handler;
     irq_table[irq].dev = dev;
+    write_sequnlock_irqrestore(&irq_table_lock, flags);
     return 0;
 }
 
 void irq_uninstall_handler(int irq) {
     if (irq < 0 || irq >= MAX_IRQS)
         return;
+    uint64_t flags = write_seqlock_irqsave(&irq_table_lock);
     irq_table[irq].handler = NULL;
     irq_table[irq].dev = NULL;
+    write_sequnlock_irqrestore(&irq_table_lock, flags);
 }
 
 void irq_dispatch(cpu_context_t *ctx, int irq) {
     if (irq < 0 || irq >= MAX_IRQS)
         return;
 
-    if (irq_table[irq].handler) {
-        irq_table[irq].handler(ctx, irq, irq_table[irq].dev);
-    }
+    irq_desc_t desc;
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&irq_table_lock);
+        desc = irq_table[irq];
+    } while (read_seqretry(&irq_table_lock, seq));
+
+    if (desc.handler)
+        desc.handler(ctx, irq, desc.dev);
 }
 
 void irq_enable(int irq) { gic_enable_irq(irq); }
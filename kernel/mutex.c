@@ -0,0 +1,158 @@
+// Sleeping mutex
+//
+// The owner word holds the owning task and two flags. The uncontended lock
+// and unlock are a single compare-and-swap on it; everything else happens
+// under wait_lock, which orders waiters setting MUTEX_FLAG_WAITERS against
+// an unlock that finds the flag and wakes the first of them. A woken waiter
+// stays at the head of the queue until it gets the mutex.
+
+#include <kernel/mutex.h>
+#include <kernel/panic.h>
+#include <kernel/rcu.h>
+#include <kernel/sched/task.h>
+
+#define MUTEX_FLAG_WAITERS 1ULL // tasks are queued: unlock goes the slow way
+#define MUTEX_FLAG_HANDOFF 2ULL // first waiter was starved: hand it over
+#define MUTEX_FLAGS 7ULL
+// Owner recorded before the scheduler is up, when there is no task yet
+#define MUTEX_OWNER_BOOT (~MUTEX_FLAGS)
+// Polls of a running owner before giving up and queueing anyway
+#define MUTEX_SPIN_MAX 1000
+
+static inline uint64_t owner_of(uint64_t v) { return v & ~MUTEX_FLAGS; }
+
+static uint64_t mutex_self(void) {
+    task_t *task = task_current();
+    return task ? (uint64_t)task : MUTEX_OWNER_BOOT;
+}
+
+// Take the mutex if nobody holds it. With a handoff pending it is reserved
+// for the first waiter.
+static int mutex_try_acquire(mutex_t *m, uint64_t self, int first) {
+    uint64_t old = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+    for (;;) {
+        if (owner_of(old))
+            return 0;
+        if ((old & MUTEX_FLAG_HANDOFF) && !first)
+            return 0;
+        uint64_t new = self | (old & MUTEX_FLAG_WAITERS);
+        if (__atomic_compare_exchange_n(&m->owner, &old, new, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+}
+
+// An owner that is on a CPU is about to release; one that is preempted or
+// asleep may take any time. The only running task on a single CPU is the
+// caller itself, so there this never spins.
+static int owner_on_cpu(uint64_t owner) {
+    task_t *task = (task_t *)owner;
+    return owner != MUTEX_OWNER_BOOT && task != task_current() &&
+           task->state == TASK_RUNNING;
+}
+
+static int mutex_optimistic_spin(mutex_t *m, uint64_t self) {
+    // The owner may release, exit and be reaped while we look at it; the
+    // read-side section keeps its task_t from being freed meanwhile
+    int ret = 0;
+    rcu_read_lock();
+    for (int i = 0; i < MUTEX_SPIN_MAX; i++) {
+        uint64_t old = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        if (old & MUTEX_FLAG_HANDOFF)
+            break; // a starved waiter goes first
+        if (!owner_of(old)) {
+            if (mutex_try_acquire(m, self, 0)) {
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+        if (!owner_on_cpu(owner_of(old)))
+            break;
+        __asm__ volatile("yield" ::: "memory");
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static void mutex_lock_slow(mutex_t *m, uint64_t self) {
+    task_t *task = (task_t *)self;
+    int woken = 0;
+    uint64_t flags = spinlock_lock_irqsave(&m->wait_lock);
+    for (;;) {
+        prepare_to_wait(&m->wait);
+        // From here on an unlock sees the flag and wakes the head
+        __atomic_fetch_or(&m->owner, MUTEX_FLAG_WAITERS, __ATOMIC_RELAXED);
+        int first = wait_queue_first(&m->wait) == task;
+        if (mutex_try_acquire(m, self, first))
+            break;
+        // Woken and beaten to it again: have the next unlock hand over
+        if (woken && first)
+            __atomic_fetch_or(&m->owner, MUTEX_FLAG_HANDOFF,
+                              __ATOMIC_RELAXED);
+        spinlock_unlock_irqrestore(&m->wait_lock, flags);
+
+        schedule();
+        woken = 1;
+
+        flags = spinlock_lock_irqsave(&m->wait_lock);
+        if (owner_of(__atomic_load_n(&m->owner, __ATOMIC_ACQUIRE)) == self)
+            break; // handed over
+    }
+    finish_wait(&m->wait);
+    if (!wait_queue_first(&m->wait))
+        __atomic_fetch_and(&m->owner, ~MUTEX_FLAGS, __ATOMIC_RELAXED);
+    spinlock_unlock_irqrestore(&m->wait_lock, flags);
+}
+
+void mutex_init(mutex_t *m) {
+    m->owner = 0;
+    spinlock_init(&m->wait_lock);
+    wait_queue_init(&m->wait);
+}
+
+void mutex_lock(mutex_t *m) {
+    uint64_t self = mutex_self();
+    if (mutex_try_acquire(m, self, 0))
+        return;
+    if (self == MUTEX_OWNER_BOOT)
+        panic("mutex: %p held before the scheduler is up", m);
+    if (owner_of(m->owner) == self)
+        panic("mutex: %p locked twice by PID %d", m, ((task_t *)self)->pid);
+    if (mutex_optimistic_spin(m, self))
+        return;
+    mutex_lock_slow(m, self);
+}
+
+int mutex_trylock(mutex_t *m) {
+    return mutex_try_acquire(m, mutex_self(), 0) ? 0 : -1;
+}
+
+void mutex_unlock(mutex_t *m) {
+    uint64_t self = mutex_self();
+    uint64_t old = self;
+    if (__atomic_compare_exchange_n(&m->owner, &old, 0, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED))
+        return;
+    if (owner_of(old) != self)
+        panic("mutex: %p unlocked by a task that does not hold it", m);
+
+    // Waiters queued. Nobody else can change the owner word while we hold
+    // the mutex and wait_lock, so plain stores do.
+    uint64_t flags = spinlock_lock_irqsave(&m->wait_lock);
+    task_t *first = wait_queue_first(&m->wait);
+    old = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+    if (first && (old & MUTEX_FLAG_HANDOFF))
+        __atomic_store_n(&m->owner, (uint64_t)first | MUTEX_FLAG_WAITERS,
+                         __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&m->owner, first ? MUTEX_FLAG_WAITERS : 0,
+                         __ATOMIC_RELEASE);
+    if (first)
+        wake_up_first(&m->wait);
+    spinlock_unlock_irqrestore(&m->wait_lock, flags);
+}
+
+int mutex_is_locked(mutex_t *m) {
+    return owner_of(__atomic_load_n(&m->owner, __ATOMIC_RELAXED)) != 0;
+}
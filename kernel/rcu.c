@@ -0,0 +1,248 @@
+// Preemptible RCU for a single CPU
+//
+// A grace period needs two things: a quiescent state of the CPU after the
+// period began, and the exit of every reader that was preempted inside its
+// read-side section before the CPU got there. Readers that are switched out
+// inside a section go on blkd_tasks; when a grace period starts, every task
+// already on the list holds it up, as does one that is switched out while
+// the CPU still owes its quiescent state. Readers preempted later started
+// after that quiescent state and cannot see anything the period protects.
+//
+// Callbacks move from next_cbs (queued, no grace period covers them yet) to
+// wait_cbs (waiting for the current one) to done_cbs (ready), which the
+// kthread drains. All state is behind rcu_lock with IRQs masked: it is
+// updated from the scheduler and the timer IRQ as well as from tasks.
+
+#include <kernel/rcu.h>
+#include <kernel/sched/completion.h>
+#include <kernel/sched/wait.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <stddef.h>
+
+typedef struct {
+    rcu_head_t *head;
+    rcu_head_t **tail;
+} rcu_cblist_t;
+
+static spinlock_t rcu_lock = SPINLOCK_INIT;
+static int gp_active;
+static int qs_pending;   // CPU has not passed a quiescent state this period
+static int gp_blockers;  // blocked readers holding up this period
+static int in_idle;      // in the idle loop's WFI: an extended quiescent state
+static task_t *blkd_tasks;
+static rcu_cblist_t next_cbs = {NULL, &next_cbs.head};
+static rcu_cblist_t wait_cbs = {NULL, &wait_cbs.head};
+static rcu_cblist_t done_cbs = {NULL, &done_cbs.head};
+static rcu_stats_t stats;
+
+static wait_queue_t rcu_wq = WAIT_QUEUE_INIT;
+static task_t *rcu_task;
+
+// Append src to dst and empty src
+static void cblist_splice(rcu_cblist_t *dst, rcu_cblist_t *src) {
+    if (!src->head)
+        return;
+    *dst->tail = src->head;
+    dst->tail = src->tail;
+    src->head = NULL;
+    src->tail = &src->head;
+}
+
+// End the current grace period if nothing holds it up any more, and start
+// the next one if callbacks are waiting for it. rcu_lock held. Returns 1 if
+// callbacks became ready and the kthread needs a wakeup.
+static int rcu_advance(void) {
+    int ready = 0;
+    for (;;) {
+        if (gp_active) {
+            if (qs_pending || gp_blockers)
+                return ready;
+            gp_active = 0;
+            stats.gp_completed++;
+            if (wait_cbs.head) {
+                cblist_splice(&done_cbs, &wait_cbs);
+                ready = 1;
+            }
+        }
+        if (!next_cbs.head)
+            return ready;
+
+        cblist_splice(&wait_cbs, &next_cbs);
+        gp_active = 1;
+        // Nothing runs on an idle CPU, so it owes no quiescent state
+        qs_pending = !in_idle;
+        gp_blockers = 0;
+        for (task_t *t = blkd_tasks; t; t = t->rcu_next) {
+            t->rcu_blocks_gp = 1;
+            gp_blockers++;
+        }
+    }
+}
+
+static void rcu_qs(void) {
+    qs_pending = 0;
+}
+
+// Take task off blkd_tasks. rcu_lock held.
+static void rcu_unblock(task_t *task) {
+    task_t **link = &blkd_tasks;
+    while (*link && *link != task)
+        link = &(*link)->rcu_next;
+    if (*link)
+        *link = task->rcu_next;
+    task->rcu_next = NULL;
+    task->rcu_blocked = 0;
+    if (task->rcu_blocks_gp) {
+        task->rcu_blocks_gp = 0;
+        gp_blockers--;
+    }
+}
+
+void rcu_read_unlock_special(task_t *task) {
+    uint64_t flags = spinlock_lock_irqsave(&rcu_lock);
+    int wake = 0;
+    if (task->rcu_blocked) {
+        rcu_unblock(task);
+        wake = rcu_advance();
+    }
+    spinlock_unlock_irqrestore(&rcu_lock, flags);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+void rcu_task_dead(task_t *task) {
+    uint64_t flags = spinlock_lock_irqsave(&rcu_lock);
+    int wake = 0;
+    task->rcu_nesting = 0;
+    if (task->rcu_blocked) {
+        rcu_unblock(task);
+        wake = rcu_advance();
+    }
+    spinlock_unlock_irqrestore(&rcu_lock, flags);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+void rcu_note_context_switch(task_t *prev) {
+    spinlock_lock(&rcu_lock);
+    if (prev && prev->rcu_nesting > 0 && !prev->rcu_blocked) {
+        prev->rcu_blocked = 1;
+        prev->rcu_next = blkd_tasks;
+        blkd_tasks = prev;
+        stats.readers_blocked++;
+        if (gp_active && qs_pending) {
+            prev->rcu_blocks_gp = 1;
+            gp_blockers++;
+        }
+    }
+    rcu_qs();
+    int wake = rcu_advance();
+    spinlock_unlock(&rcu_lock);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+void rcu_sched_clock_irq(task_t *curr) {
+    // Interrupting a reader proves nothing
+    if (curr && curr->rcu_nesting > 0)
+        return;
+    spinlock_lock(&rcu_lock);
+    int wake = 0;
+    if (gp_active && qs_pending) {
+        rcu_qs();
+        wake = rcu_advance();
+    }
+    spinlock_unlock(&rcu_lock);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+void rcu_idle_enter(void) {
+    spinlock_lock(&rcu_lock);
+    in_idle = 1;
+    rcu_qs();
+    int wake = rcu_advance();
+    spinlock_unlock(&rcu_lock);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+void rcu_idle_exit(void) {
+    spinlock_lock(&rcu_lock);
+    in_idle = 0;
+    spinlock_unlock(&rcu_lock);
+}
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head)) {
+    head->func = func;
+    head->next = NULL;
+    uint64_t flags = spinlock_lock_irqsave(&rcu_lock);
+    *next_cbs.tail = head;
+    next_cbs.tail = &head->next;
+    int wake = rcu_advance();
+    spinlock_unlock_irqrestore(&rcu_lock, flags);
+    if (wake)
+        wake_up(&rcu_wq);
+}
+
+typedef struct {
+    rcu_head_t head; // first, so the callback can cast back
+    completion_t done;
+} rcu_synchronize_t;
+
+static void wakeme_after_rcu(rcu_head_t *head) {
+    complete(&((rcu_synchronize_t *)head)->done);
+}
+
+void synchronize_rcu(void) {
+    // Before the scheduler runs there are no readers to wait for
+    if (!task_current())
+        return;
+    rcu_synchronize_t rs;
+    init_completion(&rs.done);
+    call_rcu(&rs.head, wakeme_after_rcu);
+    wait_for_completion(&rs.done);
+}
+
+static void rcu_kthread_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    for (;;) {
+        wait_event(&rcu_wq, __atomic_load_n(&done_cbs.head, __ATOMIC_RELAXED));
+
+        uint64_t flags = spinlock_lock_irqsave(&rcu_lock);
+        rcu_head_t *list = done_cbs.head;
+        done_cbs.head = NULL;
+        done_cbs.tail = &done_cbs.head;
+        spinlock_unlock_irqrestore(&rcu_lock, flags);
+
+        uint64_t n = 0;
+        while (list) {
+            rcu_head_t *next = list->next;
+            list->func(list);
+            list = next;
+            n++;
+        }
+
+        flags = spinlock_lock_irqsave(&rcu_lock);
+        stats.cbs_invoked += n;
+        spinlock_unlock_irqrestore(&rcu_lock, flags);
+    }
+}
+
+int rcu_init(void) {
+    if (rcu_task)
+        return 0;
+    rcu_task = task_create(rcu_kthread_entry, 0, NULL);
+    if (!rcu_task)
+        return -4;
+    return 0;
+}
+
+void rcu_get_stats(rcu_stats_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&rcu_lock);
+    *out = stats;
+    spinlock_unlock_irqrestore(&rcu_lock, flags);
+}
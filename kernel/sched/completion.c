@@ -0,0 +1,42 @@
+#include <kernel/sched/completion.h>
+
+// done saturates here on complete_all(): every wait passes from then on
+#define COMPLETION_ALL UINT32_MAX
+
+void init_completion(completion_t *c) {
+    c->done = 0;
+    wait_queue_init(&c->wait);
+}
+
+void wait_for_completion(completion_t *c) {
+    for (;;) {
+        prepare_to_wait(&c->wait);
+        // The count is taken under the queue lock, so two waiters cannot
+        // both consume one complete()
+        uint64_t flags = spinlock_lock_irqsave(&c->wait.lock);
+        if (c->done) {
+            if (c->done != COMPLETION_ALL)
+                c->done--;
+            spinlock_unlock_irqrestore(&c->wait.lock, flags);
+            break;
+        }
+        spinlock_unlock_irqrestore(&c->wait.lock, flags);
+        schedule();
+    }
+    finish_wait(&c->wait);
+}
+
+void complete(completion_t *c) {
+    uint64_t flags = spinlock_lock_irqsave(&c->wait.lock);
+    if (c->done != COMPLETION_ALL)
+        c->done++;
+    spinlock_unlock_irqrestore(&c->wait.lock, flags);
+    wake_up(&c->wait);
+}
+
+void complete_all(completion_t *c) {
+    uint64_t flags = spinlock_lock_irqsave(&c->wait.lock);
+    c->done = COMPLETION_ALL;
+    spinlock_unlock_irqrestore(&c->wait.lock, flags);
+    wake_up_all(&c->wait);
+}
@@ -22,34 +22,30 @@ const uint32_t eevdf_nice_to_wmult[40] = {
 };
 
 static eevdf_rq_t runqueue;
-static eevdf_rb_node_t node_pool[64];
-static uint64_t node_bitmap[2];
-
-static eevdf_rb_node_t *alloc_node(void) {
-    for (int i = 0; i < 64; i++) {
-        int word = i / 64;
-        int bit = i % 64;
-        if (!(node_bitmap[word] & (1ULL << bit))) {
-            node_bitmap[word] |= (1ULL << bit);
-            return &node_pool[i];
-        }
-    }
-    return NULL;
+
+static inline task_t *task_of(sched_entity_t *se) {
+    return (task_t *)((char *)se - __builtin_offsetof(task_t, se));
 }
 
-static void free_node(eevdf_rb_node_t *node) {
-    if (!node)
-        return;
-    int idx = node - node_pool;
-    if (idx < 0 || idx >= 64)
-        return;
-    int word = idx / 64;
-    int bit = idx % 64;
-    node_bitmap[word] &= ~(1ULL << bit);
+// Each node caches the earliest deadline in its subtree, which is what lets
+// eevdf_pick_next() skip whole subtrees. Rotations keep it up to date
+// locally; inserts and erases walk it up to the root.
+static void update_min_deadline(sched_entity_t *se) {
+    uint64_t min = se->deadline;
+    if (se->left && (int64_t)(se->left->min_deadline - min) < 0)
+        min = se->left->min_deadline;
+    if (se->right && (int64_t)(se->right->min_deadline - min) < 0)
+        min = se->right->min_deadline;
+    se->min_deadline = min;
+}
+
+static void propagate_min_deadline(sched_entity_t *se) {
+    for (; se; se = se->parent)
+        update_min_deadline(se);
 }
 
-static void rotate_left(eevdf_rb_node_t **root, eevdf_rb_node_t *x) {
-    eevdf_rb_node_t *y = x->right;
+static void rotate_left(sched_entity_t **root, sched_entity_t *x) {
+    sched_entity_t *y = x->right;
     x->right = y->left;
     if (y->left)
         y->left->parent = x;
@@ -62,10 +58,13 @@ static void rotate_left(eevdf_rb_node_t **root, eevdf_rb_node_t *x) {
         x->parent->right = y;
     y->left = x;
     x->parent = y;
+    // y took over x's subtree: only the two of them need recomputing
+    update_min_deadline(x);
+    update_min_deadline(y);
 }
 
-static void rotate_right(eevdf_rb_node_t **root, eevdf_rb_node_t *y) {
-    eevdf_rb_node_t *x = y->left;
+static void rotate_right(sched_entity_t **root, sched_entity_t *y) {
+    sched_entity_t *x = y->left;
     y->left = x->right;
     if (x->right)
         x->right->parent = y;
@@ -78,12 +77,14 @@ static void rotate_right(eevdf_rb_node_t **root, eevdf_rb_node_t *y) {
         y->parent->left = x;
     x->right = y;
     y->parent = x;
+    update_min_deadline(y);
+    update_min_deadline(x);
 }
 
-static void insert_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *z) {
+static void insert_fixup(sched_entity_t **root, sched_entity_t *z) {
     while (z->parent && z->parent->color == 1) {
         if (z->parent == z->parent->parent->left) {
-            eevdf_rb_node_t *y = z->parent->parent->right;
+            sched_entity_t *y = z->parent->parent->right;
             if (y && y->color == 1) {
                 z->parent->color = 0;
                 y->color = 0;
@@ -99,7 +100,7 @@ static void insert_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *z) {
                 rotate_right(root, z->parent->parent);
             }
         } else {
-            eevdf_rb_node_t *y = z->parent->parent->left;
+            sched_entity_t *y = z->parent->parent->left;
             if (y && y->color == 1) {
                 z->parent->color = 0;
                 y->color = 0;
@@ -119,7 +120,7 @@ static void insert_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *z) {
     (*root)->color = 0;
 }
 
-static eevdf_rb_node_t *rb_first(eevdf_rb_node_t *root) {
+static sched_entity_t *rb_first(sched_entity_t *root) {
     if (!root)
         return NULL;
     while (root->left)
@@ -127,11 +128,11 @@ static eevdf_rb_node_t *rb_first(eevdf_rb_node_t *root) {
     return root;
 }
 
-static void delete_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *x,
-                         eevdf_rb_node_t *parent) {
+static void delete_fixup(sched_entity_t **root, sched_entity_t *x,
+                         sched_entity_t *parent) {
     while (x != *root && (!x || x->color == 0)) {
         if (x == parent->left) {
-            eevdf_rb_node_t *w = parent->right;
+            sched_entity_t *w = parent->right;
             if (w && w->color == 1) {
                 w->color = 0;
                 parent->color = 1;
@@ -162,7 +163,7 @@ static void delete_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *x,
                 x = *root;
             }
         } else {
-            eevdf_rb_node_t *w = parent->left;
+            sched_entity_t *w = parent->left;
             if (w && w->color == 1) {
                 w->color = 0;
                 parent->color = 1;
@@ -198,37 +199,128 @@ static void delete_fixup(eevdf_rb_node_t **root, eevdf_rb_node_t *x,
         x->color = 0;
 }
 
-void eevdf_init(void) {
-    memset(&runqueue, 0, sizeof(eevdf_rq_t));
-    memset(node_pool, 0, sizeof(node_pool));
-    memset(node_bitmap, 0, sizeof(node_bitmap));
+// Virtual time
+//
+// Entity keys are kept relative to min_vruntime so the weighted sum fits in
+// 64 bits: avg_vruntime = sum (v_i - min_vruntime) * w_i over the queued
+// entities, whose total weight is load_weight. The running task is off the
+// tree but still competes, so it is added in on the fly until it exits or
+// eevdf_sleep() takes it out.
+
+static inline int64_t entity_key(sched_entity_t *se) {
+    return (int64_t)(se->vruntime - runqueue.min_vruntime);
 }
 
-void eevdf_enqueue(task_t *task) {
-    if (!task || task->state != TASK_READY)
-        return;
+static void avg_vruntime_add(sched_entity_t *se) {
+    runqueue.avg_vruntime += entity_key(se) * (int64_t)se->weight;
+}
+
+static void avg_vruntime_sub(sched_entity_t *se) {
+    runqueue.avg_vruntime -= entity_key(se) * (int64_t)se->weight;
+}
 
-    if (task->vruntime < runqueue.min_vruntime) {
-        task->vruntime = runqueue.min_vruntime;
+static sched_entity_t *curr_running(void) {
+    sched_entity_t *curr = runqueue.curr;
+    return curr && task_of(curr)->state != TASK_ZOMBIE ? curr : NULL;
+}
+
+static void avg_sum(int64_t *avg, int64_t *load) {
+    *avg = runqueue.avg_vruntime;
+    *load = (int64_t)runqueue.load_weight;
+    sched_entity_t *curr = curr_running();
+    if (curr) {
+        *avg += entity_key(curr) * (int64_t)curr->weight;
+        *load += curr->weight;
     }
+}
 
-    eevdf_rb_node_t *node = alloc_node();
-    if (!node) {
-        printk("[EEVDF] FAILED to alloc node for PID %d\n", task->pid);
-        return;
+// V, the weighted average vruntime: the virtual time the ideal fluid
+// scheduler would be at
+static uint64_t avg_vruntime(void) {
+    int64_t avg, load;
+    avg_sum(&avg, &load);
+    if (load) {
+        // Round towards -inf so an entity at V always counts as eligible
+        if (avg < 0)
+            avg -= load - 1;
+        avg /= load;
     }
+    return runqueue.min_vruntime + (uint64_t)avg;
+}
+
+// An entity is eligible when it has received no more than its share so far,
+// i.e. v_i <= V; compared as key * load <= avg to avoid the division
+static int entity_eligible(sched_entity_t *se) {
+    int64_t avg, load;
+    avg_sum(&avg, &load);
+    return avg >= entity_key(se) * load;
+}
 
-    node->task = task;
+// min_vruntime only moves forward; shifting it rebases every key, so the
+// weighted sum is adjusted to match
+static void update_min_vruntime(void) {
+    uint64_t v = runqueue.min_vruntime;
+    sched_entity_t *curr = curr_running();
+    if (curr)
+        v = curr->vruntime;
+    if (runqueue.leftmost &&
+        (!curr || (int64_t)(runqueue.leftmost->vruntime - v) < 0))
+        v = runqueue.leftmost->vruntime;
+
+    int64_t delta = (int64_t)(v - runqueue.min_vruntime);
+    if (delta > 0) {
+        runqueue.avg_vruntime -= (int64_t)runqueue.load_weight * delta;
+        runqueue.min_vruntime = v;
+    }
+}
+
+static inline int fls32(uint32_t x) { return x ? 32 - __builtin_clz(x) : 0; }
+
+// delta * weight / lw as a multiply and shift by the precomputed inverse
+// wmult = 2^32 / lw, with no divide on the tick path. The factor
+// weight * wmult is shifted down until it fits 32 bits, and the final
+// 64x32 product is taken in 128 bits, so even a delta of hours cannot
+// overflow before the shift.
+static uint64_t calc_delta(uint64_t delta, uint32_t weight, uint32_t wmult) {
+    int shift = EEVDF_WMULT_SHIFT;
+    uint64_t fact = (uint64_t)weight * wmult;
+    int fs = fls32((uint32_t)(fact >> 32));
+    shift -= fs;
+    fact >>= fs;
+    return (uint64_t)(((unsigned __int128)delta * fact) >> shift);
+}
+
+// Wall-clock ns to virtual ns at the entity's weight
+static uint64_t calc_delta_fair(uint64_t delta, sched_entity_t *se) {
+    if (se->weight == EEVDF_NICE_0_LOAD)
+        return delta;
+    return calc_delta(delta, EEVDF_NICE_0_LOAD, se->wmult);
+}
+
+// Bound on |vlag|: two requests, but never less than a timer tick
+static int64_t lag_limit(sched_entity_t *se) {
+    uint64_t limit = 2 * se->slice;
+    if (limit < EEVDF_TICK_NS)
+        limit = EEVDF_TICK_NS;
+    return (int64_t)calc_delta_fair(limit, se);
+}
+
+// Tree: ordered by vruntime (ties go right, so equal keys stay FIFO), with
+// the leftmost entity cached and each subtree's earliest deadline cached in
+// its root
+
+static void tree_insert(sched_entity_t *node) {
     node->left = node->right = node->parent = NULL;
     node->color = 1;
+    node->min_deadline = node->deadline;
 
-    eevdf_rb_node_t *parent = NULL;
-    eevdf_rb_node_t **link = &runqueue.root;
+    sched_entity_t *parent = NULL;
+    sched_entity_t **link = &runqueue.root;
     int leftmost = 1;
 
     while (*link) {
         parent = *link;
-        if (task->vruntime < parent->task->vruntime) {
+        if ((int64_t)(node->vruntime - parent->vruntime) < 0) {
             link = &parent->left;
         } else {
             link = &parent->right;
@@ -242,38 +334,17 @@ void eevdf_enqueue(task_t *task) {
     node->parent = parent;
     *link = node;
 
+    propagate_min_deadline(parent);
     insert_fixup(&runqueue.root, node);
-
-    uint32_t weight = eevdf_nice_to_weight[task->priority + 20];
-    runqueue.load_weight += weight;
-    runqueue.nr_running++;
 }
 
-void eevdf_dequeue(task_t *task) {
-    if (!task)
-        return;
-
-    // Search for the task's node in the runqueue
-    eevdf_rb_node_t *node = NULL;
-    for (int i = 0; i < 64; i++) {
-        if ((node_bitmap[i / 64] & (1ULL << (i % 64))) &&
-            node_pool[i].task == task) {
-            node = &node_pool[i];
-            break;
-        }
-    }
-
-    // Safe for absent tasks: if task is not in queue, return without error
-    // This can happen when dequeue is called on idle task or already-dequeued task
-    if (!node)
-        return;
-
+static void tree_erase(sched_entity_t *node) {
     if (runqueue.leftmost == node) {
         if (node->right) {
             runqueue.leftmost = rb_first(node->right);
         } else {
-            eevdf_rb_node_t *current = node;
-            eevdf_rb_node_t *parent = current->parent;
+            sched_entity_t *current = node;
+            sched_entity_t *parent = current->parent;
             while (parent && current == parent->right) {
                 current = parent;
                 parent = parent->parent;
@@ -282,8 +353,8 @@ void eevdf_dequeue(task_t *task) {
         }
     }
 
-    eevdf_rb_node_t *y = node;
-    eevdf_rb_node_t *x, *x_parent;
+    sched_entity_t *y = node;
+    sched_entity_t *x, *x_parent;
     uint8_t y_color = y->color;
 
     if (!node->left) {
@@ -339,59 +410,221 @@ void eevdf_dequeue(task_t *task) {
         y->left->parent = y;
     }
 
+    // Everything from the lowest relinked node up has lost node
+    propagate_min_deadline(x_parent);
+
     if (y_color == 0) {
         delete_fixup(&runqueue.root, x, x_parent);
     }
 
-    uint32_t weight = eevdf_nice_to_weight[task->priority + 20];
-    if (runqueue.load_weight >= weight)
-        runqueue.load_weight -= weight;
-    else
-        runqueue.load_weight = 0;
+    node->left = node->right = node->parent = NULL;
+}
+
+static void enqueue_entity(sched_entity_t *se) {
+    avg_vruntime_add(se);
+    tree_insert(se);
+    se->on_rq = 1;
+    runqueue.load_weight += se->weight;
+    runqueue.nr_running++;
+}
+
+static void dequeue_entity(sched_entity_t *se) {
+    tree_erase(se);
+    avg_vruntime_sub(se);
+    se->on_rq = 0;
+    runqueue.load_weight -= se->weight;
+    runqueue.nr_running--;
+}
+
+// Position an entity that is (re)joining the competition. A waking entity
+// gets back the lag it had when it went to sleep, scaled up because it is
+// about to add its own weight to V; a new one starts at V with half a
+// request, so a fork storm cannot push out the tasks already running.
+static void place_entity(sched_entity_t *se) {
+    uint64_t vslice = calc_delta_fair(se->slice, se);
+    uint64_t V = avg_vruntime();
+    int64_t lag = 0;
+
+    if (se->place == EEVDF_PLACE_WAKEUP) {
+        int64_t avg, load;
+        avg_sum(&avg, &load);
+        lag = se->vlag;
+        if (load)
+            lag = lag * (load + (int64_t)se->weight) / load;
+    }
+    se->vruntime = V - (uint64_t)lag;
+    if (se->place == EEVDF_PLACE_INITIAL)
+        vslice /= 2;
+    se->deadline = se->vruntime + vslice;
+    se->vlag = 0;
+    se->place = EEVDF_PLACE_NONE;
+}
+
+void eevdf_init(void) {
+    memset(&runqueue, 0, sizeof(eevdf_rq_t));
+}
+
+void eevdf_enqueue(task_t *task) {
+    if (!task || task->state != TASK_READY)
+        return;
+
+    sched_entity_t *se = &task->se;
+    if (UNLIKELY(se->on_rq)) {
+        printk("[EEVDF] PID %d enqueued twice\n", task->pid);
+        return;
+    }
 
-    if (runqueue.nr_running > 0)
-        runqueue.nr_running--;
+    // A preempted task goes back exactly where it was; its vruntime and
+    // deadline already account for the time it ran
+    if (se == runqueue.curr)
+        runqueue.curr = NULL;
+    else if (se->place != EEVDF_PLACE_NONE)
+        place_entity(se);
 
-    free_node(node);
+    enqueue_entity(se);
+}
+
+void eevdf_dequeue(task_t *task) {
+    if (!task)
+        return;
+
+    // Safe for absent tasks: if task is not in queue, return without error
+    // This can happen when dequeue is called on idle task or already-dequeued task
+    sched_entity_t *se = &task->se;
+    if (!se->on_rq)
+        return;
+
+    dequeue_entity(se);
+    update_min_vruntime();
+}
+
+void eevdf_sleep(task_t *task, uint64_t now) {
+    if (!task)
+        return;
+
+    sched_entity_t *se = &task->se;
+    if (se == runqueue.curr)
+        eevdf_update_curr(task, now);
+
+    // Lag is measured while the entity still counts towards V
+    int64_t lag = (int64_t)(avg_vruntime() - se->vruntime);
+    int64_t limit = lag_limit(se);
+    if (lag > limit)
+        lag = limit;
+    if (lag < -limit)
+        lag = -limit;
+    se->vlag = lag;
+    se->place = EEVDF_PLACE_WAKEUP;
+
+    if (se->on_rq)
+        dequeue_entity(se);
+    if (se == runqueue.curr)
+        runqueue.curr = NULL;
+    update_min_vruntime();
+}
+
+// Earliest eligible virtual deadline first. Eligibility is monotonic in
+// vruntime, so walking down from the root: an ineligible node sends us left;
+// at an eligible node, it and its whole left subtree are eligible, and the
+// cached min_deadline says whether the best deadline lies there, at the node
+// itself, or further right. The second loop then descends the chosen left
+// subtree to the entity owning that deadline.
+static sched_entity_t *pick_eevdf(void) {
+    sched_entity_t *node = runqueue.root;
+    sched_entity_t *best = NULL, *best_left = NULL;
+
+    while (node) {
+        if (!entity_eligible(node)) {
+            node = node->left;
+            continue;
+        }
+
+        if (!best || (int64_t)(node->deadline - best->deadline) < 0)
+            best = node;
+
+        if (node->left) {
+            sched_entity_t *left = node->left;
+            if (!best_left ||
+                (int64_t)(left->min_deadline - best_left->min_deadline) < 0)
+                best_left = left;
+            if (left->min_deadline == node->min_deadline)
+                break;
+        }
+        if (node->deadline == node->min_deadline)
+            break;
+        node = node->right;
+    }
+
+    if (!best_left || (int64_t)(best_left->min_deadline - best->deadline) >= 0)
+        return best;
+
+    node = best_left;
+    while (node) {
+        if (node->deadline == node->min_deadline)
+            return node;
+        if (node->left && node->left->min_deadline == node->min_deadline)
+            node = node->left;
+        else
+            node = node->right;
+    }
+    return best;
 }
 
 task_t *eevdf_pick_next(void) {
-    if (!runqueue.leftmost)
+    if (!runqueue.root)
         return NULL;
-    return runqueue.leftmost->task;
+
+    sched_entity_t *se = pick_eevdf();
+    // Someone is always eligible (not everyone can be ahead of the
+    // average); the leftmost is only a guard against rounding
+    if (UNLIKELY(!se))
+        se = runqueue.leftmost;
+    return task_of(se);
+}
+
+void eevdf_set_curr(task_t *task, uint64_t now) {
+    // The idle task is never queued and takes no share
+    if (!task || task->pid == 0) {
+        runqueue.curr = NULL;
+        return;
+    }
+    task->se.exec_start = now;
+    runqueue.curr = &task->se;
 }
 
 void eevdf_update_curr(task_t *task, uint64_t now) {
     if (!task)
         return;
 
-    uint64_t delta = now - task->context.x23;
+    sched_entity_t *se = &task->se;
+    uint64_t delta = now - se->exec_start;
     if (delta == 0)
         return;
 
-    task->context.x23 = now;
+    se->exec_start = now;
+    se->sum_exec_runtime += delta;
 
-    // uint32_t weight = eevdf_nice_to_weight[task->priority + 20];
-    uint64_t delta_fair =
-        (delta * EEVDF_NICE_0_LOAD) /
-        (runqueue.load_weight ? runqueue.load_weight : EEVDF_NICE_0_LOAD);
-    task->vruntime += delta_fair;
+    // Each entity's virtual time runs at NICE_0_LOAD / weight of real
+    // time, so equal vruntime progress means CPU in proportion to weight
+    se->vruntime += calc_delta_fair(delta, se);
 
-    if (runqueue.leftmost) {
-        runqueue.min_vruntime = runqueue.leftmost->task->vruntime;
-    } else {
-        runqueue.min_vruntime = task->vruntime;
-    }
+    // Request served: issue the next one
+    if ((int64_t)(se->vruntime - se->deadline) >= 0)
+        se->deadline = se->vruntime + calc_delta_fair(se->slice, se);
+
+    update_min_vruntime();
 }
 
 uint64_t eevdf_calc_slice(task_t *task) {
-    if (runqueue.nr_running == 0)
+    if (!task)
         return EEVDF_TIME_SLICE_NS;
 
-    uint32_t weight = eevdf_nice_to_weight[task->priority + 20];
-    uint64_t slice =
-        (EEVDF_TARGET_LATENCY * weight) /
-        (runqueue.load_weight ? runqueue.load_weight : EEVDF_NICE_0_LOAD);
+    // Wall-clock time left until the current request's deadline
+    sched_entity_t *se = &task->se;
+    int64_t vleft = (int64_t)(se->deadline - se->vruntime);
+    uint64_t slice = vleft > 0 ? (uint64_t)vleft * se->weight /
+                                     EEVDF_NICE_0_LOAD
+                               : 0;
 
     if (slice < EEVDF_MIN_GRANULARITY)
         slice = EEVDF_MIN_GRANULARITY;
@@ -401,6 +634,32 @@ uint64_t eevdf_calc_slice(task_t *task) {
     return slice;
 }
 
+// Change an entity's weight or request size. A queued entity is taken out
+// while its keys change; the remaining part of the current request is
+// rescaled to the new weight, or restarted for a new request size.
+static void reweight_entity(sched_entity_t *se, int nice, uint64_t slice) {
+    uint32_t weight = eevdf_nice_to_weight[nice + 20];
+    int queued = se->on_rq;
+    if (queued)
+        dequeue_entity(se);
+
+    if (weight != se->weight) {
+        int64_t vleft = (int64_t)(se->deadline - se->vruntime);
+        se->deadline = se->vruntime +
+                       (uint64_t)(vleft * (int64_t)se->weight / weight);
+        se->vlag = se->vlag * (int64_t)se->weight / weight;
+        se->weight = weight;
+        se->wmult = eevdf_nice_to_wmult[nice + 20];
+    }
+    if (slice != se->slice) {
+        se->slice = slice;
+        se->deadline = se->vruntime + calc_delta_fair(slice, se);
+    }
+
+    if (queued)
+        enqueue_entity(se);
+}
+
 void eevdf_set_nice(task_t *task, int nice) {
     if (!task)
         return;
@@ -409,17 +668,19 @@ void eevdf_set_nice(task_t *task, int nice) {
     if (nice > EEVDF_MAX_NICE)
         nice = EEVDF_MAX_NICE;
     task->priority = nice;
+    reweight_entity(&task->se, nice, task->se.slice);
 }
 
-int eevdf_is_queued(task_t *task) {
+void eevdf_set_slice(task_t *task, uint64_t slice) {
     if (!task)
-        return 0;
-    
-    for (int i = 0; i < 64; i++) {
-        if ((node_bitmap[i / 64] & (1ULL << (i % 64))) &&
-            node_pool[i].task == task) {
-            return 1;
-        }
-    }
-    return 0;
+        return;
+    if (slice < EEVDF_MIN_GRANULARITY)
+        slice = EEVDF_MIN_GRANULARITY;
+    if (slice > EEVDF_MAX_TIME_SLICE_NS)
+        slice = EEVDF_MAX_TIME_SLICE_NS;
+    reweight_entity(&task->se, task->priority, slice);
+}
+
+int eevdf_is_queued(task_t *task) {
+    return task && task->se.on_rq;
 }
@@ -0,0 +1,152 @@
+// Per-CPU kernel stack cache
+//
+// Each CPU keeps a LIFO of free stacks, touched only by that CPU with IRQs
+// masked, so the fast path takes no lock. The most recently freed stack is
+// reused first: its top pages are the ones most likely to still be cached.
+// Stacks keep the pages they populated while cached; their VMAs are neither
+// swappable nor mergeable, so those pages stay resident.
+//
+// Below the top page a stack fills in on demand, through kstack_handle_fault()
+// rather than vmm_handle_fault(): the faulting code may hold vmm_lock or
+// pmm_lock. Those are only ever held with IRQs masked, so a fault taken with
+// IRQs enabled allocates its frame from the PMM, and one taken with IRQs
+// masked uses a per-CPU reserve, refilled whenever allocating is safe.
+
+#include <kernel/panic.h>
+#include <kernel/sched/kstack.h>
+#include <kernel/sched/task.h>
+#include <kernel/smp.h>
+#include <mm/pmm.h>
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <string.h>
+
+#define KSTACK_PAGE_SIZE 4096ULL
+// VA covered by one L3 page table
+#define KSTACK_TABLE_SPAN (1ULL << 21)
+// Enough for one task to grow its stack in full with IRQs masked
+#define KSTACK_RESERVE (KERNEL_STACK_SIZE / KSTACK_PAGE_SIZE - 1)
+
+// Reserve frames are linked through their first word
+typedef struct kstack_frame {
+    struct kstack_frame *next;
+} kstack_frame_t;
+
+typedef struct {
+    void *stacks[KSTACK_CACHE_SIZE];
+    unsigned nr;
+    kstack_frame_t *reserve;
+    unsigned nr_reserve;
+    kstack_stats_t stats;
+} kstack_cache_t;
+
+static kstack_cache_t kstack_cache[NR_CPUS];
+
+// Top up this CPU's fault reserve. Caller has IRQs masked and holds no
+// VMM/PMM lock. The caller's own stack may still fault in here and pop a
+// frame, so the push is a compare-and-swap that retries on the new head.
+static void kstack_refill(kstack_cache_t *c) {
+    while (__atomic_load_n(&c->nr_reserve, __ATOMIC_RELAXED) <
+           KSTACK_RESERVE) {
+        kstack_frame_t *f = pmm_alloc_page();
+        if (!f)
+            return;
+        f->next = __atomic_load_n(&c->reserve, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&c->reserve, &f->next, f, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+        __atomic_fetch_add(&c->nr_reserve, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void *kstack_alloc(void) {
+    uint64_t flags = local_irq_save();
+    kstack_cache_t *c = &kstack_cache[smp_processor_id()];
+    kstack_refill(c);
+    if (c->nr) {
+        void *stack = c->stacks[--c->nr];
+        c->stats.hits++;
+        local_irq_restore(flags);
+        return stack;
+    }
+    c->stats.misses++;
+    local_irq_restore(flags);
+
+    // Only the depth actually used costs memory. The top page is touched as
+    // soon as the task runs, so populate it now. kstack_handle_fault() cannot
+    // allocate page tables: if the stack straddles an L3 table boundary,
+    // populating the bottom page as well puts a table under every page.
+    void *stack = vmalloc(KERNEL_STACK_SIZE);
+    if (!stack)
+        return NULL;
+    uint64_t base = (uint64_t)stack;
+    uint64_t top = base + KERNEL_STACK_SIZE - KSTACK_PAGE_SIZE;
+    int ret = vmm_populate(top, KSTACK_PAGE_SIZE);
+    if (ret == 0 && base / KSTACK_TABLE_SPAN != top / KSTACK_TABLE_SPAN)
+        ret = vmm_populate(base, KSTACK_PAGE_SIZE);
+    if (ret != 0) {
+        vfree(stack, KERNEL_STACK_SIZE);
+        return NULL;
+    }
+    return stack;
+}
+
+void kstack_free(void *stack) {
+    if (!stack)
+        return;
+
+    uint64_t flags = local_irq_save();
+    kstack_cache_t *c = &kstack_cache[smp_processor_id()];
+    if (c->nr < KSTACK_CACHE_SIZE) {
+        c->stacks[c->nr++] = stack;
+        c->stats.recycled++;
+        local_irq_restore(flags);
+        return;
+    }
+    c->stats.released++;
+    local_irq_restore(flags);
+
+    vfree(stack, KERNEL_STACK_SIZE);
+}
+
+int kstack_handle_fault(uint64_t va, int irqs_were_on) {
+    task_t *curr = task_current();
+    if (!curr || !curr->kernel_stack)
+        return -1;
+    uint64_t base = (uint64_t)curr->kernel_stack;
+    if (va < base || va >= base + KERNEL_STACK_SIZE)
+        return -1;
+
+    // Runs in the abort handler, IRQs masked
+    kstack_cache_t *c = &kstack_cache[smp_processor_id()];
+    void *frame;
+    if (irqs_were_on) {
+        frame = pmm_alloc_page();
+        kstack_refill(c);
+    } else if ((frame = c->reserve) != NULL) {
+        c->reserve = c->reserve->next;
+        __atomic_fetch_sub(&c->nr_reserve, 1, __ATOMIC_RELAXED);
+    }
+    if (!frame)
+        return -4;
+    memset(frame, 0, KSTACK_PAGE_SIZE);
+    if (vmm_install_page(va, frame, VMALLOC_ATTRS) != 0)
+        panic("kstack: cannot map %p in the stack of PID %d", (void *)va,
+              curr->pid);
+    c->stats.faults++;
+    return 0;
+}
+
+void kstack_get_stats(kstack_stats_t *out) {
+    uint64_t flags = local_irq_save();
+    *out = (kstack_stats_t){0};
+    for (unsigned cpu = 0; cpu < NR_CPUS; cpu++) {
+        out->hits += kstack_cache[cpu].stats.hits;
+        out->misses += kstack_cache[cpu].stats.misses;
+        out->recycled += kstack_cache[cpu].stats.recycled;
+        out->released += kstack_cache[cpu].stats.released;
+        out->faults += kstack_cache[cpu].stats.faults;
+    }
+    local_irq_restore(flags);
+}
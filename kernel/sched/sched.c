@@ -1,15 +1,34 @@
 #include <drivers/timer.h>
+#include <kernel/rcu.h>
 #include <kernel/sched/eevdf.h>
 #include <kernel/sched/task.h>
+#include <kernel/sched/wait.h>
+#include <kernel/smp.h>
 #include <string.h>
 #include <kernel/printk.h>
 #include <kernel/panic.h>
 
 extern void switch_to(cpu_context_t *prev, cpu_context_t *next);
+extern void load_context(cpu_context_t *next);
+
+// Timed sleepers, earliest wake_at first. Only touched with IRQs masked.
+static task_t *sleep_list = NULL;
+
+// Put task on the CPU: start its accounting and arm the preemption timer for
+// the time left until its request's deadline. The idle task gets a tick, so
+// it still notices tasks it created itself.
+static void set_running(task_t *task, uint64_t now) {
+    eevdf_set_curr(task, now);
+    timer_set_slice(task->pid == 0 ? EEVDF_TICK_NS : eevdf_calc_slice(task));
+}
 
 void schedule(void) {
+    // The runqueue is shared with the timer IRQ; masked until the switch,
+    // and restored by whichever context we come back in
+    uint64_t flags = local_irq_save();
     task_t *prev = task_current();
     uint64_t now = get_ns();
+    rcu_note_context_switch(prev);
 
     // Handle NULL prev case - can happen when current task was killed
     // and task_set_current(NULL) was called before schedule()
@@ -31,6 +50,9 @@ void schedule(void) {
                     panic("schedule: READY task PID %d not in queue after enqueue", prev->pid);
                 }
             }
+        } else if (prev->state == TASK_BLOCKED && prev->pid != 0) {
+            // Going to sleep: off the CPU without being requeued
+            eevdf_sleep(prev, now);
         }
         
         // Verify zombie tasks are not in queue
@@ -58,7 +80,9 @@ void schedule(void) {
             if (eevdf_is_queued(prev)) {
                 panic("schedule: RUNNING task PID %d still in queue after dequeue", prev->pid);
             }
+            set_running(prev, now);
         }
+        local_irq_restore(flags);
         return;
     }
 
@@ -79,23 +103,15 @@ void schedule(void) {
         panic("schedule: RUNNING task PID %d is in queue", next->pid);
     }
     
-    next->context.x23 = now;
-    next->time_slice = eevdf_calc_slice(next);
+    set_running(next, now);
     task_set_current(next);
 
     if (prev) {
         switch_to(&prev->context, &next->context);
+        local_irq_restore(flags);
     } else {
         // No previous task (it was killed), jump directly to next task
-        __asm__ volatile(
-            "mov sp, %0\n"
-            "mov x29, %1\n"
-            "mov x30, %2\n"
-            "br %3\n"
-            :
-            : "r"(next->context.sp), "r"(next->context.x29),
-              "r"(next->context.x30), "r"(next->context.pc)
-            : "memory");
+        load_context(&next->context);
         __builtin_unreachable();
     }
 }
@@ -104,6 +120,7 @@ void schedule_preempt(cpu_context_t *regs) {
     task_t *prev = task_current();
     if (!prev)
         return;
+    rcu_note_context_switch(prev);
 
     // Only enqueue prev if it was running normally
     // Zombie tasks are not re-enqueued
@@ -125,6 +142,12 @@ void schedule_preempt(cpu_context_t *regs) {
                 panic("schedule_preempt: READY task PID %d not in queue after enqueue", prev->pid);
             }
         }
+    } else if (prev->state == TASK_BLOCKED) {
+        // Interrupted between blocking and its call to schedule(): the task
+        // resumes there once woken
+        memcpy(&prev->context, regs, sizeof(cpu_context_t));
+        if (prev->pid != 0)
+            eevdf_sleep(prev, get_ns());
     } else if (prev->state == TASK_ZOMBIE) {
         // Zombie task - don't save context or enqueue
         printk("[SCHED] prev PID %d is ZOMBIE\n", prev->pid);
@@ -168,6 +191,7 @@ void schedule_preempt(cpu_context_t *regs) {
             if (eevdf_is_queued(prev)) {
                 panic("schedule_preempt: RUNNING task PID %d is in queue", prev->pid);
             }
+            set_running(prev, get_ns());
         }
         return;
     }
@@ -194,9 +218,95 @@ void schedule_preempt(cpu_context_t *regs) {
         panic("schedule_preempt: RUNNING task PID %d is in queue", next->pid);
     }
     
-    next->context.x23 = now;
-    next->time_slice = eevdf_calc_slice(next);
+    set_running(next, now);
     task_set_current(next);
 
     memcpy(regs, &next->context, sizeof(cpu_context_t));
 }
+
+// Insert into the sleep list and re-arm the wakeup event if task is now
+// first. IRQs masked.
+static void sleep_insert(task_t *task) {
+    task_t **link = &sleep_list;
+    while (*link && (*link)->wake_at <= task->wake_at)
+        link = &(*link)->sleep_next;
+    task->sleep_next = *link;
+    *link = task;
+    if (sleep_list == task)
+        timer_set_event(task->wake_at);
+}
+
+static void sleep_remove(task_t *task) {
+    for (task_t **link = &sleep_list; *link; link = &(*link)->sleep_next) {
+        if (*link != task)
+            continue;
+        *link = task->sleep_next;
+        task->sleep_next = NULL;
+        task->wake_at = 0;
+        timer_set_event(sleep_list ? sleep_list->wake_at : 0);
+        return;
+    }
+}
+
+void task_sleep_ns(uint64_t ns) {
+    task_t *self = task_current();
+    uint64_t until = get_ns() + ns;
+
+    if (!self || irqs_disabled()) {
+        while (get_ns() < until)
+            ;
+        return;
+    }
+    if (self->pid == 0) {
+        // The idle task must stay runnable: let the others run meanwhile
+        while (get_ns() < until)
+            schedule();
+        return;
+    }
+
+    uint64_t flags = local_irq_save();
+    self->wake_at = until;
+    sleep_insert(self);
+    self->state = TASK_BLOCKED;
+    local_irq_restore(flags);
+
+    schedule();
+}
+
+int task_wake(task_t *task) {
+    if (!task)
+        return 0;
+    uint64_t flags = local_irq_save();
+    int woken = task->state == TASK_BLOCKED;
+    if (woken) {
+        if (task->wake_at)
+            sleep_remove(task);
+        if (task == task_current()) {
+            // Blocked but not switched out yet: just keep running
+            task->state = TASK_RUNNING;
+        } else {
+            task->state = TASK_READY;
+            if (task->pid != 0)
+                eevdf_enqueue(task);
+        }
+    }
+    local_irq_restore(flags);
+    return woken;
+}
+
+void task_wake_sleepers(void) {
+    uint64_t flags = local_irq_save();
+    uint64_t now = get_ns();
+    while (sleep_list && sleep_list->wake_at <= now)
+        task_wake(sleep_list);
+    timer_set_event(sleep_list ? sleep_list->wake_at : 0);
+    local_irq_restore(flags);
+}
+
+void task_cancel_wait(task_t *task) {
+    uint64_t flags = local_irq_save();
+    if (task->wake_at)
+        sleep_remove(task);
+    local_irq_restore(flags);
+    wait_queue_remove(task);
+}
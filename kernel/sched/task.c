@@ -1,25 +1,114 @@
+#include <drivers/timer.h>
 #include <kernel/panic.h>
 #include <kernel/pid.h>
 #include <kernel/printk.h>
+#include <kernel/rcu.h>
 #include <kernel/sched/eevdf.h>
+#include <kernel/sched/kstack.h>
 #include <kernel/sched/task.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
 #include <mm/mmu.h>
 #include <mm/vmalloc.h>
 #include <string.h>
 
 static task_t *current_task = NULL;
 static task_t *task_list = NULL;
+// Lookups by PID far outnumber spawns and kills, and come from the scheduler
+// with IRQs masked as well as from tasks: they walk the list under RCU, and
+// the lock only orders writers. An unlinked task keeps its next pointer, so
+// a reader standing on it still gets back onto the list.
+static spinlock_t task_list_lock = SPINLOCK_INIT;
+
+// Zombies whose kernel stack has not been reclaimed yet. A task cannot give
+// up the stack it is running on, so task_exit()/task_kill() only queue it
+// here; task_reap() recycles the stack once the task is off the CPU, unlinks
+// the task and drops its own reference after a grace period, when no lookup
+// can still be standing on it.
+static task_t *reap_list = NULL;
+static spinlock_t reap_lock = SPINLOCK_INIT;
+
+void task_get(task_t *task) {
+    __atomic_add_fetch(&task->usage, 1, __ATOMIC_RELAXED);
+}
+
+void task_put(task_t *task) {
+    if (__atomic_sub_fetch(&task->usage, 1, __ATOMIC_ACQ_REL) == 0)
+        vfree(task, sizeof(task_t));
+}
+
+static void task_free_rcu(rcu_head_t *head) {
+    task_put((task_t *)((char *)head - __builtin_offsetof(task_t, rcu)));
+}
+
+static void task_unlink(task_t *task) {
+    uint64_t flags = spinlock_lock_irqsave(&task_list_lock);
+    if (task->prev)
+        rcu_assign_pointer(task->prev->next, task->next);
+    if (task->next)
+        task->next->prev = task->prev;
+    if (task == task_list)
+        rcu_assign_pointer(task_list, task->next);
+    spinlock_unlock_irqrestore(&task_list_lock, flags);
+}
+
+static void task_queue_reap(task_t *task) {
+    uint64_t flags = spinlock_lock_irqsave(&reap_lock);
+    task->reap_next = reap_list;
+    reap_list = task;
+    spinlock_unlock_irqrestore(&reap_lock, flags);
+}
+
+void task_reap(void) {
+    uint64_t flags = spinlock_lock_irqsave(&reap_lock);
+    task_t **link = &reap_list;
+    while (*link) {
+        task_t *task = *link;
+        if (task == current_task) {
+            link = &task->reap_next;
+            continue;
+        }
+        *link = task->reap_next;
+        task->reap_next = NULL;
+        kstack_free(task->kernel_stack);
+        task->kernel_stack = NULL;
+        task_unlink(task);
+        call_rcu(&task->rcu, task_free_rcu);
+    }
+    spinlock_unlock_irqrestore(&reap_lock, flags);
+}
 
 extern void switch_to(cpu_context_t *prev, cpu_context_t *next);
 
+void cpu_idle(void) {
+    for (;;) {
+        task_reap();
+
+        // Check for work and go to sleep with IRQs masked, so a wakeup
+        // cannot slip in between; WFI still returns on a pending IRQ. Tell
+        // RCU first: ending a grace period may wake its kthread.
+        uint64_t flags = local_irq_save();
+        rcu_idle_enter();
+        if (eevdf_pick_next()) {
+            rcu_idle_exit();
+            local_irq_restore(flags);
+            schedule();
+            continue;
+        }
+        timer_nohz_enter();
+        __asm__ volatile("dsb sy\n"
+                         "wfi" ::: "memory");
+        timer_nohz_exit();
+        rcu_idle_exit();
+        local_irq_restore(flags);
+    }
+}
+
 static void idle_task_entry(int argc, char **argv, char **envp) {
     (void)argc;
     (void)argv;
     (void)envp;
-    // Idle task just waits for interrupts
-    while (1) {
-        __asm__ volatile("wfe");
-    }
+    cpu_idle();
 }
 
 static void task_entry_wrapper(void) {
@@ -58,6 +147,7 @@ task_t *task_create(void (*entry)(int argc, char **argv, char **envp),
         return NULL;
 
     memset(task, 0, sizeof(task_t));
+    task->usage = 1;
 
     task->pid = pid_alloc();
     if (task->pid < 0) {
@@ -68,10 +158,15 @@ task_t *task_create(void (*entry)(int argc, char **argv, char **envp),
     task->priority = (priority < EEVDF_MIN_NICE)   ? EEVDF_MIN_NICE
                      : (priority > EEVDF_MAX_NICE) ? EEVDF_MAX_NICE
                                                    : priority;
-    task->time_slice = EEVDF_TIME_SLICE_NS;
-    task->vruntime = 0;
-
-    task->kernel_stack = vmalloc(KERNEL_STACK_SIZE);
+    task->se.weight = eevdf_nice_to_weight[task->priority + 20];
+    task->se.wmult = eevdf_nice_to_wmult[task->priority + 20];
+    task->se.slice = EEVDF_TIME_SLICE_NS;
+    task->se.place = EEVDF_PLACE_INITIAL;
+
+    // Recycle stacks of tasks that died since the last spawn first, so the
+    // cache can serve this one
+    task_reap();
+    task->kernel_stack = kstack_alloc();
     if (!task->kernel_stack) {
         pid_free(task->pid);
         vfree(task, sizeof(task_t));
@@ -91,18 +186,21 @@ task_t *task_create(void (*entry)(int argc, char **argv, char **envp),
         task->context.x20 = args ? args->argc : 0;
         task->context.x21 = args ? (uint64_t)args->argv : 0;
         task->context.x22 = args ? (uint64_t)args->envp : 0;
-        task->context.x23 = 0;
         task->context.x29 = 0;
         task->context.x30 = (uint64_t)task_exit;
         task->context.pstate = 0x345;
 
+        uint64_t flags = local_irq_save();
         eevdf_enqueue(task);
+        local_irq_restore(flags);
     }
 
+    uint64_t flags = spinlock_lock_irqsave(&task_list_lock);
     task->next = task_list;
     if (task_list)
         task_list->prev = task;
-    task_list = task;
+    rcu_assign_pointer(task_list, task);
+    spinlock_unlock_irqrestore(&task_list_lock, flags);
 
     return task;
 }
@@ -114,7 +212,9 @@ void task_exit(int code) {
 
     // Task is RUNNING, not in queue - don't dequeue
     current_task->state = TASK_ZOMBIE;
+    rcu_task_dead(current_task);
     pid_free(current_task->pid);
+    task_queue_reap(current_task);
 
     // Clear current_task before scheduling
     // schedule() will not return - it will switch to another task
@@ -132,13 +232,12 @@ task_t *task_current(void) { return current_task; }
 void task_set_current(task_t *task) { current_task = task; }
 
 task_t *task_find_by_pid(int pid) {
-    task_t *p = task_list;
-    while (p) {
-        if (p->pid == pid)
-            return p;
-        p = p->next;
-    }
-    return NULL;
+    // A zombie has given its PID back and stays listed only until reaped;
+    // a new task may already hold the same PID
+    task_t *p = rcu_dereference(task_list);
+    while (p && (p->pid != pid || p->state == TASK_ZOMBIE))
+        p = rcu_dereference(p->next);
+    return p;
 }
 
 int task_kill(task_t *task) {
@@ -156,23 +255,21 @@ int task_kill(task_t *task) {
     printk("[KILL] Killing PID %d (state=%d)\n", task->pid, task->state);
 
     // Remove from scheduler queue ONLY if it's in the queue (READY state)
+    uint64_t flags = local_irq_save();
     if (task->state == TASK_READY) {
         eevdf_dequeue(task);
+    } else if (task->state == TASK_BLOCKED) {
+        // Nothing may wake it once it is gone
+        task_cancel_wait(task);
     }
 
     task->state = TASK_ZOMBIE;
+    local_irq_restore(flags);
+    rcu_task_dead(task);
     pid_free(task->pid);
 
-    // Remove from task list
-    if (task->prev)
-        task->prev->next = task->next;
-    if (task->next)
-        task->next->prev = task->prev;
-    if (task == task_list)
-        task_list = task->next;
-
-    // a more robust implementation would free the stack and other resources,
-    // but for now, we just make it a zombie.
+    // Like an exited task, it stays on the list as a zombie until reaped
+    task_queue_reap(task);
 
     // If killing current task, reschedule immediately
     if (task == task_current()) {
@@ -0,0 +1,98 @@
+// Wait queues
+//
+// Waiters are linked through task_t itself (wq, wq_next): a task blocks on
+// at most one queue at a time, so no entry has to live on its stack and a
+// killed task can be unlinked through its own pointer.
+
+#include <kernel/sched/wait.h>
+
+void wait_queue_init(wait_queue_t *wq) {
+    spinlock_init(&wq->lock);
+    wq->head = wq->tail = NULL;
+}
+
+static void wq_append(wait_queue_t *wq, task_t *task) {
+    task->wq = wq;
+    task->wq_next = NULL;
+    if (wq->tail)
+        wq->tail->wq_next = task;
+    else
+        wq->head = task;
+    wq->tail = task;
+}
+
+static void wq_unlink(wait_queue_t *wq, task_t *task) {
+    task_t *prev = NULL;
+    for (task_t *t = wq->head; t; prev = t, t = t->wq_next) {
+        if (t != task)
+            continue;
+        if (prev)
+            prev->wq_next = t->wq_next;
+        else
+            wq->head = t->wq_next;
+        if (wq->tail == t)
+            wq->tail = prev;
+        break;
+    }
+    task->wq = NULL;
+    task->wq_next = NULL;
+}
+
+void prepare_to_wait(wait_queue_t *wq) {
+    task_t *self = task_current();
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    if (self->wq != wq)
+        wq_append(wq, self);
+    self->state = TASK_BLOCKED;
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+}
+
+void finish_wait(wait_queue_t *wq) {
+    task_t *self = task_current();
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    // Still queued if the condition held before anyone woke us
+    if (self->wq == wq)
+        wq_unlink(wq, self);
+    self->state = TASK_RUNNING;
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+}
+
+static int wake_up_nr(wait_queue_t *wq, int nr) {
+    int woken = 0;
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    while (wq->head && woken < nr) {
+        task_t *task = wq->head;
+        wq_unlink(wq, task);
+        woken += task_wake(task);
+    }
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+int wake_up(wait_queue_t *wq) { return wake_up_nr(wq, 1); }
+
+int wake_up_all(wait_queue_t *wq) { return wake_up_nr(wq, __INT_MAX__); }
+
+task_t *wait_queue_first(wait_queue_t *wq) {
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    task_t *first = wq->head;
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+    return first;
+}
+
+int wake_up_first(wait_queue_t *wq) {
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    int woken = wq->head ? task_wake(wq->head) : 0;
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+void wait_queue_remove(task_t *task) {
+    wait_queue_t *wq = task->wq;
+    if (!wq)
+        return;
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    if (task->wq == wq)
+        wq_unlink(wq, task);
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+}
@@ -0,0 +1,97 @@
+// Queued spinlock slow path
+//
+// A waiter's node lives on its own stack for as long as it is queued, so a
+// waiter that is preempted while it spins keeps its place (and its node)
+// until it runs again. The tail half of the lock word names the node in 32
+// bits: kernel stacks are in the higher half and the boot stack in the
+// identity-mapped image, both well within 32 GiB of their base.
+//
+// Waiting is ldaxr + WFE: the exclusive load arms the monitor, and the
+// store that changes the watched word clears it and wakes the waiter. An
+// IRQ wakes it too; on return the event register is set, so it re-checks.
+
+#include <kernel/spinlock.h>
+#include <mm/vmm.h>
+#include <stddef.h>
+
+#define SPIN_TAIL_HIGH 0x80000000u // node is in the higher half
+
+typedef struct spin_node {
+    struct spin_node *volatile next; // waiter queued behind us
+    volatile uint32_t locked;        // set when we become the queue head
+} __attribute__((aligned(16))) spin_node_t;
+
+static uint32_t encode_tail(spin_node_t *node) {
+    uint64_t addr = (uint64_t)node;
+    if (addr >= VMM_KERNEL_VIRT_BASE)
+        return (uint32_t)((addr - VMM_KERNEL_VIRT_BASE) >> 4) | SPIN_TAIL_HIGH;
+    return (uint32_t)(addr >> 4);
+}
+
+static spin_node_t *decode_tail(uint32_t tail) {
+    if (tail & SPIN_TAIL_HIGH)
+        return (spin_node_t *)(VMM_KERNEL_VIRT_BASE +
+                               ((uint64_t)(tail & ~SPIN_TAIL_HIGH) << 4));
+    return (spin_node_t *)((uint64_t)tail << 4);
+}
+
+static inline void wait_until_zero(volatile uint32_t *p) {
+    uint32_t tmp;
+    __asm__ volatile("   sevl\n"
+                     "1: wfe\n"
+                     "   ldaxr %w0, [%1]\n"
+                     "   cbnz %w0, 1b\n"
+                     : "=&r"(tmp)
+                     : "r"(p)
+                     : "memory");
+}
+
+static inline void wait_until_set(volatile uint32_t *p) {
+    uint32_t tmp;
+    __asm__ volatile("   sevl\n"
+                     "1: wfe\n"
+                     "   ldaxr %w0, [%1]\n"
+                     "   cbz %w0, 1b\n"
+                     : "=&r"(tmp)
+                     : "r"(p)
+                     : "memory");
+}
+
+static inline spin_node_t *wait_for_next(spin_node_t *node) {
+    spin_node_t *next;
+    __asm__ volatile("   sevl\n"
+                     "1: wfe\n"
+                     "   ldaxr %0, [%1]\n"
+                     "   cbz %0, 1b\n"
+                     : "=&r"(next)
+                     : "r"(&node->next)
+                     : "memory");
+    return next;
+}
+
+void spinlock_lock_slow(spinlock_t *lock) {
+    spin_node_t node = {NULL, 0};
+    uint32_t self = encode_tail(&node);
+
+    // Join the queue; a predecessor hands the head over through our node
+    uint32_t prev = __atomic_exchange_n(&lock->tail, self, __ATOMIC_ACQ_REL);
+    if (prev) {
+        __atomic_store_n(&decode_tail(prev)->next, &node, __ATOMIC_RELEASE);
+        wait_until_set(&node.locked);
+    }
+
+    // Head of the queue: wait for the holder's release
+    wait_until_zero(&lock->locked);
+
+    // Nobody behind us: take the lock and empty the queue in one go
+    uint64_t expect = (uint64_t)self << 32;
+    if (__atomic_compare_exchange_n(&lock->val, &expect, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    // Someone queued meanwhile. Only the head may set locked once it is
+    // clear (newcomers see a tail and queue), so a plain store takes it.
+    __atomic_store_n(&lock->locked, 1, __ATOMIC_RELAXED);
+    spin_node_t *next = wait_for_next(&node);
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
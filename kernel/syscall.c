@@ -1,13 +1,16 @@
 #include <kernel/printk.h>
+#include <kernel/rcu.h>
 #include <kernel/sched/task.h>
 #include <kernel/syscall.h>
 
 static int sys_kill(int pid) {
+    // The read-side section keeps the task_t from being freed under us. A
+    // task killing itself never gets back here; task_kill() ends its section.
+    rcu_read_lock();
     task_t *task = task_find_by_pid(pid);
-    if (!task)
-        return -1; // No such process
-
-    return task_kill(task);
+    int ret = task ? task_kill(task) : -1; // -1: no such process
+    rcu_read_unlock();
+    return ret;
 }
 
 static int sys_exit(int code) {
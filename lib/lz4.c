@@ -0,0 +1,164 @@
+#include <lz4.h>
+#include <string.h>
+
+// Sequence layout: token (literal length << 4 | match length - 4), extra
+// literal length bytes, literals, 16-bit little-endian offset, extra match
+// length bytes. A 4-bit field of 15 continues in bytes of 255 until a byte
+// below 255. The last sequence has literals only.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block always ends in at least 5 literals
+#define LZ4_MFLIMIT 12      // no match may start in the last 12 bytes
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Bytes needed to encode a length field's overflow beyond 15
+static inline size_t len_bytes(size_t len) {
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit literals [lit, lit+nlit) followed by a match (mlen 0: none). Returns
+// the new output pointer, or NULL if the sequence does not fit.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                             size_t nlit, uint16_t offset, size_t mlen) {
+    size_t need = 1 + len_bytes(nlit) + nlit;
+    if (mlen)
+        need += 2 + len_bytes(mlen - LZ4_MIN_MATCH);
+    if (need > (size_t)(oend - op))
+        return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = put_len(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = mlen - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (ml >= 15)
+        op = put_len(op, ml);
+    return op;
+}
+
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap,
+                    void *wrkmem) {
+    const uint8_t *in = src;
+    uint8_t *op = dst, *oend = op + cap;
+    uint16_t *table = wrkmem;
+    size_t ip = 0, anchor = 0;
+
+    if (n > LZ4_MAX_INPUT)
+        return 0;
+    memset(table, 0, LZ4_WRKMEM_SIZE);
+
+    if (n > LZ4_MFLIMIT) {
+        size_t mflimit = n - LZ4_MFLIMIT;
+        size_t matchlimit = n - LZ4_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = read32(in + ip);
+            uint32_t h = lz4_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint16_t)ip;
+            // Positions are stored modulo 64 KiB; a stale or aliased slot
+            // just fails the comparison
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+                read32(in + ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // Extend backwards over literals, then forwards
+            while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t len = LZ4_MIN_MATCH;
+            while (ip + len < matchlimit && in[ref + len] == in[ip + len])
+                len++;
+
+            op = put_sequence(op, oend, in + anchor, ip - anchor,
+                              (uint16_t)(ip - ref), len);
+            if (!op)
+                return 0;
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, in + anchor, n - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// Read a length field's continuation bytes; returns -1 on truncated input
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = ip + n;
+    uint8_t *op = dst, *oend = op + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0)
+            return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break; // last sequence: literals only
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) != 0)
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        // Byte by byte: the match may overlap the bytes it produces
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < mlen; i++)
+            op[i] = match[i];
+        op += mlen;
+    }
+    return (int)(op - (uint8_t *)dst);
+}
@@ -0,0 +1,66 @@
+// MMIO remapping on top of the VMM
+//
+// Free VA is found with the VMA tree's gap search (vmm_find_gap), so there is
+// no separate allocator to keep in sync: a mapping's VMA is its reservation.
+// ioremap_lock keeps two callers from picking the same gap. It is held across
+// the page-table allocations of vmm_map(), so it is a mutex: a caller that
+// has to wait sleeps with IRQs on.
+
+#include <kernel/mutex.h>
+#include <mm/ioremap.h>
+#include <mm/vmm.h>
+
+#define IO_PAGE_SIZE 4096ULL
+
+static mutex_t ioremap_lock = MUTEX_INIT;
+
+static void *ioremap_attrs(uint64_t pa, uint64_t size, uint32_t attrs) {
+    if (size == 0)
+        return NULL;
+
+    uint64_t offset = pa & (IO_PAGE_SIZE - 1);
+    uint64_t base = pa - offset;
+    uint64_t map_size =
+        (offset + size + IO_PAGE_SIZE - 1) & ~(IO_PAGE_SIZE - 1);
+
+    mutex_lock(&ioremap_lock);
+    uint64_t va;
+    // The gap includes a leading guard page: the search returns the lowest
+    // fit, which starts right where the previous mapping ends, so this keeps
+    // neighbouring mappings apart (no VMA merging, overruns fault)
+    if (vmm_find_gap(IOREMAP_START, IOREMAP_END, map_size + IO_PAGE_SIZE,
+                     &va) != 0)
+        goto fail;
+    va += IO_PAGE_SIZE;
+    if (vmm_map(va, base, map_size, attrs | VMM_ATTR_PXN | VMM_ATTR_UXN))
+        goto fail;
+    mutex_unlock(&ioremap_lock);
+    return (void *)(va + offset);
+
+fail:
+    mutex_unlock(&ioremap_lock);
+    return NULL;
+}
+
+void *ioremap(uint64_t pa, uint64_t size) {
+    return ioremap_attrs(pa, size, VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_DEVICE);
+}
+
+void *ioremap_nc(uint64_t pa, uint64_t size) {
+    return ioremap_attrs(pa, size,
+                         VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_DEVICE |
+                             VMM_ATTR_NP);
+}
+
+void *ioremap_wc(uint64_t pa, uint64_t size) {
+    return ioremap_attrs(pa, size, VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_WC);
+}
+
+void iounmap(void *addr) {
+    uint64_t va = (uint64_t)addr;
+    vmm_area_t area;
+    if (va < IOREMAP_START || va >= IOREMAP_END ||
+        vmm_find_area(va, &area) != 0)
+        return;
+    vmm_unmap(area.va, area.size);
+}
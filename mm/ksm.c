@@ -0,0 +1,288 @@
+// Kernel samepage merging
+//
+// ksm_scan() advances a cursor over the pages of mergeable VMAs. Each
+// populated page is hashed and looked up first among the stable frames, then
+// among this pass's unstable candidates; a hash hit is only a hint, and
+// vmm_ksm_merge() write-protects the page and compares it byte-for-byte
+// before remapping it. Two equal candidates promote the first one's frame to
+// a stable frame. Every stable frame holds one reference of its own, so its
+// contents can never change (any writer gets a copy) and it cannot be freed
+// under the table; once that reference is the only one left, the frame is
+// released at the end of the pass.
+
+#include <kernel/sched/task.h>
+#include <kernel/spinlock.h>
+#include <mm/ksm.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <string.h>
+
+#define KSM_PAGE_SIZE 4096ULL
+#define KSM_HASH_BUCKETS 64
+
+typedef struct ksm_stable {
+    void *frame;
+    uint32_t hash;
+    struct ksm_stable *next; // bucket chain, or free list
+} ksm_stable_t;
+
+typedef struct ksm_unstable {
+    uint64_t va;
+    uint64_t pa;
+    uint32_t hash;
+    struct ksm_unstable *next;
+} ksm_unstable_t;
+
+static spinlock_t ksm_lock = SPINLOCK_INIT;
+
+static ksm_stable_t stable_pool[KSM_STABLE_CAP];
+static ksm_stable_t *stable_free;
+static unsigned stable_used; // pool entries ever handed out
+static ksm_stable_t *stable_hash[KSM_HASH_BUCKETS];
+
+static ksm_unstable_t unstable_pool[KSM_UNSTABLE_CAP];
+static unsigned unstable_used; // reset every pass
+static ksm_unstable_t *unstable_hash[KSM_HASH_BUCKETS];
+
+static uint64_t scan_cursor;
+static uint32_t zero_hash;
+static int zero_hash_valid;
+static ksm_stats_t stats;
+
+static ksm_config_t config = {.pages_to_scan = 100, .sleep_ms = 20};
+static volatile int ksmd_run;
+static task_t *ksmd_task;
+
+// FNV-1a over 64-bit words, folded to 32 bits
+static uint32_t ksm_hash_words(const uint64_t *w) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (unsigned i = 0; i < KSM_PAGE_SIZE / 8; i++) {
+        h ^= w ? w[i] : 0;
+        h *= 0x100000001B3ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static int page_is_zero(const uint64_t *w) {
+    for (unsigned i = 0; i < KSM_PAGE_SIZE / 8; i++)
+        if (w[i])
+            return 0;
+    return 1;
+}
+
+static ksm_stable_t *stable_alloc(void) {
+    ksm_stable_t *s = stable_free;
+    if (s)
+        stable_free = s->next;
+    else if (stable_used < KSM_STABLE_CAP)
+        s = &stable_pool[stable_used++];
+    return s;
+}
+
+// End of a pass: forget the candidates and let go of shared frames that
+// every mapping has since copied away from or unmapped.
+static void ksm_end_pass(void) {
+    memset(unstable_hash, 0, sizeof(unstable_hash));
+    unstable_used = 0;
+
+    for (unsigned b = 0; b < KSM_HASH_BUCKETS; b++) {
+        ksm_stable_t **link = &stable_hash[b];
+        while (*link) {
+            ksm_stable_t *s = *link;
+            if (pmm_page_refcount(s->frame) > 1) {
+                link = &s->next;
+                continue;
+            }
+            *link = s->next;
+            pmm_free_page(s->frame);
+            s->next = stable_free;
+            stable_free = s;
+        }
+    }
+    stats.full_scans++;
+}
+
+static void ksm_cmp_and_merge(uint64_t va, uint64_t pa) {
+    void *page = (void *)(pa & ~(KSM_PAGE_SIZE - 1));
+    uint32_t hash = ksm_hash_words(page);
+    unsigned b = hash % KSM_HASH_BUCKETS;
+    stats.pages_scanned++;
+
+    if (!zero_hash_valid) {
+        zero_hash = ksm_hash_words(NULL);
+        zero_hash_valid = 1;
+    }
+    if (hash == zero_hash && page_is_zero(page)) {
+        if (vmm_ksm_merge(va, pa, NULL) == 0) {
+            stats.pages_merged++;
+            stats.zero_merged++;
+        }
+        return;
+    }
+
+    for (ksm_stable_t *s = stable_hash[b]; s; s = s->next) {
+        if (s->hash != hash)
+            continue;
+        if (s->frame == page)
+            return; // already shared
+        if (memcmp(page, s->frame, KSM_PAGE_SIZE) == 0) {
+            if (vmm_ksm_merge(va, pa, s->frame) == 0)
+                stats.pages_merged++;
+            return;
+        }
+    }
+
+    for (ksm_unstable_t **link = &unstable_hash[b]; *link;
+         link = &(*link)->next) {
+        ksm_unstable_t *u = *link;
+        if (u->hash != hash || u->pa == (uint64_t)page ||
+            memcmp(page, (void *)u->pa, KSM_PAGE_SIZE) != 0)
+            continue;
+        // Promote the candidate's frame: write-protect it in place and pin
+        // it for the stable table, then merge this page into it
+        *link = u->next;
+        ksm_stable_t *s = stable_alloc();
+        if (!s)
+            return;
+        if (vmm_ksm_merge(u->va, u->pa, (void *)u->pa) != 0) {
+            s->next = stable_free;
+            stable_free = s;
+            break; // the candidate went stale: this page replaces it
+        }
+        s->frame = (void *)u->pa;
+        s->hash = hash;
+        s->next = stable_hash[b];
+        stable_hash[b] = s;
+        if (vmm_ksm_merge(va, pa, s->frame) == 0)
+            stats.pages_merged++;
+        return;
+    }
+
+    if (unstable_used < KSM_UNSTABLE_CAP) {
+        ksm_unstable_t *u = &unstable_pool[unstable_used++];
+        u->va = va;
+        u->pa = (uint64_t)page;
+        u->hash = hash;
+        u->next = unstable_hash[b];
+        unstable_hash[b] = u;
+    }
+}
+
+// One step of the cursor: examine one page, or skip one VMA that is not
+// mergeable, or finish the pass.
+static void ksm_scan_step(void) {
+    vmm_area_t area;
+    if (vmm_find_next_area(scan_cursor, &area) != 0) {
+        scan_cursor = 0;
+        ksm_end_pass();
+        return;
+    }
+    uint64_t area_end = area.va + area.size;
+    if ((area.attrs & (VMM_ATTR_DEMAND | VMM_ATTR_MERGEABLE)) !=
+        (VMM_ATTR_DEMAND | VMM_ATTR_MERGEABLE)) {
+        scan_cursor = area_end;
+        if (scan_cursor == 0) // VMA reaching the top of the address space
+            ksm_end_pass();
+        return;
+    }
+
+    uint64_t va = scan_cursor > area.va ? scan_cursor : area.va;
+    va &= ~(KSM_PAGE_SIZE - 1);
+    scan_cursor = va + KSM_PAGE_SIZE;
+    uint64_t pa;
+    if (vmm_translate(va, &pa) == 0)
+        ksm_cmp_and_merge(va, pa);
+    if (scan_cursor == 0)
+        ksm_end_pass();
+}
+
+unsigned ksm_scan(unsigned nr_pages) {
+    unsigned merged = 0;
+    for (unsigned i = 0; i < nr_pages; i++) {
+        uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+        uint64_t before = stats.pages_merged;
+        ksm_scan_step();
+        merged += (unsigned)(stats.pages_merged - before);
+        spinlock_unlock_irqrestore(&ksm_lock, flags);
+    }
+    return merged;
+}
+
+int ksm_madvise(void *addr, uint64_t size, int mergeable) {
+    return vmm_set_flag((uint64_t)addr, size, VMM_ATTR_MERGEABLE, mergeable);
+}
+
+void ksm_set_config(const ksm_config_t *cfg) {
+    uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+    config = *cfg;
+    if (!config.pages_to_scan)
+        config.pages_to_scan = 1;
+    spinlock_unlock_irqrestore(&ksm_lock, flags);
+}
+
+void ksm_get_config(ksm_config_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+    *out = config;
+    spinlock_unlock_irqrestore(&ksm_lock, flags);
+}
+
+static void ksmd_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    for (;;) {
+        // Decide to exit under the lock, so a racing ksm_start() either
+        // keeps this task alive or sees it gone and creates another
+        uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+        if (!ksmd_run) {
+            ksmd_task = NULL;
+            spinlock_unlock_irqrestore(&ksm_lock, flags);
+            return;
+        }
+        ksm_config_t cfg = config;
+        spinlock_unlock_irqrestore(&ksm_lock, flags);
+
+        ksm_scan(cfg.pages_to_scan);
+        task_sleep_ns((uint64_t)cfg.sleep_ms * 1000000ULL);
+    }
+}
+
+int ksm_start(void) {
+    int ret = 0;
+    uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+    ksmd_run = 1;
+    if (!ksmd_task) {
+        // Lowest priority: merging is housekeeping
+        ksmd_task = task_create(ksmd_entry, 19, NULL);
+        if (!ksmd_task) {
+            ksmd_run = 0;
+            ret = -4;
+        }
+    }
+    spinlock_unlock_irqrestore(&ksm_lock, flags);
+    return ret;
+}
+
+void ksm_stop(void) {
+    uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+    ksmd_run = 0;
+    // Cut the sleep short so ksmd notices now rather than after sleep_ms
+    task_wake(ksmd_task);
+    spinlock_unlock_irqrestore(&ksm_lock, flags);
+}
+
+void ksm_get_stats(ksm_stats_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&ksm_lock);
+    *out = stats;
+    out->pages_shared = out->pages_sharing = 0;
+    for (unsigned b = 0; b < KSM_HASH_BUCKETS; b++) {
+        for (ksm_stable_t *s = stable_hash[b]; s; s = s->next) {
+            unsigned refs = pmm_page_refcount(s->frame);
+            if (refs <= 1)
+                continue; // waiting to be released
+            out->pages_shared++;
+            out->pages_sharing += refs - 1; // less the table's own
+        }
+    }
+    spinlock_unlock_irqrestore(&ksm_lock, flags);
+}
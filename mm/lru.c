@@ -0,0 +1,307 @@
+// Active/inactive page lists and reclaim
+//
+// One 16-byte node per PMM frame, linked by frame index. lru_lock only
+// covers the lists: it nests inside vmm_lock (the VMM calls lru_add() while
+// mapping a frame), so aging and reclaim never hold it across a call into
+// the VMM. An entry being examined is first isolated, taken off its list
+// and marked, then looked at under vmm_lock and finally put back.
+
+#include <kernel/printk.h>
+#include <kernel/sched/task.h>
+#include <kernel/spinlock.h>
+#include <mm/lru.h>
+#include <mm/mmu.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+
+#define LRU_PAGE_SIZE 4096ULL
+#define LRU_NIL UINT32_MAX
+#define LRU_BATCH 32          // pages kswapd reclaims per lru_shrink() call
+#define KSWAPD_INTERVAL_MS 50 // kswapd checks the watermarks this often
+
+enum { LRU_NONE, LRU_ACTIVE, LRU_INACTIVE, LRU_ISOLATED };
+
+typedef struct {
+    uint32_t prev;
+    uint32_t next;
+    uint32_t vpn;  // (va - VMM_KERNEL_VIRT_BASE) >> 12
+    uint8_t list;  // LRU_*
+    uint8_t readd; // lru_add() while isolated: goes back on the active list
+} lru_node_t;
+
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint64_t nr;
+} lru_list_t;
+
+static spinlock_t lru_lock = SPINLOCK_INIT;
+static lru_node_t *nodes;
+static size_t nr_nodes;
+static lru_list_t lists[LRU_INACTIVE + 1]; // by LRU_ACTIVE, LRU_INACTIVE
+static lru_watermarks_t wmark;
+static lru_stats_t stats;
+static task_t *kswapd_task;
+
+static void list_del(uint32_t i) {
+    lru_node_t *n = &nodes[i];
+    lru_list_t *l = &lists[n->list];
+    if (n->prev != LRU_NIL)
+        nodes[n->prev].next = n->next;
+    else
+        l->head = n->next;
+    if (n->next != LRU_NIL)
+        nodes[n->next].prev = n->prev;
+    else
+        l->tail = n->prev;
+    l->nr--;
+    n->list = LRU_NONE;
+}
+
+static void list_add_head(int list, uint32_t i) {
+    lru_node_t *n = &nodes[i];
+    lru_list_t *l = &lists[list];
+    n->prev = LRU_NIL;
+    n->next = l->head;
+    if (l->head != LRU_NIL)
+        nodes[l->head].prev = i;
+    else
+        l->tail = i;
+    l->head = i;
+    l->nr++;
+    n->list = (uint8_t)list;
+}
+
+int lru_init(void) {
+    size_t total = pmm_total_pages();
+    size_t bytes = total * sizeof(lru_node_t);
+    lru_node_t *table =
+        pmm_alloc_pages((bytes + LRU_PAGE_SIZE - 1) / LRU_PAGE_SIZE);
+    if (!table)
+        return -4;
+    for (size_t i = 0; i < total; i++)
+        table[i] = (lru_node_t){LRU_NIL, LRU_NIL, 0, LRU_NONE, 0};
+
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    for (int l = LRU_ACTIVE; l <= LRU_INACTIVE; l++)
+        lists[l] = (lru_list_t){LRU_NIL, LRU_NIL, 0};
+    wmark.min = total / 256;
+    wmark.low = total / 128;
+    wmark.high = total / 64;
+    nr_nodes = total;
+    nodes = table;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+
+    printk("LRU: %d frames tracked, watermarks %d/%d/%d pages%s\n",
+           (int)total, (int)wmark.min, (int)wmark.low, (int)wmark.high,
+           mmu_hw_access_flag() ? ", hardware AF" : "");
+    return 0;
+}
+
+void lru_add(void *frame, uint64_t va) {
+    size_t i = pmm_page_index(frame);
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    if (nodes && i < nr_nodes) {
+        lru_node_t *n = &nodes[i];
+        n->vpn = (uint32_t)((va - VMM_KERNEL_VIRT_BASE) >> 12);
+        if (n->list == LRU_ISOLATED) {
+            n->readd = 1;
+        } else {
+            if (n->list != LRU_NONE)
+                list_del((uint32_t)i);
+            list_add_head(LRU_ACTIVE, (uint32_t)i);
+        }
+    }
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+}
+
+// Take the tail entry of list off it for the caller to examine. Returns its
+// index, or LRU_NIL if the list is empty.
+static uint32_t lru_isolate(int list, uint64_t *va, void **frame) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    uint32_t i = nodes ? lists[list].tail : LRU_NIL;
+    if (i != LRU_NIL) {
+        list_del(i);
+        nodes[i].list = LRU_ISOLATED;
+        *va = VMM_KERNEL_VIRT_BASE + ((uint64_t)nodes[i].vpn << 12);
+        *frame = pmm_index_to_page(i);
+        stats.scanned++;
+    }
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+    return i;
+}
+
+// Put an isolated entry at the head of list (LRU_NONE drops it) and count
+// the outcome in *stat. A frame re-added meanwhile is active again, whatever
+// happened to its old mapping.
+static void lru_putback(uint32_t i, int list, uint64_t *stat) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    lru_node_t *n = &nodes[i];
+    if (n->readd) {
+        n->readd = 0;
+        list = LRU_ACTIVE;
+    }
+    if (list == LRU_NONE)
+        n->list = LRU_NONE;
+    else
+        list_add_head(list, i);
+    if (stat)
+        (*stat)++;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+}
+
+// Age the active tail: a page used since it was last looked at goes round
+// again, an unused one moves to the inactive list. Returns 0 if the active
+// list is empty.
+static int lru_age_one(void) {
+    uint64_t va;
+    void *frame;
+    uint32_t i = lru_isolate(LRU_ACTIVE, &va, &frame);
+    if (i == LRU_NIL)
+        return 0;
+    int young = vmm_page_young(va, frame);
+    if (young < 0)
+        lru_putback(i, LRU_NONE, &stats.stale);
+    else if (young)
+        lru_putback(i, LRU_ACTIVE, NULL);
+    else
+        lru_putback(i, LRU_INACTIVE, &stats.deactivated);
+    return 1;
+}
+
+unsigned lru_age(unsigned nr) {
+    unsigned n = 0;
+    while (n < nr && lru_age_one())
+        n++;
+    return n;
+}
+
+static int inactive_is_low(uint64_t *total) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    uint64_t active = lists[LRU_ACTIVE].nr, inactive = lists[LRU_INACTIVE].nr;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+    if (total)
+        *total = active + inactive;
+    return inactive < active;
+}
+
+unsigned lru_shrink(unsigned nr) {
+    unsigned freed = 0;
+    uint64_t budget;
+    inactive_is_low(&budget);
+    // Every entry may have to be aged twice, then reclaimed
+    budget *= 4;
+
+    while (freed < nr && budget--) {
+        // Keep the inactive list at least as long as the active one, so an
+        // inactive page has had a whole list's worth of time to be touched
+        if (inactive_is_low(NULL)) {
+            lru_age_one();
+            continue;
+        }
+        uint64_t va;
+        void *frame;
+        uint32_t i = lru_isolate(LRU_INACTIVE, &va, &frame);
+        if (i == LRU_NIL) {
+            if (!lru_age_one())
+                break;
+            continue;
+        }
+
+        int young = vmm_page_young(va, frame);
+        if (young < 0) {
+            lru_putback(i, LRU_NONE, &stats.stale);
+            continue;
+        }
+        if (young) {
+            lru_putback(i, LRU_ACTIVE, &stats.activated);
+            continue;
+        }
+        int ret = vmm_reclaim_page(va, frame);
+        if (ret == 0) {
+            lru_putback(i, LRU_NONE, &stats.reclaimed);
+            freed++;
+        } else if (ret == -4) {
+            lru_putback(i, LRU_INACTIVE, NULL);
+            break; // zram is full: nothing else will go either
+        } else if (ret < 0) {
+            lru_putback(i, LRU_NONE, &stats.stale);
+        } else {
+            // Shared or incompressible: give it another round
+            lru_putback(i, LRU_ACTIVE, NULL);
+        }
+    }
+    return freed;
+}
+
+int lru_madvise(void *addr, uint64_t size, int swappable) {
+    int ret = vmm_set_flag((uint64_t)addr, size, VMM_ATTR_SWAPPABLE, swappable);
+    if (ret || !swappable)
+        return ret;
+
+    // Pages populated so far were never listed
+    for (uint64_t off = 0; off < size; off += LRU_PAGE_SIZE) {
+        uint64_t pa;
+        if (vmm_translate((uint64_t)addr + off, &pa) != 0)
+            continue;
+        void *frame = (void *)(pa & ~(LRU_PAGE_SIZE - 1));
+        if (pmm_page_refcount(frame) == 1)
+            lru_add(frame, (uint64_t)addr + off);
+    }
+    return 0;
+}
+
+void lru_set_watermarks(const lru_watermarks_t *wm) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    wmark = *wm;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+}
+
+void lru_get_watermarks(lru_watermarks_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    *out = wmark;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+}
+
+static void kswapd_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    int warned = 0;
+    for (;;) {
+        lru_watermarks_t wm;
+        lru_get_watermarks(&wm);
+        if (pmm_free_pages_count() < wm.low) {
+            uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+            stats.kswapd_runs++;
+            spinlock_unlock_irqrestore(&lru_lock, flags);
+
+            while (pmm_free_pages_count() < wm.high)
+                if (!lru_shrink(LRU_BATCH))
+                    break;
+        }
+        size_t free = pmm_free_pages_count();
+        if (free < wm.min && !warned)
+            printk("kswapd: %d pages free, below min watermark %d\n",
+                   (int)free, (int)wm.min);
+        warned = free < wm.min;
+
+        task_sleep_ns(KSWAPD_INTERVAL_MS * 1000000ULL);
+    }
+}
+
+int kswapd_start(void) {
+    // Lowest priority: reclaim runs in the background. Called once at boot;
+    // task_create() maps memory, so lru_lock must not be held here.
+    if (!kswapd_task)
+        kswapd_task = task_create(kswapd_entry, 19, NULL);
+    return kswapd_task ? 0 : -4;
+}
+
+void lru_get_stats(lru_stats_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&lru_lock);
+    *out = stats;
+    out->nr_active = lists[LRU_ACTIVE].nr;
+    out->nr_inactive = lists[LRU_INACTIVE].nr;
+    spinlock_unlock_irqrestore(&lru_lock, flags);
+}
@@ -11,6 +11,7 @@
 
 static uint64_t *ttbr0_pgd = NULL; // Identity mapping
 static uint64_t *ttbr1_pgd = NULL; // Higher-half kernel
+static int hw_af;                  // TCR_EL1.HA set: hardware Access Flag
 
 #define PGD_SHIFT 39
 #define PUD_SHIFT 30
@@ -18,6 +19,7 @@ static uint64_t *ttbr1_pgd = NULL; // Higher-half kernel
 #define PTE_SHIFT 12
 
 #define TABLE_ENTRIES 512
+#define ALIGN_DOWN_PMD(x) ((x) & ~((1ULL << PMD_SHIFT) - 1))
 
 static inline uint64_t *alloc_table(void) {
     void *p = pmm_alloc_page();
@@ -120,21 +122,61 @@ void mmu_init(void) {
            (void *)(virt_base + kend), (void *)0ULL, (void *)kend);
 }
 
+#ifdef EARLY_MMU
+extern void early_mmu_off(void); // boot.S
+#endif
+
+void mmu_early_map_check(uint64_t ram_end) {
+#ifdef EARLY_MMU
+    uint64_t sctlr;
+    __asm__ volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    if (!(sctlr & 1) || ram_end <= EARLY_MMU_RAM_END)
+        return;
+    early_mmu_off();
+    printk("MMU: RAM ends at %p, past the early map; early MMU off\n",
+           (void *)ram_end);
+#else
+    (void)ram_end;
+#endif
+}
+
 void mmu_enable(void) {
 
     uint64_t mair = (MAIR_DEVICE_nGnRnE << (8 * MAIR_IDX_DEVICE)) |
                     (MAIR_NORMAL_NC << (8 * MAIR_IDX_NORMAL_NC)) |
-                    (MAIR_NORMAL << (8 * MAIR_IDX_NORMAL));
+                    (MAIR_NORMAL << (8 * MAIR_IDX_NORMAL)) |
+                    (MAIR_DEVICE_nGnRE << (8 * MAIR_IDX_DEVICE_nGnRE));
 
+    // Table walks are inner shareable and write-back cacheable, as in boot.S
     uint64_t tcr = (16ULL << 0) |  // T0SZ = 16 (48-bit)
-                   (16ULL << 16) | // T1SZ = 16
+                   (1ULL << 8) |   // IRGN0 = WB
+                   (1ULL << 10) |  // ORGN0 = WB
+                   (3ULL << 12) |  // SH0 = inner shareable
                    (0ULL << 14) |  // TG0 = 4KB
+                   (16ULL << 16) | // T1SZ = 16
+                   (1ULL << 24) |  // IRGN1 = WB
+                   (1ULL << 26) |  // ORGN1 = WB
+                   (3ULL << 28) |  // SH1 = inner shareable
                    (2ULL << 30);   // TG1 = 4KB
 
-    __asm__ volatile("msr mair_el1, %0\n"
+    // ID_AA64MMFR1_EL1.HAFDBS != 0: the walker can set AF itself instead of
+    // faulting, which takes the page-aging faults off the fault path
+    uint64_t mmfr1;
+    __asm__ volatile("mrs %0, id_aa64mmfr1_el1" : "=r"(mmfr1));
+    if (mmfr1 & 0xF) {
+        tcr |= 1ULL << 39; // HA
+        hw_af = 1;
+    }
+
+    // The MMU may already be on with the boot.S tables: flush their entries
+    __asm__ volatile("dsb ishst\n"
+                     "msr mair_el1, %0\n"
                      "msr tcr_el1, %1\n"
                      "msr ttbr0_el1, %2\n"
                      "msr ttbr1_el1, %3\n"
+                     "isb\n"
+                     "tlbi vmalle1\n"
+                     "dsb nsh\n"
                      "isb\n" ::"r"(mair),
                      "r"(tcr), "r"(ttbr0_pgd), "r"(ttbr1_pgd));
 
@@ -144,9 +186,11 @@ void mmu_enable(void) {
     __asm__ volatile("msr sctlr_el1, %0\n"
                      "isb\n" ::"r"(sctlr));
 
-    printk("MMU: enabled\n");
+    printk("MMU: enabled%s\n", hw_af ? " (hardware AF)" : "");
 }
 
+int mmu_hw_access_flag(void) { return hw_af; }
+
 uint64_t mmu_get_ttbr0(void) {
     uint64_t val;
     __asm__ volatile("mrs %0, ttbr0_el1" : "=r"(val));
@@ -159,6 +203,39 @@ uint64_t mmu_get_ttbr1(void) {
     return val;
 }
 
+#define PAR_F (1ULL << 0)
+#define PAR_PA_MASK 0x0000FFFFFFFFF000ULL
+
+int mmu_translate(uint64_t va, uint64_t *pa_out) {
+    uint64_t daif, par;
+
+    // PAR_EL1 is shared state: keep an IRQ handler from issuing its own AT
+    // between ours and the read-back.
+    __asm__ volatile("mrs %0, daif" : "=r"(daif));
+    __asm__ volatile("msr daifset, #2" ::: "memory");
+    __asm__ volatile("at s1e1r, %1\n"
+                     "isb\n"
+                     "mrs %0, par_el1"
+                     : "=r"(par)
+                     : "r"(va)
+                     : "memory");
+    __asm__ volatile("msr daif, %0" ::"r"(daif) : "memory");
+
+    if (par & PAR_F) {
+        // An aged page (AF clear) is still mapped, but without hardware AF
+        // management AT reports an Access flag fault for it: walk the tables
+        if (((par >> 1) & 0x3C) != 0x08)
+            return -1;
+        uint64_t ttbr = (va >> 63) ? mmu_get_ttbr1() : mmu_get_ttbr0();
+        uint64_t desc = mmu_get_pte((uint64_t *)(ttbr & PAR_PA_MASK), va);
+        if (!(desc & PTE_VALID))
+            return -1;
+        par = desc;
+    }
+    *pa_out = (par & PAR_PA_MASK) | (va & MMU_PAGE_MASK);
+    return 0;
+}
+
 void mmu_switch_to_higher_half(void) {
     uint64_t offset = vmm_kernel_base();
 
@@ -220,6 +297,110 @@ int mmu_unmap_page(uint64_t *pgd, uint64_t va) {
     return 0;
 }
 
+// Find the L3 table covering va without allocating. On success *pmd_entry
+// points at the L2 descriptor referencing it.
+static uint64_t *lookup_pte_table(uint64_t *pgd, uint64_t va,
+                                  uint64_t **pmd_entry) {
+    uint64_t *pud, *pmd;
+    int idx;
+
+    idx = pgd_index(va);
+    if (!(pgd[idx] & PTE_VALID))
+        return NULL;
+    pud = (uint64_t *)(pgd[idx] & ~0xFFFULL);
+
+    idx = pud_index(va);
+    if (!(pud[idx] & PTE_VALID))
+        return NULL;
+    pmd = (uint64_t *)(pud[idx] & ~0xFFFULL);
+
+    idx = pmd_index(va);
+    if (!(pmd[idx] & PTE_VALID))
+        return NULL;
+    if (pmd_entry)
+        *pmd_entry = &pmd[idx];
+    return (uint64_t *)(pmd[idx] & ~0xFFFULL);
+}
+
+uint64_t mmu_get_pte(uint64_t *pgd, uint64_t va) {
+    uint64_t *pte = lookup_pte_table(pgd, va, NULL);
+    return pte ? pte[pte_index(va)] : 0;
+}
+
+int mmu_set_pte(uint64_t *pgd, uint64_t va, uint64_t desc) {
+    uint64_t *pte = lookup_pte_table(pgd, va, NULL);
+    if (!pte)
+        return -1;
+    pte[pte_index(va)] = desc;
+    __asm__ volatile("dsb ishst" ::: "memory");
+    return 0;
+}
+
+int mmu_test_and_clear_young(uint64_t *pgd, uint64_t va) {
+    uint64_t *pte = lookup_pte_table(pgd, va, NULL);
+    if (!pte || !(pte[pte_index(va)] & PTE_VALID))
+        return -1;
+    uint64_t *p = &pte[pte_index(va)];
+    int young = (*p & PTE_AF) != 0;
+    if (young) {
+        // Atomic: with hardware AF the walker updates the entry itself
+        __atomic_fetch_and(p, ~PTE_AF, __ATOMIC_RELAXED);
+        __asm__ volatile("dsb ishst" ::: "memory");
+    }
+    return young;
+}
+
+int mmu_mkyoung(uint64_t *pgd, uint64_t va) {
+    uint64_t *pte = lookup_pte_table(pgd, va, NULL);
+    if (!pte || !(pte[pte_index(va)] & PTE_VALID))
+        return -1;
+    __atomic_fetch_or(&pte[pte_index(va)], PTE_AF, __ATOMIC_RELAXED);
+    __asm__ volatile("dsb ishst\n"
+                     "isb" ::: "memory");
+    return 0;
+}
+
+static int pte_table_empty(const uint64_t *pte) {
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        if (pte[i])
+            return 0;
+    }
+    return 1;
+}
+
+uint64_t mmu_unmap_range(uint64_t *pgd, uint64_t va, uint64_t size,
+                         mmu_gather_t *tlb) {
+    uint64_t end = va + size;
+    uint64_t unmapped = 0;
+
+    while (va < end) {
+        // Process one L3 table (2 MiB span) per iteration
+        uint64_t span_end = ALIGN_DOWN_PMD(va + (1ULL << PMD_SHIFT));
+        if (span_end > end || span_end == 0)
+            span_end = end;
+
+        uint64_t *pmd_entry = NULL;
+        uint64_t *pte = lookup_pte_table(pgd, va, &pmd_entry);
+        if (pte) {
+            for (uint64_t a = va; a < span_end; a += MMU_PAGE_SIZE) {
+                int idx = pte_index(a);
+                if (pte[idx] & PTE_VALID)
+                    unmapped++;
+                pte[idx] = 0;
+            }
+            tlb_gather_range(tlb, va, span_end - va);
+            // Release the L3 table once nothing maps through it anymore. The
+            // walker may still cache it, so it is freed only after the flush.
+            if (pte_table_empty(pte)) {
+                *pmd_entry = 0;
+                tlb_remove_page(tlb, pte);
+            }
+        }
+        va = span_end;
+    }
+    return unmapped;
+}
+
 int mmu_update_page_attrs(uint64_t *pgd, uint64_t va, uint64_t attrs) {
     int idx;
     uint64_t *pud, *pmd, *pte;
@@ -0,0 +1,222 @@
+// NUMA topology from the device tree
+//
+// QEMU describes nodes with a numa-node-id property on each memory node and
+// CPU node, and the distances between them with a numa-distance-map-v1
+// node holding (from, to, distance) triplets. Tables are filled once at
+// boot by numa_init(), before the PMM builds its per-node pools.
+
+#include <dtb.h>
+#include <kernel/printk.h>
+#include <kernel/rwlock.h>
+#include <mm/numa.h>
+#include <string.h>
+
+// Fallback orders are read on every page allocation and rewritten only by
+// numa_set_fallback_order(): allocations read them side by side
+static rwlock_t numa_lock = RWLOCK_INIT;
+static numa_memblk_t memblks[NUMA_MAX_MEMBLKS];
+static int nr_memblks;
+static int nr_nodes = 1;
+static int cpu_node;
+static uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static int8_t fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t nr_fallback[NUMA_MAX_NODES];
+
+// Properties are only 4-byte aligned: read cells bytewise
+static inline uint32_t be32_at(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+static uint64_t read_cells(const uint8_t **q, int cells) {
+    uint64_t v = 0;
+    for (int c = 0; c < cells; c++, *q += 4)
+        v = (v << 32) | be32_at(*q);
+    return v;
+}
+
+static void parse_dtb(void) {
+    struct dtb_header *hdr = dtb_get();
+    if (!hdr || be32_at((const uint8_t *)&hdr->magic) != 0xd00dfeed)
+        return;
+
+    const uint8_t *fdt = (const uint8_t *)hdr;
+    const uint8_t *p = fdt + be32_at((const uint8_t *)&hdr->off_dt_struct);
+    const char *strings =
+        (const char *)fdt + be32_at((const uint8_t *)&hdr->off_dt_strings);
+
+    int depth = 0, ac = 2, sc = 2;
+    int in_memory = 0, in_distmap = 0, in_cpus = 0, in_cpu = 0;
+    int cpu_seen = 0;
+    int blk_first = 0, blk_node = 0; // blocks of the current memory node
+
+    for (;;) {
+        uint32_t token = be32_at(p);
+        p += 4;
+        if (token == DTB_BEGIN_NODE) {
+            const char *name = (const char *)p;
+            size_t len = strlen(name);
+            p += (len + 4) & ~3u;
+            depth++;
+            if (depth == 2) {
+                in_memory = strncmp(name, "memory", 6) == 0 &&
+                            (name[6] == '\0' || name[6] == '@');
+                in_distmap = strncmp(name, "distance-map", 12) == 0;
+                in_cpus = strcmp(name, "cpus") == 0;
+                blk_first = nr_memblks;
+                blk_node = 0;
+            } else if (depth == 3 && in_cpus) {
+                in_cpu = strncmp(name, "cpu@", 4) == 0;
+            }
+        } else if (token == DTB_PROP) {
+            uint32_t len = be32_at(p);
+            const char *pname = strings + be32_at(p + 4);
+            const uint8_t *data = p + 8;
+            p += 8 + ((len + 3) & ~3u);
+
+            if (depth == 1 && strcmp(pname, "#address-cells") == 0 && len >= 4)
+                ac = (int)be32_at(data);
+            else if (depth == 1 && strcmp(pname, "#size-cells") == 0 &&
+                     len >= 4)
+                sc = (int)be32_at(data);
+            else if (depth == 2 && in_memory && strcmp(pname, "reg") == 0) {
+                uint32_t tuple = (uint32_t)(ac + sc) * 4;
+                const uint8_t *q = data;
+                for (uint32_t off = 0; tuple && off + tuple <= len;
+                     off += tuple) {
+                    uint64_t base = read_cells(&q, ac);
+                    uint64_t size = read_cells(&q, sc);
+                    if (size && nr_memblks < NUMA_MAX_MEMBLKS)
+                        memblks[nr_memblks++] =
+                            (numa_memblk_t){base, size, 0};
+                }
+            } else if (depth == 2 && in_memory &&
+                       strcmp(pname, "numa-node-id") == 0 && len >= 4) {
+                blk_node = (int)be32_at(data);
+            } else if (depth == 3 && in_cpu && !cpu_seen &&
+                       strcmp(pname, "numa-node-id") == 0 && len >= 4) {
+                // The first CPU listed is the boot CPU on QEMU virt
+                cpu_node = (int)be32_at(data);
+                cpu_seen = 1;
+            } else if (depth == 2 && in_distmap &&
+                       strcmp(pname, "distance-matrix") == 0) {
+                for (uint32_t off = 0; off + 12 <= len; off += 12) {
+                    uint32_t from = be32_at(data + off);
+                    uint32_t to = be32_at(data + off + 4);
+                    uint32_t d = be32_at(data + off + 8);
+                    if (from >= NUMA_MAX_NODES || to >= NUMA_MAX_NODES ||
+                        d > 255)
+                        continue;
+                    // One direction given implies the other
+                    distance[from][to] = distance[to][from] = (uint8_t)d;
+                }
+            }
+        } else if (token == DTB_END_NODE) {
+            if (depth == 2 && in_memory) {
+                if (blk_node < 0 || blk_node >= NUMA_MAX_NODES) {
+                    printk("NUMA: node %d out of range, using node 0\n",
+                           blk_node);
+                    blk_node = 0;
+                }
+                for (int i = blk_first; i < nr_memblks; i++)
+                    memblks[i].node = blk_node;
+            }
+            if (depth == 3)
+                in_cpu = 0;
+            if (depth == 2)
+                in_memory = in_distmap = in_cpus = 0;
+            if (depth > 0)
+                depth--;
+        } else if (token != DTB_NOP) {
+            break; // DTB_END or garbage
+        }
+    }
+}
+
+static void build_fallback(int node) {
+    int n = 0;
+    for (int i = 0; i < nr_nodes; i++) {
+        // Insertion sort by distance; equal distances keep node id order
+        int j = n++;
+        while (j > 0 && distance[node][fallback[node][j - 1]] >
+                            distance[node][i]) {
+            fallback[node][j] = fallback[node][j - 1];
+            j--;
+        }
+        fallback[node][j] = (int8_t)i;
+    }
+    nr_fallback[node] = (uint8_t)n;
+}
+
+int numa_init(void) {
+    for (int i = 0; i < NUMA_MAX_NODES; i++)
+        for (int j = 0; j < NUMA_MAX_NODES; j++)
+            distance[i][j] =
+                i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+    nr_memblks = 0;
+    cpu_node = 0;
+    parse_dtb();
+
+    nr_nodes = 1;
+    for (int i = 0; i < nr_memblks; i++)
+        if (memblks[i].node >= nr_nodes)
+            nr_nodes = memblks[i].node + 1;
+    if (cpu_node < 0 || cpu_node >= nr_nodes)
+        cpu_node = 0;
+    for (int n = 0; n < nr_nodes; n++)
+        build_fallback(n);
+
+    if (nr_nodes > 1) {
+        printk("NUMA: %d nodes, %d memory blocks, boot CPU on node %d\n",
+               nr_nodes, nr_memblks, cpu_node);
+        for (int i = 0; i < nr_memblks; i++)
+            printk("NUMA:   node %d: %p-%p\n", memblks[i].node,
+                   (void *)memblks[i].base,
+                   (void *)(memblks[i].base + memblks[i].size));
+    }
+    return nr_memblks;
+}
+
+int numa_nr_memblks(void) { return nr_memblks; }
+
+const numa_memblk_t *numa_memblk(int idx) {
+    return idx >= 0 && idx < nr_memblks ? &memblks[idx] : NULL;
+}
+
+int numa_nr_nodes(void) { return nr_nodes; }
+
+int numa_node_id(void) { return cpu_node; }
+
+int numa_distance(int from, int to) {
+    if (from < 0 || from >= nr_nodes || to < 0 || to >= nr_nodes)
+        return -1;
+    return distance[from][to];
+}
+
+int numa_fallback_order(int node, int *order) {
+    if (node < 0 || node >= nr_nodes)
+        return 0;
+    uint64_t flags = read_lock_irqsave(&numa_lock);
+    int n = nr_fallback[node];
+    for (int i = 0; i < n; i++)
+        order[i] = fallback[node][i];
+    read_unlock_irqrestore(&numa_lock, flags);
+    return n;
+}
+
+int numa_set_fallback_order(int node, const int *order, int n) {
+    if (node < 0 || node >= nr_nodes || n < 1 || n > nr_nodes)
+        return -1;
+    unsigned seen = 0;
+    for (int i = 0; i < n; i++) {
+        if (order[i] < 0 || order[i] >= nr_nodes || (seen & (1u << order[i])))
+            return -1;
+        seen |= 1u << order[i];
+    }
+    uint64_t flags = write_lock_irqsave(&numa_lock);
+    for (int i = 0; i < n; i++)
+        fallback[node][i] = (int8_t)order[i];
+    nr_fallback[node] = (uint8_t)n;
+    write_unlock_irqrestore(&numa_lock, flags);
+    return 0;
+}
@@ -1,8 +1,14 @@
 // Physical Memory Manager (PMM) — simple bitmap allocator
+//
+// One bitmap spans all RAM; each NUMA node's free pool is the set of bitmap
+// ranges covering its memory blocks, searched on their own, with a free
+// count per node. Holes between blocks stay marked allocated forever.
 
 #include <dtb.h>
 #include <kernel/printk.h>
 #include <kernel/spinlock.h>
+#include <mm/mmu.h>
+#include <mm/numa.h>
 #include <mm/pmm.h>
 #include <string.h>
 
@@ -14,6 +20,22 @@ static uint64_t pmm_mem_base = 0; // Base of managed RAM region
 static uint64_t pmm_mem_size = 0; // Size of managed RAM region
 static size_t pmm_pages_total = 0;
 static size_t pmm_pages_free = 0;
+// Per-frame reference counts, one entry per managed page. Allocated from the
+// managed range itself at init; NULL until then. Reserved frames, the table's
+// own included, are pinned: never freed, never shared.
+static uint16_t *pmm_refcount = NULL;
+#define PMM_REF_PINNED UINT16_MAX
+
+// A memory block as a range of page indices, owned by one node
+typedef struct {
+    size_t first;
+    size_t end;
+    int node;
+} pmm_block_t;
+
+static pmm_block_t pmm_blocks[NUMA_MAX_MEMBLKS];
+static int pmm_nr_blocks;
+static pmm_node_stats_t pmm_nodes[NUMA_MAX_NODES];
 
 // Symbols from linker/boot for reserved ranges
 extern char _kernel_start[];
@@ -39,6 +61,14 @@ static inline uint64_t page_to_addr(size_t page) {
     return pmm_mem_base + (uint64_t)page * PMM_PAGE_SIZE;
 }
 
+// Node owning page idx, or NUMA_NO_NODE for a hole between blocks
+static int page_node(size_t idx) {
+    for (int b = 0; b < pmm_nr_blocks; b++)
+        if (idx >= pmm_blocks[b].first && idx < pmm_blocks[b].end)
+            return pmm_blocks[b].node;
+    return NUMA_NO_NODE;
+}
+
 static void reserve_range(uint64_t start, uint64_t size) {
     if (size == 0)
         return;
@@ -63,125 +93,17 @@ static void reserve_range(uint64_t start, uint64_t size) {
             set_bit(i);
             if (pmm_pages_free)
                 pmm_pages_free--;
+            pmm_nodes[page_node(i)].free--;
         }
     }
 }
 
-// Minimal DTB parsing helpers for memory node and reg property
+// Minimal DTB parsing helpers
 static inline uint32_t be32_to_cpu_u32(uint32_t v) {
     return ((v & 0xFFu) << 24) | ((v & 0xFF00u) << 8) | ((v & 0xFF0000u) >> 8) |
            ((v & 0xFF000000u) >> 24);
 }
 
-static int dtb_find_memory_region(uint64_t *base_out, uint64_t *size_out) {
-    struct dtb_header *hdr = dtb_get();
-    if (!hdr)
-        return -1;
-    if (be32_to_cpu_u32(hdr->magic) != 0xd00dfeed)
-        return -1;
-
-    const uint8_t *fdt = (const uint8_t *)hdr;
-    uint32_t off_struct = be32_to_cpu_u32(hdr->off_dt_struct);
-    uint32_t off_strings = be32_to_cpu_u32(hdr->off_dt_strings);
-    const char *strings = (const char *)(fdt + off_strings);
-
-    uint32_t p = off_struct;
-    int depth = 0;
-    int in_memory_node = 0; // true when current node is a memory node
-    int device_type_memory =
-        0; // true if device_type=="memory" seen for current node
-    // Read #address-cells and #size-cells from the parent (root) by default.
-    int parent_addr_cells = 2; // default for 64-bit
-    int parent_size_cells = 2; // default for 64-bit
-
-    while (1) {
-        uint32_t token = be32_to_cpu_u32(*(const uint32_t *)(fdt + p));
-        p += 4;
-        if (token == DTB_BEGIN_NODE) {
-            const char *name = (const char *)(fdt + p);
-            size_t name_len = 0;
-            while (name[name_len] != '\0')
-                name_len++;
-            p += (name_len + 4) & ~3u;
-            depth++;
-            // Memory nodes are typically named "memory" or "memory@..."
-            in_memory_node = (name_len >= 6 && strncmp(name, "memory", 6) == 0);
-            device_type_memory = 0; // reset when entering a node
-        } else if (token == DTB_PROP) {
-            uint32_t len = be32_to_cpu_u32(*(const uint32_t *)(fdt + p));
-            p += 4;
-            uint32_t nameoff = be32_to_cpu_u32(*(const uint32_t *)(fdt + p));
-            p += 4;
-            const char *pname = strings + nameoff;
-            const uint8_t *pdata = fdt + p;
-            // Track device_type property
-            if (in_memory_node && pname[0] == 'd' && pname[1] == 'e' &&
-                pname[2] == 'v' && pname[3] == 'i' && pname[4] == 'c' &&
-                pname[5] == 'e' && pname[6] == '_' && pname[7] == 't' &&
-                pname[8] == 'y' && pname[9] == 'p' && pname[10] == 'e' &&
-                pname[11] == '\0') {
-                // pdata is a string like "memory\0"
-                if (len >= 6 &&
-                    strncmp((const char *)pdata, "memory", 6) == 0) {
-                    device_type_memory = 1;
-                }
-            }
-            // Capture root-level #address-cells and #size-cells (depth==1 means
-            // root's properties)
-            if (depth == 1) {
-                if (strcmp(pname, "#address-cells") == 0 && len >= 4) {
-                    parent_addr_cells =
-                        (int)be32_to_cpu_u32(*(const uint32_t *)pdata);
-                } else if (strcmp(pname, "#size-cells") == 0 && len >= 4) {
-                    parent_size_cells =
-                        (int)be32_to_cpu_u32(*(const uint32_t *)pdata);
-                }
-            }
-            if (in_memory_node && pname[0] == 'r' && pname[1] == 'e' &&
-                pname[2] == 'g' && pname[3] == '\0') {
-                // Assume 64-bit address/size pairs if len >= 16; else 32-bit.
-                uint64_t base = 0, size = 0;
-                int ac = parent_addr_cells > 0 ? parent_addr_cells : 2;
-                int sc = parent_size_cells > 0 ? parent_size_cells : 2;
-                const uint8_t *q = pdata;
-                // Only read the first tuple
-                for (int c = 0; c < ac && (q + 4) <= (pdata + len); ++c) {
-                    uint32_t cell = be32_to_cpu_u32(*(const uint32_t *)q);
-                    q += 4;
-                    base = (base << 32) | cell;
-                }
-                for (int c = 0; c < sc && (q + 4) <= (pdata + len); ++c) {
-                    uint32_t cell = be32_to_cpu_u32(*(const uint32_t *)q);
-                    q += 4;
-                    size = (size << 32) | cell;
-                }
-                // Only accept if either name matched (memory or memory@) or
-                // device_type was explicitly memory
-                if (in_memory_node || device_type_memory) {
-                    if (base_out)
-                        *base_out = base;
-                    if (size_out)
-                        *size_out = size;
-                    return 0;
-                }
-            }
-            p += (len + 3) & ~3u;
-        } else if (token == DTB_END_NODE) {
-            if (depth > 0)
-                depth--;
-            in_memory_node = 0;
-            device_type_memory = 0;
-        } else if (token == DTB_NOP) {
-            // skip
-        } else if (token == DTB_END) {
-            break;
-        } else {
-            break;
-        }
-    }
-    return -1;
-}
-
 // Reserve regions from /reserved-memory
 static void reserve_reserved_memory(void) {
     struct dtb_header *hdr = dtb_get();
@@ -311,8 +233,20 @@ void pmm_init_from_dtb(void) {
     for (size_t i = 0; i < sizeof(pmm_bitmap); ++i)
         pmm_bitmap[i] = 0xFFu;
 
+    // The managed range spans every memory block in the DTB
     uint64_t base = 0, size = 0;
-    if (dtb_find_memory_region(&base, &size) != 0 || size == 0) {
+    int nr_memblks = numa_init();
+    for (int i = 0; i < nr_memblks; i++) {
+        const numa_memblk_t *m = numa_memblk(i);
+        uint64_t end = base + size;
+        if (!size || m->base < base)
+            base = m->base;
+        if (m->base + m->size > end)
+            end = m->base + m->size;
+        size = end - base;
+    }
+    if (size == 0) {
+        nr_memblks = 0;
         // Fallback: if DTB not available, assume 1 GiB at 0x40000000 (QEMU
         // virt)
         base = 0x40000000ULL;
@@ -340,12 +274,38 @@ void pmm_init_from_dtb(void) {
     pmm_pages_total = (size_t)(pmm_mem_size / PMM_PAGE_SIZE);
     if (pmm_pages_total > PMM_MAX_PAGES)
         pmm_pages_total = PMM_MAX_PAGES;
-
-    // Mark all pages in managed range as free initially
-    for (size_t i = 0; i < pmm_pages_total; ++i) {
-        clear_bit(i);
+    // Only the image has been written so far: the last point at which the
+    // early MMU can still be dropped if it does not cover every frame
+    mmu_early_map_check(pmm_mem_base + pmm_pages_total * PMM_PAGE_SIZE);
+
+    // Mark the pages of every memory block free initially, in its node's
+    // pool; without NUMA information all RAM is one block of node 0
+    pmm_nr_blocks = 0;
+    for (int i = 0; i < nr_memblks; i++) {
+        const numa_memblk_t *m = numa_memblk(i);
+        uint64_t lo = (m->base + PMM_PAGE_SIZE - 1) & ~(PMM_PAGE_SIZE - 1);
+        uint64_t hi = (m->base + m->size) & ~(PMM_PAGE_SIZE - 1);
+        if (hi <= lo || lo < pmm_mem_base)
+            continue;
+        size_t first = addr_to_page(lo), limit = addr_to_page(hi);
+        if (limit > pmm_pages_total)
+            limit = pmm_pages_total;
+        if (first < limit)
+            pmm_blocks[pmm_nr_blocks++] =
+                (pmm_block_t){first, limit, m->node};
+    }
+    if (pmm_nr_blocks == 0)
+        pmm_blocks[pmm_nr_blocks++] = (pmm_block_t){0, pmm_pages_total, 0};
+
+    pmm_pages_free = 0;
+    for (int b = 0; b < pmm_nr_blocks; b++) {
+        pmm_block_t *blk = &pmm_blocks[b];
+        for (size_t i = blk->first; i < blk->end; ++i)
+            clear_bit(i);
+        pmm_nodes[blk->node].total += blk->end - blk->first;
+        pmm_nodes[blk->node].free += blk->end - blk->first;
+        pmm_pages_free += blk->end - blk->first;
     }
-    pmm_pages_free = pmm_pages_total;
 
     // Reserve critical regions: kernel image, boot stack, DTB blob, and memory
     // below base if misaligned
@@ -372,43 +332,98 @@ void pmm_init_from_dtb(void) {
 
     printk("PMM: managing %d pages (base=%p size=%p)\n", (int)pmm_pages_total,
            (void *)pmm_mem_base, (void *)pmm_mem_size);
+    if (numa_nr_nodes() > 1) {
+        for (int n = 0; n < numa_nr_nodes(); n++)
+            printk("PMM: node %d: %d pages, %d free\n", n,
+                   (int)pmm_nodes[n].total, (int)pmm_nodes[n].free);
+    }
+
+    // The refcount table lives in managed RAM. Everything allocated so far is
+    // a reserved range or the table itself: pin it, so pmm_free_pages()
+    // rejects a stray free instead of handing the frames out again.
+    size_t rc_bytes = pmm_pages_total * sizeof(uint16_t);
+    size_t rc_pages = (rc_bytes + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+    uint16_t *rc = pmm_alloc_pages(rc_pages);
+    if (!rc) {
+        printk("PMM: cannot allocate refcount table (%d pages)\n",
+               (int)rc_pages);
+        return;
+    }
+    memset(rc, 0, rc_pages * PMM_PAGE_SIZE);
+    for (size_t i = 0; i < pmm_pages_total; ++i) {
+        if (test_bit(i))
+            rc[i] = PMM_REF_PINNED;
+    }
+    pmm_refcount = rc;
 }
 
-static void *pmm_alloc_run(size_t count) {
-    uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
+// Claim a run of count free frames from node's pool. Caller holds pmm_lock.
+// Returns the first page index, or (size_t)-1 if no run fits.
+static size_t claim_run(int node, size_t count) {
+    if (pmm_nodes[node].free < count)
+        return (size_t)-1;
+    for (int b = 0; b < pmm_nr_blocks; b++) {
+        if (pmm_blocks[b].node != node)
+            continue;
+        size_t run = 0;
+        size_t run_start = 0;
+        for (size_t i = pmm_blocks[b].first; i < pmm_blocks[b].end; ++i) {
+            if (test_bit(i)) {
+                run = 0;
+                continue;
+            }
+            if (run == 0)
+                run_start = i;
+            if (++run < count)
+                continue;
+            // mark allocated
+            for (size_t j = 0; j < count; ++j) {
+                set_bit(run_start + j);
+                if (pmm_refcount)
+                    pmm_refcount[run_start + j] = 1;
+            }
+            pmm_nodes[node].free -= count;
+            pmm_pages_free -= count;
+            return run_start;
+        }
+    }
+    return (size_t)-1;
+}
+
+void *pmm_alloc_pages_node(int node, size_t count) {
+    if (node == NUMA_NO_NODE)
+        node = numa_node_id();
+    int order[NUMA_MAX_NODES];
+    int nr = numa_fallback_order(node, order);
 
+    uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
     if (count == 0 || count > pmm_pages_free) {
         spinlock_unlock_irqrestore(&pmm_lock, flags);
         return NULL;
     }
-
-    size_t run = 0;
-    size_t run_start = 0;
-    for (size_t i = 0; i < pmm_pages_total; ++i) {
-        if (!test_bit(i)) {
-            if (run == 0)
-                run_start = i;
-            run++;
-            if (run == count) {
-                // mark allocated
-                for (size_t j = 0; j < count; ++j)
-                    set_bit(run_start + j);
-                pmm_pages_free -= count;
-                spinlock_unlock_irqrestore(&pmm_lock, flags);
-                return (void *)(page_to_addr(run_start));
-            }
+    for (int i = 0; i < nr; i++) {
+        size_t idx = claim_run(order[i], count);
+        if (idx == (size_t)-1)
+            continue;
+        if (order[i] == node) {
+            pmm_nodes[node].local++;
         } else {
-            run = 0;
+            pmm_nodes[order[i]].miss++;
+            pmm_nodes[node].foreign++;
         }
+        spinlock_unlock_irqrestore(&pmm_lock, flags);
+        return (void *)page_to_addr(idx);
     }
 
     spinlock_unlock_irqrestore(&pmm_lock, flags);
     return NULL;
 }
 
-void *pmm_alloc_pages(size_t count) { return pmm_alloc_run(count); }
+void *pmm_alloc_pages(size_t count) {
+    return pmm_alloc_pages_node(NUMA_NO_NODE, count);
+}
 
-void *pmm_alloc_page(void) { return pmm_alloc_run(1); }
+void *pmm_alloc_page(void) { return pmm_alloc_pages_node(NUMA_NO_NODE, 1); }
 
 void pmm_free_pages(void *addr, size_t count) {
     uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
@@ -429,14 +444,30 @@ void pmm_free_pages(void *addr, size_t count) {
     size_t first = addr_to_page(a);
     for (size_t i = 0; i < count && (first + i) < pmm_pages_total; ++i) {
         size_t idx = first + i;
+        int node = page_node(idx);
+        if (node == NUMA_NO_NODE)
+            continue; // a hole, never handed out
         if (!test_bit(idx)) {
             // double free detection
             printk("PMM: warning: double-free page %d at %p ignored\n",
                    (int)idx, (void *)page_to_addr(idx));
             continue;
         }
+        if (pmm_refcount && pmm_refcount[idx] == PMM_REF_PINNED) {
+            printk("PMM: warning: free of reserved page %d at %p ignored\n",
+                   (int)idx, (void *)page_to_addr(idx));
+            continue;
+        }
+        // Shared frames (COW) only lose this owner's reference
+        if (pmm_refcount && pmm_refcount[idx] > 1) {
+            pmm_refcount[idx]--;
+            continue;
+        }
+        if (pmm_refcount)
+            pmm_refcount[idx] = 0;
         clear_bit(idx);
         pmm_pages_free++;
+        pmm_nodes[node].free++;
     }
 
     spinlock_unlock_irqrestore(&pmm_lock, flags);
@@ -444,6 +475,63 @@ void pmm_free_pages(void *addr, size_t count) {
 
 void pmm_free_page(void *addr) { pmm_free_pages(addr, 1); }
 
+// Returns the page index of an allocated, refcounted frame, or -1.
+static long refcounted_page(uint64_t a) {
+    if (!pmm_refcount || a < pmm_mem_base || a >= pmm_mem_base + pmm_mem_size)
+        return -1;
+    size_t idx = addr_to_page(a);
+    if (idx >= pmm_pages_total || !test_bit(idx) || pmm_refcount[idx] == 0 ||
+        pmm_refcount[idx] == PMM_REF_PINNED)
+        return -1;
+    return (long)idx;
+}
+
+int pmm_page_get(void *addr) {
+    uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
+    long idx = refcounted_page((uint64_t)addr);
+    if (idx < 0 || pmm_refcount[idx] == PMM_REF_PINNED - 1) {
+        spinlock_unlock_irqrestore(&pmm_lock, flags);
+        return -1;
+    }
+    pmm_refcount[idx]++;
+    spinlock_unlock_irqrestore(&pmm_lock, flags);
+    return 0;
+}
+
+unsigned pmm_page_refcount(void *addr) {
+    uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
+    long idx = refcounted_page((uint64_t)addr);
+    unsigned count = idx < 0 ? 0 : pmm_refcount[idx];
+    spinlock_unlock_irqrestore(&pmm_lock, flags);
+    return count;
+}
+
+int pmm_page_node(void *addr) {
+    uint64_t a = (uint64_t)addr;
+    if (a < pmm_mem_base || a >= pmm_mem_base + pmm_mem_size)
+        return NUMA_NO_NODE;
+    return page_node(addr_to_page(a));
+}
+
+int pmm_get_node_stats(int node, pmm_node_stats_t *out) {
+    if (node < 0 || node >= numa_nr_nodes())
+        return -1;
+    uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
+    *out = pmm_nodes[node];
+    spinlock_unlock_irqrestore(&pmm_lock, flags);
+    return out->total ? 0 : -1;
+}
+
+size_t pmm_page_index(void *addr) {
+    uint64_t a = (uint64_t)addr;
+    if (a < pmm_mem_base || a >= pmm_mem_base + pmm_mem_size)
+        return (size_t)-1;
+    size_t idx = addr_to_page(a);
+    return idx < pmm_pages_total ? idx : (size_t)-1;
+}
+
+void *pmm_index_to_page(size_t idx) { return (void *)page_to_addr(idx); }
+
 size_t pmm_total_pages(void) {
     uint64_t flags = spinlock_lock_irqsave(&pmm_lock);
     size_t total = pmm_pages_total;
@@ -474,6 +562,35 @@ int pmm_check(void) {
         return -1;
     }
 
+    // Every node's free count matches its blocks
+    for (int n = 0; n < numa_nr_nodes(); n++) {
+        size_t free = 0;
+        for (int b = 0; b < pmm_nr_blocks; b++) {
+            if (pmm_blocks[b].node != n)
+                continue;
+            for (size_t i = pmm_blocks[b].first; i < pmm_blocks[b].end; ++i)
+                free += !test_bit(i);
+        }
+        if (free != pmm_nodes[n].free) {
+            printk("PMM: check failed, node %d free=%d expected=%d\n", n,
+                   (int)free, (int)pmm_nodes[n].free);
+            spinlock_unlock_irqrestore(&pmm_lock, flags);
+            return -1;
+        }
+    }
+
+    // Every free frame must have dropped its last reference
+    if (pmm_refcount) {
+        for (size_t i = 0; i < pmm_pages_total; ++i) {
+            if (!test_bit(i) && pmm_refcount[i] != 0) {
+                printk("PMM: check failed, free page %d has refcount %d\n",
+                       (int)i, (int)pmm_refcount[i]);
+                spinlock_unlock_irqrestore(&pmm_lock, flags);
+                return -1;
+            }
+        }
+    }
+
     spinlock_unlock_irqrestore(&pmm_lock, flags);
     return 0;
 }
@@ -1,8 +1,12 @@
 // TLB and cache maintenance operations for ARM64
 
 #include <mm/mmu.h>
+#include <mm/pmm.h>
 #include <stdint.h>
 
+// Past this many pages a full invalidation is cheaper than per-page TLBIs
+#define TLB_FLUSH_ALL_THRESHOLD 512
+
 void tlb_flush_all(void) {
     __asm__ volatile("dsb ishst\n"
                      "tlbi vmalle1is\n"
@@ -21,7 +25,13 @@ void tlb_flush_page(uint64_t va) {
 }
 
 void tlb_flush_range(uint64_t va, uint64_t size) {
+    if (size / MMU_PAGE_SIZE > TLB_FLUSH_ALL_THRESHOLD) {
+        tlb_flush_all();
+        return;
+    }
+
     uint64_t end = va + size;
+    __asm__ volatile("dsb ishst" ::: "memory");
     for (uint64_t addr = va; addr < end; addr += MMU_PAGE_SIZE) {
         __asm__ volatile("lsr x0, %0, #12\n"
                          "tlbi vaae1is, x0\n" ::"r"(addr)
@@ -30,6 +40,43 @@ void tlb_flush_range(uint64_t va, uint64_t size) {
     __asm__ volatile("dsb ish\nisb\n" ::: "memory");
 }
 
+void tlb_gather_mmu(mmu_gather_t *tlb) {
+    tlb->start = UINT64_MAX;
+    tlb->end = 0;
+    tlb->nr_pages = 0;
+}
+
+void tlb_gather_range(mmu_gather_t *tlb, uint64_t va, uint64_t size) {
+    if (size == 0)
+        return;
+    if (va < tlb->start)
+        tlb->start = va;
+    if (va + size > tlb->end)
+        tlb->end = va + size;
+}
+
+void tlb_flush_mmu(mmu_gather_t *tlb) {
+    if (tlb->end > tlb->start)
+        tlb_flush_range(tlb->start, tlb->end - tlb->start);
+    tlb->start = UINT64_MAX;
+    tlb->end = 0;
+
+    // Only now can no walker or TLB hold a reference to these frames
+    for (uint32_t i = 0; i < tlb->nr_pages; i++)
+        pmm_free_page(tlb->pages[i]);
+    tlb->nr_pages = 0;
+}
+
+void tlb_remove_page(mmu_gather_t *tlb, void *page) {
+    if (!page)
+        return;
+    if (tlb->nr_pages == MMU_GATHER_BATCH)
+        tlb_flush_mmu(tlb);
+    tlb->pages[tlb->nr_pages++] = page;
+}
+
+void tlb_finish_mmu(mmu_gather_t *tlb) { tlb_flush_mmu(tlb); }
+
 void cache_flush_range(uint64_t va, uint64_t size) {
     uint64_t line_size = 64;
     uint64_t start = va & ~(line_size - 1);
@@ -0,0 +1,471 @@
+// Range B-tree for VMA indexing
+//
+// Leaves hold up to VMT_SLOTS sorted, non-overlapping [pivot, last) ranges.
+// Internal slots hold a child plus a summary of it: its lowest start, its
+// highest end and the largest free gap between ranges inside it. Gaps that
+// straddle two children are recomputed from neighbouring summaries, so a
+// change only ever needs to be propagated along the path to the root.
+//
+// Nodes split in half when full. One that drops below a quarter full is
+// merged into a sibling, or topped up from a sibling too full to merge with,
+// so every node but the root stays at least a quarter full.
+
+#include <mm/vma_tree.h>
+
+#define VMT_MIN_FILL (VMT_SLOTS / 4)
+// Upper bound on nodes visited by one gap search; a consistent tree needs
+// about two root-to-leaf paths, so only a walk racing a writer can hit it.
+#define VMT_GAP_BUDGET (VMT_SLOTS * VMT_MAX_HEIGHT)
+
+void vmt_init(vma_tree_t *tree, vmt_node_t *nodes, size_t nr_nodes) {
+    tree->root = NULL;
+    tree->nodes = nodes;
+    tree->nr_nodes = nr_nodes;
+    tree->free_list = NULL;
+    tree->nr_free = 0;
+    tree->nr_entries = 0;
+    for (size_t i = nr_nodes; i-- > 0;) {
+        nodes[i].count = 0;
+        nodes[i].parent = tree->free_list;
+        tree->free_list = &nodes[i];
+        tree->nr_free++;
+    }
+}
+
+static vmt_node_t *node_alloc(vma_tree_t *tree, int leaf) {
+    vmt_node_t *n = tree->free_list;
+    if (!n)
+        return NULL;
+    tree->free_list = n->parent;
+    tree->nr_free--;
+    n->parent = NULL;
+    n->count = 0;
+    n->leaf = (uint8_t)leaf;
+    return n;
+}
+
+static void node_free(vma_tree_t *tree, vmt_node_t *n) {
+    n->count = 0;
+    n->parent = tree->free_list;
+    tree->free_list = n;
+    tree->nr_free++;
+}
+
+// --- Reader helpers: must stay safe on a tree a writer is modifying ---
+
+static int valid_node(const vma_tree_t *tree, const void *p) {
+    uintptr_t base = (uintptr_t)tree->nodes;
+    uintptr_t addr = (uintptr_t)p;
+    if (addr < base || addr >= base + tree->nr_nodes * sizeof(vmt_node_t))
+        return 0;
+    return (addr - base) % sizeof(vmt_node_t) == 0;
+}
+
+static inline int node_count(const vmt_node_t *n) {
+    int count = n->count;
+    return count > VMT_SLOTS ? VMT_SLOTS : count;
+}
+
+// Last slot whose pivot is <= addr, or -1 if addr precedes them all
+static int slot_le(const vmt_node_t *n, int count, uint64_t addr) {
+    int i = 0;
+    while (i < count && n->pivot[i] <= addr)
+        i++;
+    return i - 1;
+}
+
+static void fill_entry(const vmt_node_t *leaf, int i, vmt_entry_t *out) {
+    out->start = leaf->pivot[i];
+    out->end = leaf->last[i];
+    out->data = leaf->slot[i];
+}
+
+int vmt_find_le(const vma_tree_t *tree, uint64_t addr, vmt_entry_t *out) {
+    const vmt_node_t *n = tree->root;
+    for (int depth = 0; depth < VMT_MAX_HEIGHT; depth++) {
+        if (!valid_node(tree, n))
+            return 0;
+        int i = slot_le(n, node_count(n), addr);
+        if (i < 0)
+            return 0;
+        if (n->leaf) {
+            fill_entry(n, i, out);
+            return 1;
+        }
+        n = n->slot[i];
+    }
+    return 0;
+}
+
+static int leftmost(const vma_tree_t *tree, const vmt_node_t *n, int depth,
+                    vmt_entry_t *out) {
+    for (; depth < VMT_MAX_HEIGHT; depth++) {
+        if (!valid_node(tree, n) || node_count(n) == 0)
+            return 0;
+        if (n->leaf) {
+            fill_entry(n, 0, out);
+            return 1;
+        }
+        n = n->slot[0];
+    }
+    return 0;
+}
+
+static int ge_walk(const vma_tree_t *tree, const vmt_node_t *n, uint64_t addr,
+                   int depth, vmt_entry_t *out) {
+    if (depth >= VMT_MAX_HEIGHT || !valid_node(tree, n))
+        return 0;
+    int count = node_count(n);
+    if (n->leaf) {
+        for (int i = 0; i < count; i++) {
+            if (n->pivot[i] >= addr) {
+                fill_entry(n, i, out);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    int i = slot_le(n, count, addr);
+    if (i < 0)
+        i = 0;
+    if (ge_walk(tree, n->slot[i], addr, depth + 1, out))
+        return 1;
+    // Everything in child i precedes addr: the answer opens child i + 1
+    if (i + 1 < count)
+        return leftmost(tree, n->slot[i + 1], depth + 1, out);
+    return 0;
+}
+
+int vmt_find_ge(const vma_tree_t *tree, uint64_t addr, vmt_entry_t *out) {
+    return ge_walk(tree, tree->root, addr, 0, out);
+}
+
+typedef struct {
+    const vma_tree_t *tree;
+    uint64_t lo, hi, size;
+    uint64_t prev_end; // end of the last range visited, at least lo
+    int budget;
+} gap_walk_t;
+
+// In-order walk over holes. Returns 1 when a hole fits, -1 once the walk
+// passed hi (or ran out of budget), 0 to continue with the next sibling.
+static int gap_walk(gap_walk_t *w, const vmt_node_t *n, int depth,
+                    uint64_t *out) {
+    if (depth >= VMT_MAX_HEIGHT || !valid_node(w->tree, n) || --w->budget < 0)
+        return -1;
+    int count = node_count(n);
+    for (int i = 0; i < count; i++) {
+        uint64_t s = w->prev_end > w->lo ? w->prev_end : w->lo;
+        if (s >= w->hi)
+            return -1;
+        uint64_t lim = n->pivot[i] < w->hi ? n->pivot[i] : w->hi;
+        if (lim > s && lim - s >= w->size) {
+            *out = s;
+            return 1;
+        }
+        if (n->pivot[i] >= w->hi)
+            return -1;
+        // Descend only if a large enough hole may live inside the child;
+        // holes clipped by lo only shrink, so the summary prunes safely.
+        if (!n->leaf && n->last[i] > w->lo && n->gap[i] >= w->size) {
+            int ret = gap_walk(w, n->slot[i], depth + 1, out);
+            if (ret)
+                return ret;
+        }
+        if (n->last[i] > w->prev_end)
+            w->prev_end = n->last[i];
+    }
+    return 0;
+}
+
+int vmt_find_gap(const vma_tree_t *tree, uint64_t lo, uint64_t hi,
+                 uint64_t size, uint64_t *out) {
+    if (!out || size == 0 || lo >= hi || hi - lo < size)
+        return -1;
+
+    gap_walk_t w = {.tree = tree,
+                    .lo = lo,
+                    .hi = hi,
+                    .size = size,
+                    .prev_end = lo,
+                    .budget = VMT_GAP_BUDGET};
+    const vmt_node_t *root = tree->root;
+    if (root) {
+        int ret = gap_walk(&w, root, 0, out);
+        if (ret > 0)
+            return 0;
+        if (ret < 0)
+            return -1;
+    }
+
+    // Hole after the last range
+    uint64_t s = w.prev_end > lo ? w.prev_end : lo;
+    if (s < hi && hi - s >= size) {
+        *out = s;
+        return 0;
+    }
+    return -1;
+}
+
+// --- Writer side: callers serialize ---
+
+static uint64_t node_gap(const vmt_node_t *n) {
+    uint64_t gap = 0;
+    for (int i = 0; i < n->count; i++) {
+        if (!n->leaf && n->gap[i] > gap)
+            gap = n->gap[i];
+        if (i > 0 && n->pivot[i] - n->last[i - 1] > gap)
+            gap = n->pivot[i] - n->last[i - 1];
+    }
+    return gap;
+}
+
+static int parent_slot(const vmt_node_t *n) {
+    const vmt_node_t *p = n->parent;
+    for (int i = 0; i < p->count; i++) {
+        if (p->slot[i] == n)
+            return i;
+    }
+    return -1;
+}
+
+// Refresh the parent's summary of n; returns 1 if anything changed
+static int update_summary(vmt_node_t *n) {
+    vmt_node_t *p = n->parent;
+    int i = parent_slot(n);
+    uint64_t pivot = n->pivot[0];
+    uint64_t last = n->last[n->count - 1];
+    uint64_t gap = node_gap(n);
+    if (p->pivot[i] == pivot && p->last[i] == last && p->gap[i] == gap)
+        return 0;
+    p->pivot[i] = pivot;
+    p->last[i] = last;
+    p->gap[i] = gap;
+    return 1;
+}
+
+static void propagate(vmt_node_t *n) {
+    while (n->parent && update_summary(n))
+        n = n->parent;
+}
+
+static void move_slot(vmt_node_t *dst, int di, const vmt_node_t *src,
+                      int si) {
+    dst->pivot[di] = src->pivot[si];
+    dst->last[di] = src->last[si];
+    dst->gap[di] = src->gap[si];
+    dst->slot[di] = src->slot[si];
+    if (!dst->leaf)
+        ((vmt_node_t *)dst->slot[di])->parent = dst;
+}
+
+static void node_insert_at(vmt_node_t *n, int pos, uint64_t pivot,
+                           uint64_t last, uint64_t gap, void *slot) {
+    for (int i = n->count; i > pos; i--)
+        move_slot(n, i, n, i - 1);
+    n->pivot[pos] = pivot;
+    n->last[pos] = last;
+    n->gap[pos] = gap;
+    n->slot[pos] = slot;
+    if (!n->leaf)
+        ((vmt_node_t *)slot)->parent = n;
+    n->count++;
+}
+
+static void node_remove_at(vmt_node_t *n, int pos) {
+    for (int i = pos; i + 1 < n->count; i++)
+        move_slot(n, i, n, i + 1);
+    n->count--;
+}
+
+static int tree_height(const vma_tree_t *tree) {
+    int height = 0;
+    for (const vmt_node_t *n = tree->root; n; n = n->leaf ? NULL : n->slot[0])
+        height++;
+    return height;
+}
+
+int vmt_can_insert(const vma_tree_t *tree, unsigned nr) {
+    // Each insert can split every level and add a new root
+    return tree->nr_free >= nr * (unsigned)(tree_height(tree) + 1);
+}
+
+// Move the upper half of a full node into a new right sibling. The caller
+// has checked that enough nodes are free for a split at every level.
+static vmt_node_t *node_split(vma_tree_t *tree, vmt_node_t *n) {
+    if (!n->parent) {
+        vmt_node_t *root = node_alloc(tree, 0);
+        node_insert_at(root, 0, n->pivot[0], n->last[n->count - 1],
+                       node_gap(n), n);
+        tree->root = root;
+    } else if (n->parent->count == VMT_SLOTS) {
+        node_split(tree, n->parent);
+    }
+
+    vmt_node_t *p = n->parent;
+    vmt_node_t *right = node_alloc(tree, n->leaf);
+    int half = n->count / 2;
+    for (int i = half; i < n->count; i++)
+        move_slot(right, i - half, n, i);
+    right->count = (uint8_t)(n->count - half);
+    n->count = (uint8_t)half;
+
+    int i = parent_slot(n);
+    node_insert_at(p, i + 1, right->pivot[0], right->last[right->count - 1],
+                   node_gap(right), right);
+    update_summary(n);
+    return right;
+}
+
+static vmt_node_t *descend(const vma_tree_t *tree, uint64_t addr) {
+    vmt_node_t *n = tree->root;
+    while (n && !n->leaf) {
+        int i = slot_le(n, n->count, addr);
+        n = n->slot[i < 0 ? 0 : i];
+    }
+    return n;
+}
+
+static int leaf_find(const vmt_node_t *leaf, uint64_t start) {
+    for (int i = 0; leaf && i < leaf->count; i++) {
+        if (leaf->pivot[i] == start)
+            return i;
+    }
+    return -1;
+}
+
+int vmt_insert(vma_tree_t *tree, uint64_t start, uint64_t end, void *data) {
+    vmt_entry_t e;
+    if (start >= end)
+        return -1;
+    if (vmt_find_le(tree, end - 1, &e) && e.end > start)
+        return -1;
+    if (!vmt_can_insert(tree, 1))
+        return -4;
+
+    if (!tree->root)
+        tree->root = node_alloc(tree, 1);
+
+    vmt_node_t *leaf = descend(tree, start);
+    int split = leaf->count == VMT_SLOTS;
+    if (split) {
+        vmt_node_t *right = node_split(tree, leaf);
+        if (start >= right->pivot[0])
+            leaf = right;
+    }
+    int pos = slot_le(leaf, leaf->count, start) + 1;
+    node_insert_at(leaf, pos, start, end, 0, data);
+    tree->nr_entries++;
+
+    // A split changes ancestors that the early-exit walk would not reach
+    if (split) {
+        for (vmt_node_t *n = leaf; n->parent; n = n->parent)
+            update_summary(n);
+    } else {
+        propagate(leaf);
+    }
+    return 0;
+}
+
+int vmt_set_end(vma_tree_t *tree, uint64_t start, uint64_t end) {
+    vmt_node_t *leaf = descend(tree, start);
+    int i = leaf_find(leaf, start);
+    if (i < 0 || end <= start)
+        return -1;
+    leaf->last[i] = end;
+    propagate(leaf);
+    return 0;
+}
+
+// Fold b (the right neighbour of a under the same parent) into a
+static void node_merge(vma_tree_t *tree, vmt_node_t *a, vmt_node_t *b) {
+    for (int i = 0; i < b->count; i++)
+        move_slot(a, a->count + i, b, i);
+    a->count = (uint8_t)(a->count + b->count);
+    node_remove_at(b->parent, parent_slot(b));
+    node_free(tree, b);
+    update_summary(a);
+}
+
+// Move the last k slots of left to the front of n, its right neighbour
+static void borrow_left(vmt_node_t *left, vmt_node_t *n, int k) {
+    for (int i = n->count - 1; i >= 0; i--)
+        move_slot(n, i + k, n, i);
+    for (int i = 0; i < k; i++)
+        move_slot(n, i, left, left->count - k + i);
+    n->count = (uint8_t)(n->count + k);
+    left->count = (uint8_t)(left->count - k);
+    update_summary(left);
+    update_summary(n);
+}
+
+// Move the first k slots of right to the end of n, its left neighbour
+static void borrow_right(vmt_node_t *n, vmt_node_t *right, int k) {
+    for (int i = 0; i < k; i++)
+        move_slot(n, n->count + i, right, i);
+    n->count = (uint8_t)(n->count + k);
+    for (int i = k; i < right->count; i++)
+        move_slot(right, i - k, right, i);
+    right->count = (uint8_t)(right->count - k);
+    update_summary(n);
+    update_summary(right);
+}
+
+static void rebalance(vma_tree_t *tree, vmt_node_t *n) {
+    while (n->parent) {
+        vmt_node_t *p = n->parent;
+        int i = parent_slot(n);
+        if (n->count == 0) {
+            node_remove_at(p, i);
+            node_free(tree, n);
+        } else if (n->count < VMT_MIN_FILL) {
+            vmt_node_t *left = i > 0 ? p->slot[i - 1] : NULL;
+            vmt_node_t *right = i + 1 < p->count ? p->slot[i + 1] : NULL;
+            if (left && left->count + n->count <= VMT_SLOTS) {
+                node_merge(tree, left, n);
+            } else if (right && n->count + right->count <= VMT_SLOTS) {
+                node_merge(tree, n, right);
+            } else if (left || right) {
+                // The sibling holds more than VMT_SLOTS - VMT_MIN_FILL, so it
+                // stays above the bound after giving up the difference
+                int k = VMT_MIN_FILL - n->count;
+                if (left)
+                    borrow_left(left, n, k);
+                else
+                    borrow_right(n, right, k);
+                propagate(p);
+                return;
+            } else {
+                // Only child: p is below the bound too, fix it up instead
+                propagate(n);
+            }
+        } else {
+            propagate(n);
+            return;
+        }
+        n = p;
+    }
+
+    // n is the root: drop it once empty, collapse single-child levels
+    while (n->count == 0 || (!n->leaf && n->count == 1)) {
+        vmt_node_t *child = n->count ? n->slot[0] : NULL;
+        if (child)
+            child->parent = NULL;
+        tree->root = child;
+        node_free(tree, n);
+        if (!child)
+            break;
+        n = child;
+    }
+}
+
+int vmt_erase(vma_tree_t *tree, uint64_t start) {
+    vmt_node_t *leaf = descend(tree, start);
+    int i = leaf_find(leaf, start);
+    if (i < 0)
+        return -1;
+    node_remove_at(leaf, i);
+    tree->nr_entries--;
+    rebalance(tree, leaf);
+    return 0;
+}
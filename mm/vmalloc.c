@@ -1,9 +1,14 @@
 // VMM allocator with coalescing free-list and guard pages
+//
+// Allocations are demand-paged: vmalloc() only reserves VA and records a
+// VMM_ATTR_DEMAND VMA, and frames are allocated on first touch. Guard pages
+// are reserved VA with no VMA behind them, so an overrun faults. vclone()
+// copies an allocation copy-on-write: both share frames until written.
 
 #include <kernel/printk.h>
 #include <kernel/spinlock.h>
 #include <mm/mmu.h>
-#include <mm/pmm.h>
+#include <mm/vmalloc.h>
 #include <mm/vmm.h>
 
 #define VMALLOC_START 0xFFFFFF8080000000ULL
@@ -193,46 +198,11 @@ void *vmalloc(uint64_t size) {
     if (!base_va)
         return NULL;
 
-    void *guard1 = pmm_alloc_page();
-    if (!guard1) {
-        add_free_space(base_va, total_size);
-        return NULL;
-    }
-    vmm_map(base_va, (uint64_t)guard1, GUARD_SIZE, VMM_ATTR_PXN);
-
     uint64_t data_va = base_va + GUARD_SIZE;
-    for (uint64_t i = 0; i < pages; i++) {
-        void *page = pmm_alloc_page();
-        if (!page) {
-            for (uint64_t j = 0; j < i; j++) {
-                uint64_t pa;
-                vmm_virt_to_phys(data_va + j * 4096, &pa);
-                vmm_unmap(data_va + j * 4096, 4096);
-                pmm_free_page((void *)pa);
-            }
-            vmm_unmap(base_va, GUARD_SIZE);
-            pmm_free_page(guard1);
-            add_free_space(base_va, total_size);
-            return NULL;
-        }
-        vmm_map(data_va + i * 4096, (uint64_t)page, 4096,
-                VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_NORMAL | VMM_ATTR_PXN);
-    }
-
-    void *guard2 = pmm_alloc_page();
-    if (!guard2) {
-        for (uint64_t i = 0; i < pages; i++) {
-            uint64_t pa;
-            vmm_virt_to_phys(data_va + i * 4096, &pa);
-            vmm_unmap(data_va + i * 4096, 4096);
-            pmm_free_page((void *)pa);
-        }
-        vmm_unmap(base_va, GUARD_SIZE);
-        pmm_free_page(guard1);
+    if (vmm_map(data_va, 0, data_size, VMALLOC_ATTRS) != 0) {
         add_free_space(base_va, total_size);
         return NULL;
     }
-    vmm_map(data_va + data_size, (uint64_t)guard2, GUARD_SIZE, VMM_ATTR_PXN);
 
     return (void *)data_va;
 }
@@ -247,25 +217,42 @@ void vfree(void *ptr, uint64_t size) {
     uint64_t base_va = data_va - GUARD_SIZE;
     uint64_t total_size = data_size + 2 * GUARD_SIZE;
 
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t pa;
-        if (vmm_virt_to_phys(data_va + i * 4096, &pa) == 0) {
-            vmm_unmap(data_va + i * 4096, 4096);
-            pmm_free_page((void *)pa);
-        }
-    }
+    // The whole allocation is torn down under one gather: a single TLB flush
+    // covers it before any populated frame goes back to the PMM. The frames
+    // are collected from the PTEs under vmm_lock, so reclaim and samepage
+    // merging cannot replace one in between.
+    mmu_gather_t tlb;
+    tlb_gather_mmu(&tlb);
+    vmm_unmap_gather(data_va, data_size, &tlb);
+    tlb_finish_mmu(&tlb);
 
-    uint64_t pa;
-    if (vmm_virt_to_phys(base_va, &pa) == 0) {
-        vmm_unmap(base_va, GUARD_SIZE);
-        pmm_free_page((void *)pa);
-    }
-    if (vmm_virt_to_phys(data_va + data_size, &pa) == 0) {
-        vmm_unmap(data_va + data_size, GUARD_SIZE);
-        pmm_free_page((void *)pa);
+    add_free_space(base_va, total_size);
+}
+
+void *vclone(const void *src, uint64_t size) {
+    if (!src || size == 0)
+        return NULL;
+
+    uint64_t pages = (size + 4095) / 4096;
+    uint64_t data_size = pages * 4096;
+    uint64_t total_size = data_size + 2 * GUARD_SIZE;
+
+    uint64_t base_va = find_free_space(total_size);
+    if (!base_va)
+        return NULL;
+
+    uint64_t data_va = base_va + GUARD_SIZE;
+    int ret = vmm_clone((uint64_t)src, data_va, data_size);
+    if (ret != 0) {
+        // -4 can leave a partial clone behind; -3 means nothing was mapped
+        if (ret == -4)
+            vfree((void *)data_va, data_size);
+        else
+            add_free_space(base_va, total_size);
+        return NULL;
     }
 
-    add_free_space(base_va, total_size);
+    return (void *)data_va;
 }
 
 void vmalloc_stats(void) {
@@ -1,10 +1,23 @@
-// Minimal VMM with RB-tree VMA manager
+// Minimal VMM with a range B-tree VMA index (mm/vma_tree.c)
+//
+// Writers serialize on vmm_lock and publish every index change inside a
+// vma_seq write section. Lookups take no lock: they walk the tree under a
+// seqcount snapshot and retry if a writer raced with them. Tree nodes and
+// VMA records live in static pools and are never returned to the allocator,
+// so a racing walk can read stale entries but never unmapped memory; the
+// tree bounds every reader loop and rejects pointers outside its pool.
 
 #include <kernel/printk.h>
+#include <kernel/seqlock.h>
 #include <kernel/spinlock.h>
+#include <mm/lru.h>
 #include <mm/mmu.h>
+#include <mm/pmm.h>
+#include <mm/vma_tree.h>
 #include <mm/vmm.h>
+#include <mm/zram.h>
 #include <stdint.h>
+#include <string.h>
 
 // 4 KiB page alignment for now
 #define VMM_PAGE_SIZE 4096ULL
@@ -12,389 +25,282 @@
 #define ALIGN_UP(x, a)                                                         \
     (((uint64_t)(x) + ((uint64_t)(a) - 1)) & ~((uint64_t)(a) - 1))
 
-typedef enum { RB_RED = 0, RB_BLACK = 1 } rb_color_t;
+#define VMA_POOL_CAP 256
+// Nodes below the root stay at least a quarter full, so a full record pool
+// needs at most 64 + 16 + 4 + 1 of these, leaving room for splits
+#define VMA_NODE_CAP (VMA_POOL_CAP / 2)
 
-typedef struct vma_node {
-    uint64_t va;
+// Per-VMA payload; the range itself lives in the tree
+typedef struct vma {
     uint64_t pa;
-    uint64_t size; // bytes
     uint32_t attrs;
-    // RB-tree links
-    struct vma_node *left;
-    struct vma_node *right;
-    struct vma_node *parent;
-    rb_color_t color;
-} vma_node_t;
-
-static vma_node_t *vma_root = NULL;
-static spinlock_t vmm_lock;
+    struct vma *next_free;
+} vma_t;
 
-static inline int is_red(vma_node_t *n) { return n && n->color == RB_RED; }
-static inline int is_black(vma_node_t *n) { return !n || n->color == RB_BLACK; }
-
-static void rotate_left(vma_node_t **root, vma_node_t *x) {
-    vma_node_t *y = x->right;
-    x->right = y->left;
-    if (y->left)
-        y->left->parent = x;
-    y->parent = x->parent;
-    if (!x->parent)
-        *root = y;
-    else if (x == x->parent->left)
-        x->parent->left = y;
-    else
-        x->parent->right = y;
-    y->left = x;
-    x->parent = y;
-}
-
-static void rotate_right(vma_node_t **root, vma_node_t *y) {
-    vma_node_t *x = y->left;
-    y->left = x->right;
-    if (x->right)
-        x->right->parent = y;
-    x->parent = y->parent;
-    if (!y->parent)
-        *root = x;
-    else if (y == y->parent->left)
-        y->parent->left = x;
-    else
-        y->parent->right = x;
-    x->right = y;
-    y->parent = x;
-}
-
-static void insert_fixup(vma_node_t **root, vma_node_t *z) {
-    while (is_red(z->parent)) {
-        vma_node_t *p = z->parent;
-        vma_node_t *g = p->parent;
-        if (p == g->left) {
-            vma_node_t *u = g->right;
-            if (is_red(u)) { // case 1
-                p->color = RB_BLACK;
-                u->color = RB_BLACK;
-                g->color = RB_RED;
-                z = g;
-                continue;
-            }
-            if (z == p->right) { // case 2
-                z = p;
-                rotate_left(root, z);
-                p = z->parent;
-                g = p->parent;
-            }
-            // case 3
-            p->color = RB_BLACK;
-            g->color = RB_RED;
-            rotate_right(root, g);
-        } else {
-            vma_node_t *u = g->left;
-            if (is_red(u)) { // mirror case 1
-                p->color = RB_BLACK;
-                u->color = RB_BLACK;
-                g->color = RB_RED;
-                z = g;
-                continue;
-            }
-            if (z == p->left) { // mirror case 2
-                z = p;
-                rotate_right(root, z);
-                p = z->parent;
-                g = p->parent;
-            }
-            // mirror case 3
-            p->color = RB_BLACK;
-            g->color = RB_RED;
-            rotate_left(root, g);
-        }
-    }
-    (*root)->color = RB_BLACK;
-}
+static vma_tree_t vma_tree;
+static vmt_node_t vma_nodes[VMA_NODE_CAP];
+static spinlock_t vmm_lock;
+static seqcount_t vma_seq = SEQCNT_ZERO;
 
-static vma_node_t *tree_min(vma_node_t *n) {
-    while (n && n->left)
-        n = n->left;
-    return n;
-}
+// Shared zero frame: read faults on untouched demand pages map it read-only
+// instead of allocating. Every such mapping holds a reference, on top of the
+// one taken at init that pins it, so unmap paths release it like any frame.
+static void *zero_page;
+static vmm_zero_stats_t zero_stats;
 
-static void transplant(vma_node_t **root, vma_node_t *u, vma_node_t *v) {
-    if (!u->parent)
-        *root = v;
-    else if (u == u->parent->left)
-        u->parent->left = v;
-    else
-        u->parent->right = v;
-    if (v)
-        v->parent = u->parent;
-}
-
-static void delete_fixup(vma_node_t **root, vma_node_t *x,
-                         vma_node_t *x_parent) {
-    while ((x != *root) && is_black(x)) {
-        if (x == (x_parent ? x_parent->left : NULL)) {
-            vma_node_t *w = x_parent ? x_parent->right : NULL;
-            if (is_red(w)) {
-                w->color = RB_BLACK;
-                if (x_parent)
-                    x_parent->color = RB_RED;
-                rotate_left(root, x_parent);
-                w = x_parent ? x_parent->right : NULL;
-            }
-            if (is_black(w ? w->left : NULL) && is_black(w ? w->right : NULL)) {
-                if (w)
-                    w->color = RB_RED;
-                x = x_parent;
-                x_parent = x_parent ? x_parent->parent : NULL;
-            } else {
-                if (is_black(w ? w->right : NULL)) {
-                    if (w && w->left)
-                        w->left->color = RB_BLACK;
-                    if (w)
-                        w->color = RB_RED;
-                    rotate_right(root, w);
-                    w = x_parent ? x_parent->right : NULL;
-                }
-                if (w)
-                    w->color = x_parent ? x_parent->color : RB_BLACK;
-                if (x_parent)
-                    x_parent->color = RB_BLACK;
-                if (w && w->right)
-                    w->right->color = RB_BLACK;
-                rotate_left(root, x_parent);
-                x = *root;
-                break;
-            }
-        } else {
-            vma_node_t *w = x_parent ? x_parent->left : NULL;
-            if (is_red(w)) {
-                w->color = RB_BLACK;
-                if (x_parent)
-                    x_parent->color = RB_RED;
-                rotate_right(root, x_parent);
-                w = x_parent ? x_parent->left : NULL;
-            }
-            if (is_black(w ? w->right : NULL) && is_black(w ? w->left : NULL)) {
-                if (w)
-                    w->color = RB_RED;
-                x = x_parent;
-                x_parent = x_parent ? x_parent->parent : NULL;
-            } else {
-                if (is_black(w ? w->left : NULL)) {
-                    if (w && w->right)
-                        w->right->color = RB_BLACK;
-                    if (w)
-                        w->color = RB_RED;
-                    rotate_left(root, w);
-                    w = x_parent ? x_parent->left : NULL;
-                }
-                if (w)
-                    w->color = x_parent ? x_parent->color : RB_BLACK;
-                if (x_parent)
-                    x_parent->color = RB_BLACK;
-                if (w && w->left)
-                    w->left->color = RB_BLACK;
-                rotate_right(root, x_parent);
-                x = *root;
-                break;
-            }
-        }
-    }
-    if (x)
-        x->color = RB_BLACK;
-}
-
-static void rb_delete(vma_node_t **root, vma_node_t *z) {
-    vma_node_t *y = z;
-    vma_node_t *x = NULL;
-    vma_node_t *x_parent = NULL;
-    rb_color_t y_orig = y->color;
-    if (!z->left) {
-        x = z->right;
-        x_parent = z->parent;
-        transplant(root, z, z->right);
-    } else if (!z->right) {
-        x = z->left;
-        x_parent = z->parent;
-        transplant(root, z, z->left);
-    } else {
-        y = tree_min(z->right);
-        y_orig = y->color;
-        x = y->right;
-        x_parent = y->parent;
-        if (y->parent == z) {
-            if (x)
-                x->parent = y;
-            x_parent = y;
-        } else {
-            transplant(root, y, y->right);
-            y->right = z->right;
-            if (y->right)
-                y->right->parent = y;
-        }
-        transplant(root, z, y);
-        y->left = z->left;
-        if (y->left)
-            y->left->parent = y;
-        y->color = z->color;
-    }
-    if (y_orig == RB_BLACK)
-        delete_fixup(root, x, x_parent);
-}
-
-static vma_node_t *find_le(vma_node_t *root, uint64_t va) {
-    vma_node_t *res = NULL;
-    while (root) {
-        if (va < root->va)
-            root = root->left;
-        else {
-            res = root;
-            root = root->right;
-        }
-    }
-    return res; // greatest <= va
-}
-
-static int overlaps(vma_node_t *n, uint64_t va, uint64_t size) {
-    if (!n)
-        return 0;
-    uint64_t a0 = n->va, a1 = n->va + n->size;
-    uint64_t b0 = va, b1 = va + size;
-    return !(b1 <= a0 || a1 <= b0);
-}
+// Pages whose PTE holds a zram entry instead of a frame. Unmapping must give
+// the entries back; when there are none the PTE walk is skipped.
+static uint64_t nr_swapped;
 
-#define VMA_POOL_CAP 256
-static vma_node_t vma_pool[VMA_POOL_CAP];
-static vma_node_t *vma_free_list = NULL;
+static vma_t vma_pool[VMA_POOL_CAP];
+static vma_t *vma_free_list = NULL;
+static int vma_free_count = 0;
 
 static void init_vma_pool(void) {
+    vma_free_list = NULL;
     for (int i = 0; i < VMA_POOL_CAP; i++) {
-        vma_pool[i].left = vma_free_list;
+        vma_pool[i].next_free = vma_free_list;
         vma_free_list = &vma_pool[i];
     }
+    vma_free_count = VMA_POOL_CAP;
+    vmt_init(&vma_tree, vma_nodes, VMA_NODE_CAP);
 }
 
-static vma_node_t *vma_alloc_node(void) {
-    if (!vma_free_list) {
-        static int initialized = 0;
-        if (!initialized) {
-            init_vma_pool();
-            initialized = 1;
-        }
-        if (!vma_free_list)
-            return NULL;
-    }
-    vma_node_t *n = vma_free_list;
-    vma_free_list = n->left;
-    n->left = n->right = n->parent = NULL;
-    n->color = RB_RED;
-    return n;
+static vma_t *vma_alloc(void) {
+    vma_t *v = vma_free_list;
+    if (!v)
+        return NULL;
+    vma_free_list = v->next_free;
+    vma_free_count--;
+    return v;
 }
 
-static void vma_free_node(vma_node_t *n) {
-    if (!n)
+static void vma_free(vma_t *v) {
+    if (!v)
         return;
-    n->left = vma_free_list;
-    vma_free_list = n;
+    v->next_free = vma_free_list;
+    vma_free_list = v;
+    vma_free_count++;
+}
+
+// Records are only dereferenced if they belong to the pool: a reader racing
+// a writer may pick up a stale slot.
+static inline vma_t *vma_of(const vmt_entry_t *e) {
+    vma_t *v = (vma_t *)e->data;
+    if (v < vma_pool || v >= vma_pool + VMA_POOL_CAP)
+        return NULL;
+    return v;
 }
 
 void vmm_init_identity(void) { /* placeholder for future page tables */ }
 
 int vmm_init(void) {
     spinlock_init(&vmm_lock);
-    vma_root = NULL;
     init_vma_pool();
+    zero_page = pmm_alloc_page();
+    if (!zero_page)
+        return -4;
+    memset(zero_page, 0, VMM_PAGE_SIZE);
     return 0;
 }
 
-static vma_node_t *find_ge(vma_node_t *root, uint64_t va) {
-    vma_node_t *res = NULL;
-    while (root) {
-        if (va <= root->va) {
-            res = root;
-            root = root->left;
-        } else
-            root = root->right;
+static uint64_t vmm_pte_attrs(uint32_t attrs) {
+    uint64_t pte_attrs = PTE_PAGE | PTE_AF | PTE_SH_INNER;
+    if ((attrs & VMM_ATTR_DEVICE) && (attrs & VMM_ATTR_NP))
+        pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_DEVICE);
+    else if (attrs & VMM_ATTR_DEVICE)
+        pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_DEVICE_nGnRE);
+    else if (attrs & VMM_ATTR_WC)
+        pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_NORMAL_NC);
+    else
+        pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_NORMAL);
+    if (!(attrs & VMM_ATTR_W))
+        pte_attrs |= PTE_RO;
+    if (attrs & VMM_ATTR_UXN)
+        pte_attrs |= PTE_UXN;
+    if (attrs & VMM_ATTR_PXN)
+        pte_attrs |= PTE_PXN;
+    return pte_attrs;
+}
+
+// --- Index edits: callers hold vmm_lock and an open vma_seq write section ---
+
+static inline int find_le(uint64_t va, vmt_entry_t *e) {
+    return vmt_find_le(&vma_tree, va, e);
+}
+
+static inline int find_ge(uint64_t va, vmt_entry_t *e) {
+    return vmt_find_ge(&vma_tree, va, e);
+}
+
+static void vma_unlink(const vmt_entry_t *e) {
+    vmt_erase(&vma_tree, e->start);
+    vma_free(vma_of(e));
+}
+
+// Two VMAs can become one if they abut in VA and agree on attributes, and
+// (unless they are demand-paged, so have no fixed PA) abut in PA too
+static int vma_can_extend(const vmt_entry_t *a, uint64_t b_va, uint64_t b_pa,
+                          uint32_t b_attrs) {
+    const vma_t *v = vma_of(a);
+    if (a->end != b_va || v->attrs != b_attrs)
+        return 0;
+    return (b_attrs & VMM_ATTR_DEMAND) || v->pa + (a->end - a->start) == b_pa;
+}
+
+static int vma_mergeable(const vmt_entry_t *a, const vmt_entry_t *b) {
+    const vma_t *vb = vma_of(b);
+    return vma_can_extend(a, b->start, vb->pa, vb->attrs);
+}
+
+// Split e at 'at' (e->start < at < e->end); the upper part becomes a new
+// VMA. The caller has checked that a record and tree nodes are available.
+static void vma_split(const vmt_entry_t *e, uint64_t at) {
+    const vma_t *lo = vma_of(e);
+    vma_t *hi = vma_alloc();
+    hi->pa = (lo->attrs & VMM_ATTR_DEMAND) ? 0 : lo->pa + (at - e->start);
+    hi->attrs = lo->attrs;
+    vmt_set_end(&vma_tree, e->start, at);
+    vmt_insert(&vma_tree, at, e->end, hi);
+}
+
+// Coalesce mergeable neighbours among the VMAs touching [va, end]
+static void vma_merge_range(uint64_t va, uint64_t end) {
+    vmt_entry_t n, next;
+    int have = va && find_le(va - 1, &n) && n.end >= va;
+    if (!have)
+        have = find_ge(va, &n);
+    while (have) {
+        if (!find_ge(n.end, &next) || next.start > end)
+            break;
+        if (vma_mergeable(&n, &next)) {
+            vma_unlink(&next);
+            vmt_set_end(&vma_tree, n.start, next.end);
+            n.end = next.end;
+            continue;
+        }
+        n = next;
     }
-    return res;
 }
 
-static vma_node_t *find_exact(vma_node_t *root, uint64_t va) {
-    while (root) {
-        if (va < root->va)
-            root = root->left;
-        else if (va > root->va)
-            root = root->right;
-        else
-            return root;
+// Check that [va, end) is fully covered by VMAs with no holes
+static int vma_range_covered(uint64_t va, uint64_t end) {
+    vmt_entry_t n;
+    if (!find_le(va, &n) || n.end <= va)
+        return 0;
+    uint64_t cursor = n.end;
+    while (cursor < end) {
+        if (!find_ge(cursor, &n) || n.start != cursor)
+            return 0;
+        cursor = n.end;
     }
-    return NULL;
+    return 1;
 }
 
-int vmm_map(uint64_t va, uint64_t pa, uint64_t size, uint32_t attrs) {
-    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+// Room for the two splits vma_isolate_range() may perform
+static int vma_split_room(void) {
+    return vma_free_count >= 2 && vmt_can_insert(&vma_tree, 2);
+}
 
-    if (size == 0) {
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -1;
+// Split the VMAs straddling va and end so [va, end) is made of whole VMAs.
+// The caller checks vma_split_room() first.
+static void vma_isolate_range(uint64_t va, uint64_t end) {
+    vmt_entry_t n;
+    if (find_le(va, &n) && n.start < va && n.end > va)
+        vma_split(&n, va);
+    if (find_le(end - 1, &n) && n.end > end)
+        vma_split(&n, end);
+}
+
+// Clear the PTEs of [va, end), which lies within one VMA with the given
+// attributes. A demand VMA owns what its PTEs point to: each populated frame
+// (a private, shared or zero-page reference) is queued on tlb and released
+// after the flush, and each zram entry is freed. Other mappings are only
+// unmapped. vmm_lock held, so reclaim and merging cannot swap a frame out
+// from under us.
+static void vma_zap_range(uint64_t *pgd, uint64_t va, uint64_t end,
+                          uint32_t attrs, mmu_gather_t *tlb) {
+    void *frames[MMU_GATHER_BATCH];
+    while (va < end) {
+        uint64_t stop = end;
+        if (stop - va > MMU_GATHER_BATCH * VMM_PAGE_SIZE)
+            stop = va + MMU_GATHER_BATCH * VMM_PAGE_SIZE;
+
+        uint32_t nr = 0;
+        for (uint64_t a = va; (attrs & VMM_ATTR_DEMAND) && a < stop;
+             a += VMM_PAGE_SIZE) {
+            uint64_t desc = mmu_get_pte(pgd, a);
+            if (pte_is_swap(desc)) {
+                zram_free(pte_swap_entry(desc));
+                nr_swapped--;
+            } else if (desc & PTE_VALID) {
+                frames[nr++] = (void *)(desc & PTE_ADDR_MASK);
+            }
+        }
+        // Queue the frames only once their PTEs are gone and the range is
+        // recorded, so a flush forced by a full batch cannot free a frame
+        // that is still mapped
+        mmu_unmap_range(pgd, va, stop - va, tlb);
+        for (uint32_t i = 0; i < nr; i++)
+            tlb_remove_page(tlb, frames[i]);
+        va = stop;
     }
-    if ((va & (VMM_PAGE_SIZE - 1)) || (pa & (VMM_PAGE_SIZE - 1)) ||
-        (size & (VMM_PAGE_SIZE - 1))) {
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
+}
+
+static int vmm_check_range(uint64_t va, uint64_t size) {
+    if (size == 0)
+        return -1;
+    if ((va & (VMM_PAGE_SIZE - 1)) || (size & (VMM_PAGE_SIZE - 1)))
         return -2;
-    }
+    return 0;
+}
+
+int vmm_map(uint64_t va, uint64_t pa, uint64_t size, uint32_t attrs) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
 
-    vma_node_t *pred = find_le(vma_root, va);
-    if (overlaps(pred, va, size)) {
+    if (attrs & VMM_ATTR_DEMAND)
+        pa = 0;
+    int ret = vmm_check_range(va, size);
+    if (ret == 0 && (pa & (VMM_PAGE_SIZE - 1)))
+        ret = -2;
+    if (ret) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -3;
+        return ret;
     }
 
-    vma_node_t *succ = find_ge(vma_root, va);
-    if (overlaps(succ, va, size)) {
+    vmt_entry_t pred, succ;
+    int have_pred = find_le(va, &pred);
+    if ((have_pred && pred.end > va) ||
+        (find_ge(va, &succ) && succ.start < va + size)) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
         return -3;
     }
 
-    vma_node_t *n = vma_alloc_node();
-    if (!n) {
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -4;
-    }
-    n->va = va;
-    n->pa = pa;
-    n->size = size;
-    n->attrs = attrs;
-    n->color = RB_RED;
-
-    vma_node_t **link = &vma_root;
-    vma_node_t *parent = NULL;
-    while (*link) {
-        parent = *link;
-        if (va < parent->va)
-            link = &parent->left;
-        else
-            link = &parent->right;
+    // Extending a neighbour keeps the VMA count proportional to logical
+    // regions rather than to pages.
+    int extend = have_pred && vma_can_extend(&pred, va, pa, attrs);
+    vma_t *v = NULL;
+    if (!extend) {
+        if (!vmt_can_insert(&vma_tree, 1) || !(v = vma_alloc())) {
+            spinlock_unlock_irqrestore(&vmm_lock, flags);
+            return -4;
+        }
+        v->pa = pa;
+        v->attrs = attrs;
     }
-    *link = n;
-    n->parent = parent;
-    n->left = n->right = NULL;
-    n->color = RB_RED;
-    insert_fixup(&vma_root, n);
 
-    // Map pages in MMU if TTBR1 is set
+    write_seqcount_begin(&vma_seq);
+    if (extend)
+        vmt_set_end(&vma_tree, pred.start, va + size);
+    else
+        vmt_insert(&vma_tree, va, va + size, v);
+    vma_merge_range(va, va + size);
+    write_seqcount_end(&vma_seq);
+
+    // Map pages in MMU if TTBR1 is set; demand VMAs fault pages in later
     uint64_t ttbr1 = mmu_get_ttbr1();
-    if (ttbr1) {
-        uint64_t pte_attrs = PTE_PAGE | PTE_AF | PTE_SH_INNER;
-        if (attrs & VMM_ATTR_DEVICE)
-            pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_DEVICE);
-        else
-            pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_NORMAL);
-        if (!(attrs & VMM_ATTR_W))
-            pte_attrs |= PTE_RO;
-        if (attrs & VMM_ATTR_UXN)
-            pte_attrs |= (1ULL << 54);
-        if (attrs & VMM_ATTR_PXN)
-            pte_attrs |= (1ULL << 53);
+    if (ttbr1 && !(attrs & VMM_ATTR_DEMAND)) {
+        uint64_t pte_attrs = vmm_pte_attrs(attrs);
 
         for (uint64_t off = 0; off < size; off += VMM_PAGE_SIZE) {
             mmu_map_page((uint64_t *)ttbr1, va + off, pa + off, pte_attrs);
@@ -404,81 +310,107 @@ int vmm_map(uint64_t va, uint64_t pa, uint64_t size, uint32_t attrs) {
             cache_flush_range(va, size);
             icache_invalidate_range(va, size);
         }
-        tlb_flush_range(va, size);
+        // The range was unmapped (and flushed) before it could be reused, so
+        // no TLB can hold an entry for it: an isb is all that is needed.
+        __asm__ volatile("isb" ::: "memory");
     }
 
     spinlock_unlock_irqrestore(&vmm_lock, flags);
     return 0;
 }
 
-int vmm_unmap(uint64_t va, uint64_t size) {
+int vmm_unmap_gather(uint64_t va, uint64_t size, mmu_gather_t *tlb) {
     uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
 
-    if (size == 0) {
+    int ret = vmm_check_range(va, size);
+    if (ret) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -1;
-    }
-    if ((va & (VMM_PAGE_SIZE - 1)) || (size & (VMM_PAGE_SIZE - 1))) {
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -2;
+        return ret;
     }
 
-    vma_node_t *cur = find_exact(vma_root, va);
-    if (!cur || cur->size != size) {
+    uint64_t end = va + size;
+    if (!vma_range_covered(va, end)) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
         return -3;
     }
+    if (!vma_split_room()) {
+        spinlock_unlock_irqrestore(&vmm_lock, flags);
+        return -4;
+    }
 
+    // Tear down the page tables while the VMAs still say what owns the
+    // frames. TLB invalidation is deferred to the caller's tlb_finish_mmu().
     uint64_t ttbr1 = mmu_get_ttbr1();
+    vmt_entry_t cur;
     if (ttbr1) {
-        for (uint64_t off = 0; off < size; off += VMM_PAGE_SIZE) {
-            mmu_unmap_page((uint64_t *)ttbr1, va + off);
+        for (int have = find_le(va, &cur); have && cur.start < end;
+             have = find_ge(cur.end, &cur)) {
+            uint64_t lo = cur.start > va ? cur.start : va;
+            uint64_t hi = cur.end < end ? cur.end : end;
+            vma_zap_range((uint64_t *)ttbr1, lo, hi, vma_of(&cur)->attrs,
+                          tlb);
         }
-        tlb_flush_range(va, size);
     }
 
-    rb_delete(&vma_root, cur);
-    vma_free_node(cur);
+    write_seqcount_begin(&vma_seq);
+    vma_isolate_range(va, end);
+    while (find_ge(va, &cur) && cur.start < end)
+        vma_unlink(&cur);
+    write_seqcount_end(&vma_seq);
 
     spinlock_unlock_irqrestore(&vmm_lock, flags);
     return 0;
 }
 
+int vmm_unmap(uint64_t va, uint64_t size) {
+    mmu_gather_t tlb;
+    tlb_gather_mmu(&tlb);
+    int ret = vmm_unmap_gather(va, size, &tlb);
+    tlb_finish_mmu(&tlb);
+    return ret;
+}
+
 int vmm_protect(uint64_t va, uint64_t size, uint32_t attrs) {
     uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
 
-    if (size == 0) {
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -1;
-    }
-    if ((va & (VMM_PAGE_SIZE - 1)) || (size & (VMM_PAGE_SIZE - 1))) {
+    int ret = vmm_check_range(va, size);
+    if (ret) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
-        return -2;
+        return ret;
     }
 
-    vma_node_t *cur = find_exact(vma_root, va);
-    if (!cur || cur->size != size) {
+    uint64_t end = va + size;
+    if (!vma_range_covered(va, end)) {
         spinlock_unlock_irqrestore(&vmm_lock, flags);
         return -3;
     }
-    cur->attrs = attrs;
+    if (!vma_split_room()) {
+        spinlock_unlock_irqrestore(&vmm_lock, flags);
+        return -4;
+    }
+
+    write_seqcount_begin(&vma_seq);
+    vma_isolate_range(va, end);
+    vmt_entry_t cur;
+    for (int have = find_ge(va, &cur); have && cur.start < end;
+         have = find_ge(cur.end, &cur))
+        vma_of(&cur)->attrs =
+            attrs | (vma_of(&cur)->attrs & VMM_ATTR_DEMAND);
+    vma_merge_range(va, end);
+    write_seqcount_end(&vma_seq);
 
     uint64_t ttbr1 = mmu_get_ttbr1();
     if (ttbr1) {
-        uint64_t pte_attrs = PTE_PAGE | PTE_AF | PTE_SH_INNER;
-        if (attrs & VMM_ATTR_DEVICE)
-            pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_DEVICE);
-        else
-            pte_attrs |= PTE_ATTR_IDX(MAIR_IDX_NORMAL);
-        if (!(attrs & VMM_ATTR_W))
-            pte_attrs |= PTE_RO;
-        if (attrs & VMM_ATTR_UXN)
-            pte_attrs |= (1ULL << 54);
-        if (attrs & VMM_ATTR_PXN)
-            pte_attrs |= (1ULL << 53);
+        uint64_t pte_attrs = vmm_pte_attrs(attrs);
 
         for (uint64_t off = 0; off < size; off += VMM_PAGE_SIZE) {
-            mmu_update_page_attrs((uint64_t *)ttbr1, va + off, pte_attrs);
+            // A frame still shared copy-on-write stays read-only: the next
+            // write fault gives this mapping its own copy.
+            uint64_t pte = pte_attrs, pa;
+            if ((attrs & VMM_ATTR_W) && mmu_translate(va + off, &pa) == 0 &&
+                pmm_page_refcount((void *)ALIGN_DOWN(pa, VMM_PAGE_SIZE)) > 1)
+                pte |= PTE_RO;
+            mmu_update_page_attrs((uint64_t *)ttbr1, va + off, pte);
         }
         tlb_flush_range(va, size);
     }
@@ -487,37 +419,566 @@ int vmm_protect(uint64_t va, uint64_t size, uint32_t attrs) {
     return 0;
 }
 
-static void inorder_dump(vma_node_t *n) {
-    if (!n)
+int vmm_set_flag(uint64_t va, uint64_t size, uint32_t flag, int set) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+
+    int ret = vmm_check_range(va, size);
+    uint64_t end = va + size;
+    if (!ret && !vma_range_covered(va, end))
+        ret = -3;
+    vmt_entry_t cur;
+    for (int have = !ret && find_le(va, &cur); have && cur.start < end;
+         have = find_ge(cur.end, &cur)) {
+        if (!(vma_of(&cur)->attrs & VMM_ATTR_DEMAND)) {
+            ret = -1;
+            break;
+        }
+    }
+    if (!ret && !vma_split_room())
+        ret = -4;
+    if (ret) {
+        spinlock_unlock_irqrestore(&vmm_lock, flags);
+        return ret;
+    }
+
+    // The flags only steer reclaim and merging: the PTEs stay as they are
+    write_seqcount_begin(&vma_seq);
+    vma_isolate_range(va, end);
+    for (int have = find_ge(va, &cur); have && cur.start < end;
+         have = find_ge(cur.end, &cur)) {
+        if (set)
+            vma_of(&cur)->attrs |= flag;
+        else
+            vma_of(&cur)->attrs &= ~flag;
+    }
+    vma_merge_range(va, end);
+    write_seqcount_end(&vma_seq);
+
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return 0;
+}
+
+// A page of swappable memory got a private frame: it starts out active
+static inline void vma_lru_add(void *frame, uint64_t page_va, uint32_t attrs) {
+    if (attrs & VMM_ATTR_SWAPPABLE)
+        lru_add(frame, page_va);
+}
+
+// Give the write-faulting mapping at page_va a private, writable frame. The
+// last sharer takes the frame over in place; otherwise the page is copied.
+static int vma_break_cow(uint64_t *pgd, uint64_t page_va, uint64_t pa,
+                         uint32_t attrs) {
+    void *frame = (void *)ALIGN_DOWN(pa, VMM_PAGE_SIZE);
+    uint64_t pte_attrs = vmm_pte_attrs(attrs);
+
+    if (frame != zero_page && pmm_page_refcount(frame) <= 1) {
+        mmu_update_page_attrs(pgd, page_va, pte_attrs);
+        tlb_flush_page(page_va);
+        vma_lru_add(frame, page_va, attrs);
+        return 0;
+    }
+
+    void *copy = pmm_alloc_page();
+    if (!copy)
+        return -4;
+    if (frame == zero_page) {
+        memset(copy, 0, VMM_PAGE_SIZE);
+        zero_stats.upgrades++;
+    } else {
+        memcpy(copy, frame, VMM_PAGE_SIZE);
+    }
+    // Break-before-make: the shared entry must be invalid and flushed before
+    // the same VA points at a different frame.
+    mmu_unmap_page(pgd, page_va);
+    tlb_flush_page(page_va);
+    mmu_map_page(pgd, page_va, (uint64_t)copy, pte_attrs);
+    __asm__ volatile("isb" ::: "memory");
+    pmm_free_page(frame); // drop this mapping's reference
+    vma_lru_add(copy, page_va, attrs);
+    return 0;
+}
+
+// Bring a swapped-out page back from zram into a private frame
+static int vma_swap_in(uint64_t *pgd, uint64_t page_va, uint64_t desc,
+                       uint32_t attrs) {
+    void *page = pmm_alloc_page();
+    if (!page)
+        return -4;
+    uint32_t entry = pte_swap_entry(desc);
+    if (zram_load(entry, page) != 0 ||
+        mmu_map_page(pgd, page_va, (uint64_t)page, vmm_pte_attrs(attrs)) !=
+            0) {
+        pmm_free_page(page);
+        return -4;
+    }
+    // The swap entry was an invalid descriptor: nothing to flush
+    __asm__ volatile("isb" ::: "memory");
+    zram_free(entry);
+    nr_swapped--;
+    vma_lru_add(page, page_va, attrs);
+    return 0;
+}
+
+int vmm_handle_fault(uint64_t va, uint32_t flags) {
+    uint64_t page_va = ALIGN_DOWN(va, VMM_PAGE_SIZE);
+    uint64_t irqflags = spinlock_lock_irqsave(&vmm_lock);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    int ret = -1;
+
+    vmt_entry_t e;
+    if (!ttbr1 || !find_le(va, &e) || e.end <= va)
+        goto out;
+    uint32_t attrs = vma_of(&e)->attrs;
+    if (!(attrs & VMM_ATTR_DEMAND))
+        goto out;
+    if ((flags & VMM_FAULT_WRITE) && !(attrs & VMM_ATTR_W))
+        goto out;
+    // Aging cleared AF: the page is still mapped, mark it used and retry
+    if ((flags & VMM_FAULT_ACCESS) &&
+        mmu_mkyoung((uint64_t *)ttbr1, page_va) == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    uint64_t pa;
+    if (mmu_translate(page_va, &pa) == 0) {
+        if (!(flags & VMM_FAULT_PRESENT))
+            ret = 0; // populated since the fault was taken (or by populate)
+        else if (flags & VMM_FAULT_WRITE)
+            ret = vma_break_cow((uint64_t *)ttbr1, page_va, pa, attrs);
+        goto out;
+    }
+    uint64_t desc = mmu_get_pte((uint64_t *)ttbr1, page_va);
+    if (pte_is_swap(desc)) {
+        ret = vma_swap_in((uint64_t *)ttbr1, page_va, desc, attrs);
+        goto out;
+    }
+
+    // A read of a page nobody has written yet sees the shared zero frame;
+    // the first write takes the permission-fault path above.
+    void *page;
+    uint64_t pte_attrs;
+    if (!(flags & VMM_FAULT_WRITE) && pmm_page_get(zero_page) == 0) {
+        page = zero_page;
+        pte_attrs = vmm_pte_attrs(attrs & ~VMM_ATTR_W);
+        zero_stats.read_faults++;
+    } else {
+        page = pmm_alloc_page();
+        if (!page) {
+            ret = -4;
+            goto out;
+        }
+        memset(page, 0, VMM_PAGE_SIZE);
+        pte_attrs = vmm_pte_attrs(attrs);
+    }
+    if (mmu_map_page((uint64_t *)ttbr1, page_va, (uint64_t)page,
+                     pte_attrs) != 0) {
+        pmm_free_page(page);
+        if (page == zero_page)
+            zero_stats.read_faults--;
+        ret = -4;
+        goto out;
+    }
+    // Invalid entries are never cached in the TLB: no invalidation needed
+    __asm__ volatile("isb" ::: "memory");
+    if (page != zero_page)
+        vma_lru_add(page, page_va, attrs);
+    ret = 0;
+
+out:
+    spinlock_unlock_irqrestore(&vmm_lock, irqflags);
+    return ret;
+}
+
+int vmm_populate(uint64_t va, uint64_t size) {
+    int ret = vmm_check_range(va, size);
+    // Populate for writing: a zero-page mapping would only fault again
+    for (uint64_t off = 0; ret == 0 && off < size; off += VMM_PAGE_SIZE)
+        ret = vmm_handle_fault(va + off, VMM_FAULT_WRITE);
+    return ret;
+}
+
+int vmm_install_page(uint64_t va, void *frame, uint32_t attrs) {
+    uint64_t page_va = ALIGN_DOWN(va, VMM_PAGE_SIZE);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    if (!ttbr1 || (mmu_get_pte((uint64_t *)ttbr1, page_va) & PTE_VALID))
+        return -1;
+    // mmu_set_pte() never allocates, so no lock is needed on this path
+    uint64_t desc = (uint64_t)frame | vmm_pte_attrs(attrs) | PTE_VALID;
+    if (mmu_set_pte((uint64_t *)ttbr1, page_va, desc) != 0)
+        return -1;
+    // Invalid entries are never cached in the TLB: no invalidation needed
+    __asm__ volatile("isb" ::: "memory");
+    return 0;
+}
+
+// Compress one populated, unshared page into zram. Returns 0 if swapped
+// out, 1 if the page was skipped, -4 if zram is full.
+static int vma_swap_out_page(uint64_t *pgd, uint64_t page_va, uint32_t attrs) {
+    uint64_t pa;
+    if (mmu_translate(page_va, &pa) != 0)
+        return 1;
+    // Shared frames (COW, merged, the zero page) would not be freed
+    void *frame = (void *)ALIGN_DOWN(pa, VMM_PAGE_SIZE);
+    if (frame == zero_page || pmm_page_refcount(frame) != 1)
+        return 1;
+
+    // Unmap first so that no write can slip in while the page is compressed;
+    // an access in the meantime faults and waits for vmm_lock.
+    mmu_unmap_page(pgd, page_va);
+    tlb_flush_page(page_va);
+    uint32_t entry;
+    int ret = zram_store(frame, &entry);
+    if (ret != 0) {
+        mmu_map_page(pgd, page_va, (uint64_t)frame, vmm_pte_attrs(attrs));
+        __asm__ volatile("isb" ::: "memory");
+        return ret;
+    }
+    mmu_set_pte(pgd, page_va, pte_mk_swap(entry));
+    pmm_free_page(frame);
+    nr_swapped++;
+    return 0;
+}
+
+int vmm_swap_out(uint64_t va, uint64_t size) {
+    int ret = vmm_check_range(va, size);
+    if (ret)
+        return ret;
+
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    uint64_t end = va + size;
+    int swapped = 0;
+    vmt_entry_t e = {0};
+    for (uint64_t a = va; ttbr1 && a < end; a += VMM_PAGE_SIZE) {
+        if (a >= e.end && (!find_le(a, &e) || e.end <= a)) {
+            e.end = 0;
+            continue;
+        }
+        uint32_t attrs = vma_of(&e)->attrs;
+        if (!(attrs & VMM_ATTR_DEMAND))
+            continue;
+        ret = vma_swap_out_page((uint64_t *)ttbr1, a, attrs);
+        if (ret < 0)
+            break;
+        if (ret == 0)
+            swapped++;
+    }
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return swapped ? swapped : (ret < 0 ? ret : 0);
+}
+
+// Attributes of the swappable demand VMA in which va is still backed by
+// frame, or 0. Caller holds vmm_lock.
+static uint32_t lru_entry_attrs(uint64_t *pgd, uint64_t va, void *frame) {
+    vmt_entry_t e;
+    if (!find_le(va, &e) || e.end <= va)
+        return 0;
+    uint32_t attrs = vma_of(&e)->attrs;
+    if ((attrs & (VMM_ATTR_DEMAND | VMM_ATTR_SWAPPABLE)) !=
+        (VMM_ATTR_DEMAND | VMM_ATTR_SWAPPABLE))
+        return 0;
+    uint64_t desc = mmu_get_pte(pgd, va);
+    if (!(desc & PTE_VALID) || (desc & PTE_ADDR_MASK) != (uint64_t)frame)
+        return 0;
+    return attrs;
+}
+
+int vmm_page_young(uint64_t va, void *frame) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    int ret = -1;
+    if (ttbr1 && lru_entry_attrs((uint64_t *)ttbr1, va, frame)) {
+        ret = mmu_test_and_clear_young((uint64_t *)ttbr1, va);
+        // Accesses through a cached translation would not set AF again
+        if (ret == 1)
+            tlb_flush_page(va);
+    }
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return ret;
+}
+
+int vmm_reclaim_page(uint64_t va, void *frame) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    int ret = -1;
+    uint32_t attrs;
+    if (ttbr1 && (attrs = lru_entry_attrs((uint64_t *)ttbr1, va, frame)))
+        ret = vma_swap_out_page((uint64_t *)ttbr1, va, attrs);
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return ret;
+}
+
+void vmm_zero_page_stats(vmm_zero_stats_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+    *out = zero_stats;
+    // Less the pinning reference taken at init
+    unsigned refs = zero_page ? pmm_page_refcount(zero_page) : 0;
+    out->mapped = refs ? refs - 1 : 0;
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+}
+
+// Writable again unless the VMA forbids it or the frame is still shared
+static void ksm_restore_pte(uint64_t *pgd, uint64_t va, void *frame,
+                            uint32_t attrs) {
+    if (!(attrs & VMM_ATTR_W) || frame == zero_page ||
+        pmm_page_refcount(frame) > 1)
         return;
-    inorder_dump(n->left);
-    printk("VMM: VMA va=%p..%p -> pa=%p attrs=%x\n", (void *)n->va,
-           (void *)(n->va + n->size), (void *)n->pa, (unsigned)n->attrs);
-    inorder_dump(n->right);
+    mmu_update_page_attrs(pgd, va, vmm_pte_attrs(attrs));
+    tlb_flush_page(va);
 }
 
-void vmm_dump(void) {
+int vmm_ksm_merge(uint64_t va, uint64_t pa, void *target) {
     uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
-    inorder_dump(vma_root);
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    uint64_t *pgd = (uint64_t *)ttbr1;
+    void *frame = (void *)ALIGN_DOWN(pa, VMM_PAGE_SIZE);
+    int ret = -1;
+
+    vmt_entry_t e;
+    if (!ttbr1 || (va & (VMM_PAGE_SIZE - 1)) || !find_le(va, &e) ||
+        e.end <= va)
+        goto out;
+    uint32_t attrs = vma_of(&e)->attrs;
+    if ((attrs & (VMM_ATTR_DEMAND | VMM_ATTR_MERGEABLE)) !=
+        (VMM_ATTR_DEMAND | VMM_ATTR_MERGEABLE))
+        goto out;
+
+    // The scanner looked at the page without the lock: it may have been
+    // freed or replaced since
+    ret = 1;
+    uint64_t cur;
+    if (mmu_translate(va, &cur) != 0 ||
+        ALIGN_DOWN(cur, VMM_PAGE_SIZE) != (uint64_t)frame)
+        goto out;
+    if (!target)
+        target = zero_page;
+    if (frame == zero_page)
+        goto out; // already as shared as it gets
+
+    // Write-protect before comparing, so the contents cannot change between
+    // the comparison and the remap
+    uint64_t ro = vmm_pte_attrs(attrs & ~VMM_ATTR_W);
+    mmu_update_page_attrs(pgd, va, ro);
+    tlb_flush_page(va);
+
+    if (frame == target) {
+        ret = pmm_page_get(frame) == 0 ? 0 : -4;
+        if (ret)
+            ksm_restore_pte(pgd, va, frame, attrs);
+        goto out;
+    }
+    if (memcmp(frame, target, VMM_PAGE_SIZE) != 0) {
+        ksm_restore_pte(pgd, va, frame, attrs);
+        goto out;
+    }
+    if (pmm_page_get(target) != 0) {
+        ksm_restore_pte(pgd, va, frame, attrs);
+        ret = -4;
+        goto out;
+    }
+    // Break-before-make, as in vma_break_cow()
+    mmu_unmap_page(pgd, va);
+    tlb_flush_page(va);
+    mmu_map_page(pgd, va, (uint64_t)target, ro);
+    __asm__ volatile("isb" ::: "memory");
+    pmm_free_page(frame);
+    ret = 0;
+
+out:
     spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return ret;
+}
+
+int vmm_clone(uint64_t src, uint64_t dst, uint64_t size) {
+    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
+    uint64_t end = src + size;
+    vmt_entry_t n;
+
+    int ret = vmm_check_range(src, size);
+    if (ret == 0 && (dst & (VMM_PAGE_SIZE - 1)))
+        ret = -2;
+    if (ret)
+        goto out;
+
+    // The source must be demand-paged throughout: fixed-PA mappings have no
+    // refcounted frames to share.
+    ret = -3;
+    if (!vma_range_covered(src, end))
+        goto out;
+    unsigned nr = 0;
+    for (uint64_t cur = src; cur < end; cur = n.end, nr++) {
+        find_le(cur, &n);
+        if (!(vma_of(&n)->attrs & VMM_ATTR_DEMAND)) {
+            ret = -1;
+            goto out;
+        }
+    }
+    // Also rejects a dst overlapping src, which is covered
+    if ((find_le(dst, &n) && n.end > dst) ||
+        (find_ge(dst, &n) && n.start < dst + size))
+        goto out;
+    ret = -4;
+    if (vma_free_count < (int)nr || !vmt_can_insert(&vma_tree, nr))
+        goto out;
+
+    write_seqcount_begin(&vma_seq);
+    for (uint64_t cur = src; cur < end; cur = n.end) {
+        find_le(cur, &n);
+        uint64_t hi = n.end < end ? n.end : end;
+        vma_t *v = vma_alloc();
+        v->pa = 0;
+        v->attrs = vma_of(&n)->attrs;
+        vmt_insert(&vma_tree, dst + (cur - src), dst + (hi - src), v);
+    }
+    vma_merge_range(dst, dst + size);
+    write_seqcount_end(&vma_seq);
+
+    ret = 0;
+    uint64_t ttbr1 = mmu_get_ttbr1();
+    if (!ttbr1)
+        goto out;
+
+    n.end = 0;
+    for (uint64_t off = 0; off < size; off += VMM_PAGE_SIZE) {
+        uint64_t pa;
+        if (src + off >= n.end)
+            find_le(src + off, &n);
+        // A swapped-out page is read back first and then shared like the rest
+        uint64_t desc = mmu_get_pte((uint64_t *)ttbr1, src + off);
+        if (pte_is_swap(desc) &&
+            vma_swap_in((uint64_t *)ttbr1, src + off, desc,
+                        vma_of(&n)->attrs) != 0) {
+            ret = -4;
+            break;
+        }
+        if (mmu_translate(src + off, &pa) != 0)
+            continue; // never touched: both sides fault in zeroes
+        void *frame = (void *)ALIGN_DOWN(pa, VMM_PAGE_SIZE);
+        uint64_t ro = vmm_pte_attrs(vma_of(&n)->attrs & ~VMM_ATTR_W);
+
+        if (pmm_page_get(frame) != 0) {
+            // Not shareable (refcount saturated): copy it now instead
+            void *copy = pmm_alloc_page();
+            if (!copy) {
+                ret = -4;
+                break;
+            }
+            memcpy(copy, frame, VMM_PAGE_SIZE);
+            if (mmu_map_page((uint64_t *)ttbr1, dst + off, (uint64_t)copy,
+                             vmm_pte_attrs(vma_of(&n)->attrs)) != 0) {
+                pmm_free_page(copy);
+                ret = -4;
+                break;
+            }
+            vma_lru_add(copy, dst + off, vma_of(&n)->attrs);
+            continue;
+        }
+        if (mmu_map_page((uint64_t *)ttbr1, dst + off, (uint64_t)frame, ro) !=
+            0) {
+            pmm_free_page(frame);
+            ret = -4;
+            break;
+        }
+        mmu_update_page_attrs((uint64_t *)ttbr1, src + off, ro);
+    }
+    // The source lost write permission on every shared page
+    tlb_flush_range(src, size);
+
+out:
+    spinlock_unlock_irqrestore(&vmm_lock, flags);
+    return ret;
+}
+
+// Copy out the VMA selected by pick(tree, va) without taking vmm_lock.
+static int lookup_area(int (*pick)(const vma_tree_t *, uint64_t,
+                                   vmt_entry_t *),
+                       uint64_t va, vmm_area_t *out) {
+    uint32_t seq;
+    int found;
+    do {
+        seq = read_seqcount_begin(&vma_seq);
+        vmt_entry_t e;
+        const vma_t *v = NULL;
+        found = pick(&vma_tree, va, &e) && (v = vma_of(&e)) != NULL;
+        if (found) {
+            out->va = e.start;
+            out->pa = v->pa;
+            out->size = e.end - e.start;
+            out->attrs = v->attrs;
+        }
+    } while (read_seqcount_retry(&vma_seq, seq));
+    return found;
+}
+
+int vmm_find_area(uint64_t va, vmm_area_t *out) {
+    vmm_area_t area;
+    if (!out || !lookup_area(vmt_find_le, va, &area))
+        return -1;
+    if (va >= area.va + area.size)
+        return -1;
+    *out = area;
+    return 0;
+}
+
+int vmm_find_next_area(uint64_t va, vmm_area_t *out) {
+    if (!out)
+        return -1;
+    if (vmm_find_area(va, out) == 0)
+        return 0;
+    return lookup_area(vmt_find_ge, va, out) ? 0 : -1;
+}
+
+int vmm_find_gap(uint64_t lo, uint64_t hi, uint64_t size, uint64_t *va_out) {
+    if (!va_out || vmm_check_range(lo, size))
+        return -1;
+    uint32_t seq;
+    int ret;
+    uint64_t va;
+    do {
+        seq = read_seqcount_begin(&vma_seq);
+        ret = vmt_find_gap(&vma_tree, lo, hi, size, &va);
+    } while (read_seqcount_retry(&vma_seq, seq));
+    if (ret == 0)
+        *va_out = va;
+    return ret;
+}
+
+void vmm_dump(void) {
+    // Iterate in VA order with independent lockless lookups; each line is a
+    // consistent snapshot of one VMA.
+    vmm_area_t area;
+    uint64_t next = 0;
+    while (lookup_area(vmt_find_ge, next, &area)) {
+        printk("VMM: VMA va=%p..%p -> pa=%p attrs=%x\n", (void *)area.va,
+               (void *)(area.va + area.size), (void *)area.pa,
+               (unsigned)area.attrs);
+        next = area.va + area.size;
+        if (next == 0)
+            break;
+    }
 }
 
 int vmm_virt_to_phys(uint64_t va, uint64_t *pa_out) {
     if (!pa_out)
         return -1;
 
-    uint64_t flags = spinlock_lock_irqsave(&vmm_lock);
-    // If a VMA covers this VA, translate via offset; otherwise assume identity
-    // (early boot)
-    vma_node_t *n = find_le(vma_root, va);
-    if (n && va >= n->va && va < (n->va + n->size)) {
-        *pa_out = n->pa + (va - n->va);
-        spinlock_unlock_irqrestore(&vmm_lock, flags);
+    vmm_area_t area;
+    if (vmm_find_area(va, &area) == 0 && !(area.attrs & VMM_ATTR_DEMAND)) {
+        *pa_out = area.pa + (va - area.va);
         return 0;
     }
-    *pa_out = va; // identity fallback
-    spinlock_unlock_irqrestore(&vmm_lock, flags);
-    return 0;
+
+    // Demand VMAs have no fixed PA, and the kernel image, linear map and
+    // identity window are not VMAs: all of them are translatable through the
+    // page tables, and anything else is unmapped.
+    return mmu_translate(va, pa_out);
+}
+
+int vmm_translate(uint64_t va, uint64_t *pa_out) {
+    if (!pa_out)
+        return -1;
+    return mmu_translate(va, pa_out);
 }
 
 uint64_t vmm_kernel_base(void) { return (uint64_t)VMM_KERNEL_VIRT_BASE; }
@@ -0,0 +1,154 @@
+// Compressed in-RAM page store
+//
+// One lock covers the entry table, the zsmalloc pool and the compressor
+// scratch buffers. Callers may hold vmm_lock; zram never calls back into the
+// VMM.
+
+#include <kernel/spinlock.h>
+#include <lz4.h>
+#include <mm/zram.h>
+#include <mm/zsmalloc.h>
+#include <string.h>
+
+#define ZRAM_PAGE_SIZE 4096
+
+#define ZRAM_USED (1u << 0)
+#define ZRAM_SAME (1u << 1) // value is the fill word, no object
+
+typedef struct {
+    uint64_t value; // zsmalloc handle, fill word, or next free index
+    uint16_t len;   // compressed length
+    uint16_t flags;
+} zram_entry_t;
+
+static spinlock_t zram_lock = SPINLOCK_INIT;
+static zram_entry_t entries[ZRAM_MAX_ENTRIES];
+static uint32_t free_head;   // 1-based; 0 = fall back to the bump index
+static uint32_t entries_used; // entries ever handed out
+static zram_stats_t stats;
+
+static uint8_t wrkmem[LZ4_WRKMEM_SIZE];
+static uint8_t cbuf[ZRAM_MAX_COMPRESSED];
+
+static uint32_t entry_alloc(void) {
+    if (free_head) {
+        uint32_t id = free_head;
+        free_head = (uint32_t)entries[id - 1].value;
+        return id;
+    }
+    if (entries_used < ZRAM_MAX_ENTRIES)
+        return ++entries_used;
+    return 0;
+}
+
+static void entry_release(uint32_t id) {
+    entries[id - 1].flags = 0;
+    entries[id - 1].value = free_head;
+    free_head = id;
+}
+
+static int page_same_filled(const uint64_t *w, uint64_t *fill) {
+    for (unsigned i = 1; i < ZRAM_PAGE_SIZE / 8; i++)
+        if (w[i] != w[0])
+            return 0;
+    *fill = w[0];
+    return 1;
+}
+
+int zram_store(const void *page, uint32_t *entry) {
+    uint64_t flags = spinlock_lock_irqsave(&zram_lock);
+    int ret = -4;
+    uint32_t id = entry_alloc();
+    if (!id)
+        goto out;
+    zram_entry_t *e = &entries[id - 1];
+
+    uint64_t fill;
+    if (page_same_filled(page, &fill)) {
+        e->value = fill;
+        e->len = 0;
+        e->flags = ZRAM_USED | ZRAM_SAME;
+        stats.same_filled++;
+    } else {
+        size_t len = lz4_compress(page, ZRAM_PAGE_SIZE, cbuf, sizeof(cbuf),
+                                  wrkmem);
+        if (!len) {
+            entry_release(id);
+            stats.rejected++;
+            ret = 1;
+            goto out;
+        }
+        uint32_t handle = zs_malloc((uint32_t)len);
+        if (!handle) {
+            entry_release(id);
+            goto out;
+        }
+        memcpy(zs_map(handle), cbuf, len);
+        e->value = handle;
+        e->len = (uint16_t)len;
+        e->flags = ZRAM_USED;
+        stats.compr_bytes += len;
+    }
+    stats.stored++;
+    stats.stores++;
+    *entry = id;
+    ret = 0;
+
+out:
+    spinlock_unlock_irqrestore(&zram_lock, flags);
+    return ret;
+}
+
+static zram_entry_t *entry_get(uint32_t id) {
+    if (id == 0 || id > entries_used || !(entries[id - 1].flags & ZRAM_USED))
+        return NULL;
+    return &entries[id - 1];
+}
+
+int zram_load(uint32_t entry, void *page) {
+    uint64_t flags = spinlock_lock_irqsave(&zram_lock);
+    int ret = -1;
+    zram_entry_t *e = entry_get(entry);
+    if (!e)
+        goto out;
+
+    if (e->flags & ZRAM_SAME) {
+        uint64_t *w = page;
+        for (unsigned i = 0; i < ZRAM_PAGE_SIZE / 8; i++)
+            w[i] = e->value;
+    } else if (lz4_decompress(zs_map((uint32_t)e->value), e->len, page,
+                              ZRAM_PAGE_SIZE) != ZRAM_PAGE_SIZE) {
+        goto out;
+    }
+    stats.loads++;
+    ret = 0;
+
+out:
+    spinlock_unlock_irqrestore(&zram_lock, flags);
+    return ret;
+}
+
+void zram_free(uint32_t entry) {
+    uint64_t flags = spinlock_lock_irqsave(&zram_lock);
+    zram_entry_t *e = entry_get(entry);
+    if (e) {
+        if (e->flags & ZRAM_SAME) {
+            stats.same_filled--;
+        } else {
+            zs_free((uint32_t)e->value);
+            stats.compr_bytes -= e->len;
+        }
+        stats.stored--;
+        entry_release(entry);
+    }
+    spinlock_unlock_irqrestore(&zram_lock, flags);
+}
+
+void zram_get_stats(zram_stats_t *out) {
+    uint64_t flags = spinlock_lock_irqsave(&zram_lock);
+    *out = stats;
+    zs_stats_t zs;
+    zs_get_stats(&zs);
+    out->pool_pages = zs.pages;
+    spinlock_unlock_irqrestore(&zram_lock, flags);
+}
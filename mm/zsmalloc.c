@@ -0,0 +1,186 @@
+// Size-class allocator for compressed objects
+//
+// Every class keeps a doubly linked list of its zspages that still have a
+// free slot, so allocation is O(1) apart from a bitmap scan inside the
+// zspage. A zspage that becomes empty goes straight back to the PMM.
+// Objects never straddle zspages; the number of frames per zspage is picked
+// per class so that the tail left over after the last slot stays small: 1632-
+// byte objects get 2 frames holding 5 slots with 32 bytes to spare, rather
+// than 2 slots per frame and 832 bytes (20%) lost.
+
+#include <mm/pmm.h>
+#include <mm/zsmalloc.h>
+
+#define ZS_NR_CLASSES (ZS_MAX_SIZE / ZS_ALIGN)
+#define ZS_MAX_SLOTS (ZS_MAX_ZSPAGE_PAGES * PMM_PAGE_SIZE / ZS_ALIGN)
+#define ZS_SLOT_BITS 9 // log2(ZS_MAX_SLOTS)
+#define ZS_MAP_WORDS (ZS_MAX_SLOTS / 64)
+
+typedef struct zspage {
+    uint8_t *base;
+    struct zspage *next; // class partial list, or free list
+    struct zspage *prev;
+    uint16_t cls;
+    uint16_t inuse;
+    uint64_t free_map[ZS_MAP_WORDS]; // set bit: free slot
+} zspage_t;
+
+typedef struct {
+    uint16_t size;  // slot size
+    uint16_t slots; // slots per zspage
+    uint8_t pages;  // frames per zspage
+    zspage_t *partial;
+} zs_class_t;
+
+static zs_class_t classes[ZS_NR_CLASSES];
+static int classes_ready;
+
+static zspage_t zspage_pool[ZS_MAX_ZSPAGES];
+static zspage_t *zspage_free;
+static unsigned zspage_used; // pool entries ever handed out
+static zs_stats_t stats;
+
+static void zs_init_classes(void) {
+    for (unsigned c = 0; c < ZS_NR_CLASSES; c++) {
+        uint32_t size = (c + 1) * ZS_ALIGN;
+        uint32_t best_pages = 1;
+        uint32_t best_waste = PMM_PAGE_SIZE % size;
+        // Compare waste as a fraction of the zspage; ties keep fewer frames
+        for (uint32_t k = 2; k <= ZS_MAX_ZSPAGE_PAGES; k++) {
+            uint32_t waste = (k * PMM_PAGE_SIZE) % size;
+            if (waste * best_pages < best_waste * k) {
+                best_pages = k;
+                best_waste = waste;
+            }
+        }
+        classes[c].size = (uint16_t)size;
+        classes[c].pages = (uint8_t)best_pages;
+        classes[c].slots = (uint16_t)(best_pages * PMM_PAGE_SIZE / size);
+        classes[c].partial = NULL;
+    }
+    classes_ready = 1;
+}
+
+static void partial_add(zs_class_t *cl, zspage_t *z) {
+    z->prev = NULL;
+    z->next = cl->partial;
+    if (cl->partial)
+        cl->partial->prev = z;
+    cl->partial = z;
+}
+
+static void partial_del(zs_class_t *cl, zspage_t *z) {
+    if (z->prev)
+        z->prev->next = z->next;
+    else
+        cl->partial = z->next;
+    if (z->next)
+        z->next->prev = z->prev;
+    z->next = z->prev = NULL;
+}
+
+static zspage_t *zspage_create(unsigned c) {
+    zs_class_t *cl = &classes[c];
+    zspage_t *z = zspage_free;
+    if (z)
+        zspage_free = z->next;
+    else if (zspage_used < ZS_MAX_ZSPAGES)
+        z = &zspage_pool[zspage_used++];
+    if (!z)
+        return NULL;
+
+    z->base = pmm_alloc_pages(cl->pages);
+    if (!z->base) {
+        z->next = zspage_free;
+        zspage_free = z;
+        return NULL;
+    }
+    z->cls = (uint16_t)c;
+    z->inuse = 0;
+    for (unsigned w = 0; w < ZS_MAP_WORDS; w++) {
+        unsigned first = w * 64;
+        if (first >= cl->slots)
+            z->free_map[w] = 0;
+        else if (cl->slots - first >= 64)
+            z->free_map[w] = ~0ULL;
+        else
+            z->free_map[w] = (1ULL << (cl->slots - first)) - 1;
+    }
+    partial_add(cl, z);
+    stats.zspages++;
+    stats.pages += cl->pages;
+    return z;
+}
+
+uint32_t zs_malloc(uint32_t size) {
+    if (size == 0 || size > ZS_MAX_SIZE)
+        return 0;
+    if (!classes_ready)
+        zs_init_classes();
+
+    unsigned c = (size - 1) / ZS_ALIGN;
+    zs_class_t *cl = &classes[c];
+    zspage_t *z = cl->partial;
+    if (!z && !(z = zspage_create(c)))
+        return 0;
+
+    unsigned w = 0;
+    while (!z->free_map[w])
+        w++;
+    unsigned slot = w * 64 + (unsigned)__builtin_ctzll(z->free_map[w]);
+    z->free_map[w] &= ~(1ULL << (slot % 64));
+    if (++z->inuse == cl->slots)
+        partial_del(cl, z);
+
+    stats.objects++;
+    stats.used_bytes += cl->size;
+    return (uint32_t)((z - zspage_pool + 1) << ZS_SLOT_BITS) | slot;
+}
+
+static zspage_t *handle_zspage(uint32_t handle, unsigned *slot) {
+    uint32_t idx = handle >> ZS_SLOT_BITS;
+    if (idx == 0 || idx > zspage_used)
+        return NULL;
+    zspage_t *z = &zspage_pool[idx - 1];
+    *slot = handle & ((1u << ZS_SLOT_BITS) - 1);
+    if (!z->base || *slot >= classes[z->cls].slots)
+        return NULL;
+    return z;
+}
+
+void zs_free(uint32_t handle) {
+    unsigned slot;
+    zspage_t *z = handle_zspage(handle, &slot);
+    if (!z || (z->free_map[slot / 64] & (1ULL << (slot % 64))))
+        return; // bad handle or double free
+
+    zs_class_t *cl = &classes[z->cls];
+    int was_full = z->inuse == cl->slots;
+    z->free_map[slot / 64] |= 1ULL << (slot % 64);
+    z->inuse--;
+    stats.objects--;
+    stats.used_bytes -= cl->size;
+
+    if (z->inuse == 0) {
+        if (!was_full)
+            partial_del(cl, z);
+        pmm_free_pages(z->base, cl->pages);
+        z->base = NULL;
+        z->next = zspage_free;
+        zspage_free = z;
+        stats.zspages--;
+        stats.pages -= cl->pages;
+    } else if (was_full) {
+        partial_add(cl, z);
+    }
+}
+
+void *zs_map(uint32_t handle) {
+    unsigned slot;
+    zspage_t *z = handle_zspage(handle, &slot);
+    if (!z)
+        return NULL;
+    return z->base + (uint64_t)slot * classes[z->cls].size;
+}
+
+void zs_get_stats(zs_stats_t *out) { *out = stats; }
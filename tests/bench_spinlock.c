@@ -0,0 +1,151 @@
+// Spinlock microbenchmark: queued MCS lock (kernel/spinlock.c) vs. the
+// test-and-set lock it replaced.
+//
+// Uncontended: back-to-back lock/unlock pairs on one CPU.
+// Contended: BENCH_LOCK_TASKS tasks take the lock in a loop with IRQs on,
+// holding it for BENCH_HOLD_NS each time. With a single CPU a waiter can
+// only find the lock held when the holder was preempted inside its critical
+// section, so this measures what happens then: how the acquisitions are
+// shared out and how long the worst wait is. Handover latency between CPUs
+// needs SMP and is not measured.
+
+#include <drivers/timer.h>
+#include <kernel/printk.h>
+#include <kernel/sched/task.h>
+#include <kernel/spinlock.h>
+#include <stddef.h>
+#include <test/bench_spinlock.h>
+
+#define BENCH_UNCONTENDED 100000
+#define BENCH_LOCK_TASKS 3
+#define BENCH_RUN_NS (300 * 1000000ULL)
+#define BENCH_HOLD_NS 5000ULL
+
+// --- Baseline: the test-and-set lock formerly in kernel/spinlock.h ---
+
+typedef struct {
+    volatile uint32_t lock;
+} tas_lock_t;
+
+static inline void tas_lock(tas_lock_t *lock) {
+    uint32_t tmp;
+    __asm__ volatile("1: ldaxr %w0, [%1]\n"
+                     "   cbnz %w0, 1b\n"
+                     "   stxr %w0, %w2, [%1]\n"
+                     "   cbnz %w0, 1b\n"
+                     : "=&r"(tmp)
+                     : "r"(&lock->lock), "r"(1)
+                     : "memory");
+}
+
+static inline void tas_unlock(tas_lock_t *lock) {
+    __asm__ volatile("stlr %w1, [%0]\n"
+                     :
+                     : "r"(&lock->lock), "r"(0)
+                     : "memory");
+}
+
+// --- Contended run ---
+
+static tas_lock_t bench_tas;
+static spinlock_t bench_queued;
+static volatile int bench_use_queued;
+static volatile uint64_t bench_end;
+static volatile uint64_t bench_in_section;
+static uint64_t bench_acquired[BENCH_LOCK_TASKS];
+static uint64_t bench_max_wait[BENCH_LOCK_TASKS];
+static volatile int bench_broken;
+
+static void bench_lock_entry(int argc, char **argv, char **envp) {
+    (void)argv;
+    (void)envp;
+    while (get_ns() < bench_end) {
+        uint64_t t0 = get_ns();
+        if (bench_use_queued)
+            spinlock_lock(&bench_queued);
+        else
+            tas_lock(&bench_tas);
+        uint64_t now = get_ns();
+        if (bench_in_section++)
+            bench_broken = 1;
+        bench_acquired[argc]++;
+        if (now - t0 > bench_max_wait[argc])
+            bench_max_wait[argc] = now - t0;
+        while (get_ns() - now < BENCH_HOLD_NS)
+            ;
+        bench_in_section--;
+        if (bench_use_queued)
+            spinlock_unlock(&bench_queued);
+        else
+            tas_unlock(&bench_tas);
+    }
+}
+
+static void run_contended(int queued) {
+    task_t *tasks[BENCH_LOCK_TASKS] = {0};
+    bench_use_queued = queued;
+    bench_end = get_ns() + BENCH_RUN_NS;
+    for (int i = 0; i < BENCH_LOCK_TASKS; i++) {
+        bench_acquired[i] = bench_max_wait[i] = 0;
+        task_args args = {.argc = i, .argv = NULL, .envp = NULL};
+        tasks[i] = task_create(bench_lock_entry, 0, &args);
+        if (!tasks[i]) {
+            printk("  SKIP (could not create tasks)\n");
+            bench_end = 0;
+            break;
+        }
+        // Pinned: reaped tasks are freed a grace period later
+        task_get(tasks[i]);
+    }
+    for (int i = 0; i < BENCH_LOCK_TASKS; i++)
+        while (tasks[i] && tasks[i]->state != TASK_ZOMBIE)
+            schedule();
+    task_reap();
+    for (int i = 0; i < BENCH_LOCK_TASKS; i++)
+        if (tasks[i])
+            task_put(tasks[i]);
+
+    uint64_t total = 0, min = UINT64_MAX, max = 0, wait = 0;
+    for (int i = 0; i < BENCH_LOCK_TASKS; i++) {
+        total += bench_acquired[i];
+        min = bench_acquired[i] < min ? bench_acquired[i] : min;
+        max = bench_acquired[i] > max ? bench_acquired[i] : max;
+        wait = bench_max_wait[i] > wait ? bench_max_wait[i] : wait;
+    }
+    printk("  %s: %llu acquisitions (per task %llu-%llu), worst wait %llu us\n",
+           queued ? "queued" : "tas   ", (unsigned long long)total,
+           (unsigned long long)min, (unsigned long long)max,
+           (unsigned long long)(wait / 1000));
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks, uint64_t ops) {
+    return ticks * 1000000000ULL / read_cntfrq() / ops;
+}
+
+void run_spinlock_benchmark(void) {
+    printk("\n========================================\n");
+    printk("  SPINLOCK BENCHMARK\n");
+    printk("========================================\n");
+
+    uint64_t t0 = read_cntpct();
+    for (int i = 0; i < BENCH_UNCONTENDED; i++) {
+        tas_lock(&bench_tas);
+        tas_unlock(&bench_tas);
+    }
+    uint64_t tas_ticks = read_cntpct() - t0;
+    t0 = read_cntpct();
+    for (int i = 0; i < BENCH_UNCONTENDED; i++) {
+        spinlock_lock(&bench_queued);
+        spinlock_unlock(&bench_queued);
+    }
+    uint64_t queued_ticks = read_cntpct() - t0;
+    printk("  uncontended: tas %llu ns/op, queued %llu ns/op\n",
+           (unsigned long long)ticks_to_ns(tas_ticks, BENCH_UNCONTENDED),
+           (unsigned long long)ticks_to_ns(queued_ticks, BENCH_UNCONTENDED));
+
+    bench_broken = 0;
+    run_contended(0);
+    run_contended(1);
+    if (bench_broken)
+        printk("  FAIL (two holders at once)\n");
+}
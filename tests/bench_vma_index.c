@@ -0,0 +1,310 @@
+// VMA index microbenchmark: range B-tree (mm/vma_tree.c) vs. the RB-tree it
+// replaced. Both index the same BENCH_VMAS single-page ranges separated by
+// one-page holes, inserted in random order, then answer the same lookup and
+// gap-find queries. The RB-tree has no gap summaries, so gap-find is an
+// in-order walk from the start address, as a caller of the old tree had to do.
+
+#include <drivers/timer.h>
+#include <kernel/printk.h>
+#include <mm/pmm.h>
+#include <mm/vma_tree.h>
+#include <test/bench_vma_index.h>
+
+#define BENCH_VMAS 12288
+#define BENCH_LOOKUPS 100000
+#define BENCH_GAP_FINDS 1000
+#define BENCH_PAGE 4096ULL
+#define BENCH_BASE 0xFFFFFF8100000000ULL
+#define BENCH_END (BENCH_BASE + 2 * BENCH_PAGE * BENCH_VMAS + 4 * BENCH_PAGE)
+#define BENCH_TREE_NODES (BENCH_VMAS / 4)
+// Sanity bounds, far from the measured ratios: gap-find must be at least
+// this many times faster in the B-tree, lookup at most this many times slower
+#define BENCH_MIN_GAP_SPEEDUP 10
+#define BENCH_MAX_LOOKUP_SLOWDOWN 2
+
+// --- Baseline: the RB-tree formerly used by mm/vmm.c ---
+
+typedef struct rb_vma {
+    uint64_t va, size;
+    struct rb_vma *left, *right, *parent;
+    int red;
+} rb_vma_t;
+
+static void rb_rotate_left(rb_vma_t **root, rb_vma_t *x) {
+    rb_vma_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        *root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_vma_t **root, rb_vma_t *y) {
+    rb_vma_t *x = y->left;
+    y->left = x->right;
+    if (x->right)
+        x->right->parent = y;
+    x->parent = y->parent;
+    if (!y->parent)
+        *root = x;
+    else if (y == y->parent->left)
+        y->parent->left = x;
+    else
+        y->parent->right = x;
+    x->right = y;
+    y->parent = x;
+}
+
+static void rb_insert(rb_vma_t **root, rb_vma_t *z) {
+    rb_vma_t **link = root, *parent = NULL;
+    while (*link) {
+        parent = *link;
+        link = z->va < parent->va ? &parent->left : &parent->right;
+    }
+    *link = z;
+    z->parent = parent;
+    z->left = z->right = NULL;
+    z->red = 1;
+
+    while (z->parent && z->parent->red) {
+        rb_vma_t *p = z->parent, *g = p->parent;
+        int left = p == g->left;
+        rb_vma_t *u = left ? g->right : g->left;
+        if (u && u->red) {
+            p->red = u->red = 0;
+            g->red = 1;
+            z = g;
+            continue;
+        }
+        if (z == (left ? p->right : p->left)) {
+            z = p;
+            if (left)
+                rb_rotate_left(root, z);
+            else
+                rb_rotate_right(root, z);
+            p = z->parent;
+        }
+        p->red = 0;
+        g->red = 1;
+        if (left)
+            rb_rotate_right(root, g);
+        else
+            rb_rotate_left(root, g);
+    }
+    (*root)->red = 0;
+}
+
+static rb_vma_t *rb_find_le(rb_vma_t *n, uint64_t va) {
+    rb_vma_t *res = NULL;
+    while (n) {
+        if (va < n->va)
+            n = n->left;
+        else {
+            res = n;
+            n = n->right;
+        }
+    }
+    return res;
+}
+
+static rb_vma_t *rb_next(rb_vma_t *n) {
+    if (n->right) {
+        n = n->right;
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+    while (n->parent && n == n->parent->right)
+        n = n->parent;
+    return n->parent;
+}
+
+static int rb_find_gap(rb_vma_t *root, uint64_t lo, uint64_t hi,
+                       uint64_t size, uint64_t *out) {
+    uint64_t cursor = lo;
+    rb_vma_t *n = rb_find_le(root, lo);
+    if (n) {
+        if (n->va + n->size > cursor)
+            cursor = n->va + n->size;
+        n = rb_next(n);
+    } else {
+        for (n = root; n && n->left;)
+            n = n->left;
+    }
+    for (; n && n->va < hi; n = rb_next(n)) {
+        if (n->va >= cursor && n->va - cursor >= size) {
+            *out = cursor;
+            return 0;
+        }
+        if (n->va + n->size > cursor)
+            cursor = n->va + n->size;
+    }
+    if (cursor < hi && hi - cursor >= size) {
+        *out = cursor;
+        return 0;
+    }
+    return -1;
+}
+
+// --- Harness ---
+
+static uint64_t bench_rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_rand(void) {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks, uint64_t ops) {
+    return ticks * 1000000000ULL / read_cntfrq() / ops;
+}
+
+static void report(const char *what, uint64_t rb_ticks, uint64_t bt_ticks,
+                   uint64_t ops) {
+    printk("  %s: rb-tree %llu ns/op, b-tree %llu ns/op\n", what,
+           (unsigned long long)ticks_to_ns(rb_ticks, ops),
+           (unsigned long long)ticks_to_ns(bt_ticks, ops));
+}
+
+static uint64_t pages_for(uint64_t bytes) {
+    return (bytes + BENCH_PAGE - 1) / BENCH_PAGE;
+}
+
+int run_vma_index_benchmark(void) {
+    int ret = -1;
+    printk("\n========================================\n");
+    printk("  VMA INDEX BENCHMARK (%d VMAs)\n", BENCH_VMAS);
+    printk("========================================\n");
+
+    uint64_t rb_pages = pages_for(sizeof(rb_vma_t) * BENCH_VMAS);
+    uint64_t bt_pages = pages_for(sizeof(vmt_node_t) * BENCH_TREE_NODES);
+    uint64_t ord_pages = pages_for(sizeof(uint32_t) * BENCH_VMAS);
+    rb_vma_t *rb_nodes = pmm_alloc_pages(rb_pages);
+    vmt_node_t *bt_nodes = pmm_alloc_pages(bt_pages);
+    uint32_t *order = pmm_alloc_pages(ord_pages);
+    if (!rb_nodes || !bt_nodes || !order) {
+        printk("  SKIP (out of memory)\n");
+        ret = 0;
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < BENCH_VMAS; i++)
+        order[i] = i;
+    for (uint32_t i = BENCH_VMAS - 1; i > 0; i--) {
+        uint32_t j = (uint32_t)(bench_rand() % (i + 1));
+        uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    // Insert
+    rb_vma_t *rb_root = NULL;
+    uint64_t t0 = read_cntpct();
+    for (uint32_t i = 0; i < BENCH_VMAS; i++) {
+        rb_vma_t *n = &rb_nodes[i];
+        n->va = BENCH_BASE + 2 * BENCH_PAGE * order[i];
+        n->size = BENCH_PAGE;
+        rb_insert(&rb_root, n);
+    }
+    uint64_t rb_ticks = read_cntpct() - t0;
+
+    vma_tree_t tree;
+    vmt_init(&tree, bt_nodes, BENCH_TREE_NODES);
+    t0 = read_cntpct();
+    for (uint32_t i = 0; i < BENCH_VMAS; i++) {
+        uint64_t va = BENCH_BASE + 2 * BENCH_PAGE * order[i];
+        if (vmt_insert(&tree, va, va + BENCH_PAGE, &rb_nodes[i]) != 0) {
+            printk("  FAIL (b-tree insert %u)\n", i);
+            goto out;
+        }
+    }
+    uint64_t bt_ticks = read_cntpct() - t0;
+    report("insert   ", rb_ticks, bt_ticks, BENCH_VMAS);
+
+    // Lookup (greatest start <= addr, as vmm_find_area does)
+    uint64_t rb_sum = 0, bt_sum = 0;
+    uint64_t seed = bench_rng;
+    t0 = read_cntpct();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        uint64_t va = BENCH_BASE + bench_rand() % (BENCH_END - BENCH_BASE);
+        rb_vma_t *n = rb_find_le(rb_root, va);
+        rb_sum += n ? n->va : 0;
+    }
+    rb_ticks = read_cntpct() - t0;
+
+    bench_rng = seed;
+    t0 = read_cntpct();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        uint64_t va = BENCH_BASE + bench_rand() % (BENCH_END - BENCH_BASE);
+        vmt_entry_t e;
+        bt_sum += vmt_find_le(&tree, va, &e) ? e.start : 0;
+    }
+    bt_ticks = read_cntpct() - t0;
+    report("lookup   ", rb_ticks, bt_ticks, BENCH_LOOKUPS);
+    if (rb_sum != bt_sum) {
+        printk("  FAIL (lookup results differ)\n");
+        goto out;
+    }
+    if (bt_ticks > BENCH_MAX_LOOKUP_SLOWDOWN * rb_ticks) {
+        printk("  FAIL (b-tree lookup over %dx slower)\n",
+               BENCH_MAX_LOOKUP_SLOWDOWN);
+        goto out;
+    }
+
+    // Gap-find: two pages only fit past the last VMA, so every query has to
+    // skip everything above its start address.
+    rb_sum = bt_sum = 0;
+    seed = bench_rng;
+    t0 = read_cntpct();
+    for (int i = 0; i < BENCH_GAP_FINDS; i++) {
+        uint64_t lo = BENCH_BASE + BENCH_PAGE * (bench_rand() % BENCH_VMAS);
+        uint64_t va = 0;
+        rb_find_gap(rb_root, lo, BENCH_END, 2 * BENCH_PAGE, &va);
+        rb_sum += va;
+    }
+    rb_ticks = read_cntpct() - t0;
+
+    bench_rng = seed;
+    t0 = read_cntpct();
+    for (int i = 0; i < BENCH_GAP_FINDS; i++) {
+        uint64_t lo = BENCH_BASE + BENCH_PAGE * (bench_rand() % BENCH_VMAS);
+        uint64_t va = 0;
+        vmt_find_gap(&tree, lo, BENCH_END, 2 * BENCH_PAGE, &va);
+        bt_sum += va;
+    }
+    bt_ticks = read_cntpct() - t0;
+    report("gap-find ", rb_ticks, bt_ticks, BENCH_GAP_FINDS);
+    if (rb_sum != bt_sum) {
+        printk("  FAIL (gap-find results differ)\n");
+        goto out;
+    }
+    if (bt_ticks * BENCH_MIN_GAP_SPEEDUP > rb_ticks) {
+        printk("  FAIL (b-tree gap-find under %dx faster)\n",
+               BENCH_MIN_GAP_SPEEDUP);
+        goto out;
+    }
+
+    printk("  b-tree: %u nodes of %u bytes in use\n",
+           (unsigned)(BENCH_TREE_NODES - tree.nr_free),
+           (unsigned)sizeof(vmt_node_t));
+    printk("  PASS\n");
+    ret = 0;
+
+out:
+    if (order)
+        pmm_free_pages(order, ord_pages);
+    if (bt_nodes)
+        pmm_free_pages(bt_nodes, bt_pages);
+    if (rb_nodes)
+        pmm_free_pages(rb_nodes, rb_pages);
+    return ret;
+}
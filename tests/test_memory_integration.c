@@ -1,8 +1,14 @@
+#include <dtb.h>
 #include <kernel/printk.h>
 #include <kernel/sched/task.h>
+#include <mm/ioremap.h>
+#include <mm/ksm.h>
+#include <mm/lru.h>
+#include <mm/numa.h>
 #include <mm/pmm.h>
 #include <mm/vmalloc.h>
 #include <mm/vmm.h>
+#include <mm/zram.h>
 #include <string.h>
 
 #define TEST_PATTERN_1 0xAA
@@ -15,7 +21,7 @@ static int tests_failed = 0;
 
 // Test 1: PMM Basic Allocation
 static int test_pmm_basic(void) {
-    printk("  [1/10] PMM basic allocation...");
+    printk("  [1/21] PMM basic allocation...");
 
     void *p1 = pmm_alloc_page();
     void *p2 = pmm_alloc_page();
@@ -30,13 +36,22 @@ static int test_pmm_basic(void) {
     pmm_free_page(p2);
     pmm_free_page(p3);
 
+    // Reserved frames are pinned: a stray free must not release them
+    extern char _kernel_start[];
+    size_t free_before = pmm_free_pages_count();
+    pmm_free_page(_kernel_start);
+    if (pmm_free_pages_count() != free_before) {
+        printk(" FAIL (reserved page freed)\n");
+        return -1;
+    }
+
     printk(" PASS\n");
     return 0;
 }
 
 // Test 2: PMM Write/Read Patterns
 static int test_pmm_patterns(void) {
-    printk("  [2/10] PMM write/read patterns...");
+    printk("  [2/21] PMM write/read patterns...");
 
     void *page = pmm_alloc_page();
     if (!page) {
@@ -73,7 +88,7 @@ static int test_pmm_patterns(void) {
 
 // Test 3: PMM Stress Test
 static int test_pmm_stress(void) {
-    printk("  [3/10] PMM stress test (128 pages)...");
+    printk("  [3/21] PMM stress test (128 pages)...");
 
 #define STRESS_PAGES 128
     void *pages[STRESS_PAGES];
@@ -115,7 +130,7 @@ static int test_pmm_stress(void) {
 
 // Test 4: VMM Basic Mapping
 static int test_vmm_basic(void) {
-    printk("  [4/10] VMM basic mapping...");
+    printk("  [4/21] VMM basic mapping...");
 
     void *page = pmm_alloc_page();
     if (!page) {
@@ -150,7 +165,7 @@ static int test_vmm_basic(void) {
 
 // Test 5: VMM Permission Changes
 static int test_vmm_protect(void) {
-    printk("  [5/10] VMM permission changes...");
+    printk("  [5/21] VMM permission changes...");
 
     void *page = pmm_alloc_page();
     if (!page) {
@@ -183,7 +198,7 @@ static int test_vmm_protect(void) {
 
 // Test 6: vmalloc Basic
 static int test_vmalloc_basic(void) {
-    printk("  [6/10] vmalloc basic (8KB)...");
+    printk("  [6/21] vmalloc basic (8KB)...");
 
     void *buf = vmalloc(8192);
     if (!buf) {
@@ -208,7 +223,7 @@ static int test_vmalloc_basic(void) {
 
 // Test 7: vmalloc Fragmentation
 static int test_vmalloc_fragmentation(void) {
-    printk("  [7/10] vmalloc fragmentation...");
+    printk("  [7/21] vmalloc fragmentation...");
 
     void *b1 = vmalloc(4096);
     void *b2 = vmalloc(8192);
@@ -244,7 +259,7 @@ static int test_vmalloc_fragmentation(void) {
 
 // Test 8: Memory Isolation
 static int test_memory_isolation(void) {
-    printk("  [8/10] Memory isolation...");
+    printk("  [8/21] Memory isolation...");
 
     void *p1 = vmalloc(4096);
     void *p2 = vmalloc(4096);
@@ -280,7 +295,7 @@ static int test_memory_isolation(void) {
 
 // Test 9: Large Allocation
 static int test_large_allocation(void) {
-    printk("  [9/10] Large allocation (64KB)...");
+    printk("  [9/21] Large allocation (64KB)...");
 
     void *buf = vmalloc(65536);
     if (!buf) {
@@ -310,7 +325,7 @@ static int test_large_allocation(void) {
 
 // Test 10: Concurrent Allocation (simulated)
 static int test_concurrent_allocation(void) {
-    printk("  [10/10] Concurrent allocation pattern...");
+    printk("  [10/21] Concurrent allocation pattern...");
 
 #define CONCURRENT_ALLOCS 32
     void *allocs[CONCURRENT_ALLOCS];
@@ -356,7 +371,736 @@ static int test_concurrent_allocation(void) {
     return 0;
 }
 
+// Test 11: Lockless Translation
+static int test_vmm_translate(void) {
+    printk("  [11/21] VMM lockless translation...");
+
+    void *page = pmm_alloc_page();
+    if (!page) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    uint64_t va = vmm_kernel_base() + 0x52000000ULL;
+    vmm_map(va, (uint64_t)page, 4096,
+            VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_NORMAL);
+
+    uint64_t pa = 0;
+    if (vmm_translate(va + 0x123, &pa) != 0 || pa != (uint64_t)page + 0x123) {
+        printk(" FAIL (mapped va -> %p)\n", (void *)pa);
+        vmm_unmap(va, 4096);
+        pmm_free_page(page);
+        return -1;
+    }
+
+    vmm_unmap(va, 4096);
+    pmm_free_page(page);
+
+    if (vmm_translate(va, &pa) == 0 || vmm_virt_to_phys(va, &pa) == 0) {
+        printk(" FAIL (unmapped va translated)\n");
+        return -1;
+    }
+
+    printk(" PASS\n");
+    return 0;
+}
+
+// Test 12: VMA Split and Merge
+static int test_vmm_split_merge(void) {
+    printk("  [12/21] VMM partial unmap/protect with split/merge...");
+
+    void *pages = pmm_alloc_pages(4);
+    if (!pages) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    uint64_t va = vmm_kernel_base() + 0x53000000ULL;
+    uint64_t pa = (uint64_t)pages;
+    uint32_t rw = VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_NORMAL;
+    int ret = -1;
+    vmm_area_t area;
+
+    // Page-by-page maps of contiguous frames collapse into one VMA
+    for (int i = 0; i < 4; i++)
+        vmm_map(va + i * 4096, pa + i * 4096, 4096, rw);
+    if (vmm_find_area(va + 3 * 4096, &area) != 0 || area.va != va ||
+        area.size != 4 * 4096) {
+        printk(" FAIL (merge)\n");
+        goto out;
+    }
+
+    // Protecting the middle splits it out; restoring merges it back
+    if (vmm_protect(va + 4096, 4096, VMM_ATTR_R | VMM_ATTR_NORMAL) != 0 ||
+        vmm_find_area(va, &area) != 0 || area.size != 4096) {
+        printk(" FAIL (split on protect)\n");
+        goto out;
+    }
+    if (vmm_protect(va + 4096, 4096, rw) != 0 ||
+        vmm_find_area(va, &area) != 0 || area.size != 4 * 4096) {
+        printk(" FAIL (merge on protect)\n");
+        goto out;
+    }
+
+    // Punch a hole and check both sides survive
+    uint64_t tmp;
+    if (vmm_unmap(va + 2 * 4096, 4096) != 0 ||
+        vmm_translate(va + 2 * 4096, &tmp) == 0 ||
+        vmm_translate(va + 3 * 4096, &tmp) != 0 || tmp != pa + 3 * 4096) {
+        printk(" FAIL (partial unmap)\n");
+        goto out;
+    }
+    if (vmm_unmap(va, 4 * 4096) == 0) {
+        printk(" FAIL (unmap across hole accepted)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    for (int i = 0; i < 4; i++)
+        vmm_unmap(va + i * 4096, 4096);
+    pmm_free_pages(pages, 4);
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 13: VMA gap search
+static int test_vmm_find_gap(void) {
+    printk("  [13/21] VMM free-range search...");
+
+    void *pages = pmm_alloc_pages(2);
+    if (!pages) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    uint64_t lo = vmm_kernel_base() + 0x54000000ULL;
+    uint64_t hi = lo + 16 * 4096;
+    uint64_t pa = (uint64_t)pages;
+    uint32_t rw = VMM_ATTR_R | VMM_ATTR_W | VMM_ATTR_NORMAL;
+    int ret = -1;
+    uint64_t va;
+
+    // [lo, +1) mapped, one-page hole, [lo+2, +3) mapped
+    vmm_map(lo, pa, 4096, rw);
+    vmm_map(lo + 2 * 4096, pa + 4096, 4096, rw);
+
+    if (vmm_find_gap(lo, hi, 4096, &va) != 0 || va != lo + 4096) {
+        printk(" FAIL (one-page hole)\n");
+        goto out;
+    }
+    if (vmm_find_gap(lo, hi, 2 * 4096, &va) != 0 || va != lo + 3 * 4096) {
+        printk(" FAIL (two-page gap)\n");
+        goto out;
+    }
+    if (vmm_find_gap(lo, lo + 3 * 4096, 2 * 4096, &va) == 0) {
+        printk(" FAIL (gap beyond hi accepted)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vmm_unmap(lo, 4096);
+    vmm_unmap(lo + 2 * 4096, 4096);
+    pmm_free_pages(pages, 2);
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 14: Demand paging
+static int test_demand_paging(void) {
+    printk("  [14/21] Demand-paged vmalloc...");
+
+    const uint64_t pages = 64;
+    size_t free_before = pmm_free_pages_count();
+    uint8_t *buf = vmalloc(pages * 4096);
+    if (!buf) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    int ret = -1;
+    uint64_t pa;
+    if (pmm_free_pages_count() != free_before ||
+        vmm_translate((uint64_t)buf, &pa) == 0) {
+        printk(" FAIL (populated up front)\n");
+        goto out;
+    }
+
+    // First touch faults in a zeroed page; its neighbours stay unpopulated
+    uint8_t *p = buf + 10 * 4096 + 123;
+    if (*p != 0) {
+        printk(" FAIL (page not zeroed)\n");
+        goto out;
+    }
+    *p = 0x5A;
+    size_t used = free_before - pmm_free_pages_count();
+    if (*p != 0x5A || vmm_translate((uint64_t)p, &pa) != 0 ||
+        vmm_translate((uint64_t)(buf + 11 * 4096), &pa) == 0 || used < 1 ||
+        used > 4) {
+        printk(" FAIL (fault-in: %d pages used)\n", (int)used);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vfree(buf, pages * 4096);
+    if (ret == 0 && pmm_free_pages_count() != free_before) {
+        printk(" FAIL (frames not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 15: Copy-on-write clone
+static int test_cow_clone(void) {
+    printk("  [15/21] Copy-on-write clone...");
+
+    const uint64_t size = 4 * 4096;
+    size_t free_before = pmm_free_pages_count();
+    uint8_t *src = vmalloc(size);
+    uint8_t *dst = NULL;
+    if (!src) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    // Populate pages 0 and 1; pages 2 and 3 stay untouched
+    memset(src, TEST_PATTERN_1, 4096);
+    memset(src + 4096, TEST_PATTERN_2, 4096);
+
+    int ret = -1;
+    uint64_t pa_src, pa_dst;
+    size_t free_mid = pmm_free_pages_count();
+    dst = vclone(src, size);
+    if (!dst) {
+        printk(" FAIL (clone)\n");
+        goto out;
+    }
+    // Only page tables may have been allocated, never data frames
+    if (free_mid - pmm_free_pages_count() > 2 ||
+        vmm_translate((uint64_t)src, &pa_src) != 0 ||
+        vmm_translate((uint64_t)dst, &pa_dst) != 0 || pa_src != pa_dst ||
+        pmm_page_refcount((void *)pa_src) != 2) {
+        printk(" FAIL (frames not shared)\n");
+        goto out;
+    }
+    if (dst[100] != TEST_PATTERN_1 || dst[4096 + 100] != TEST_PATTERN_2 ||
+        dst[2 * 4096] != 0) {
+        printk(" FAIL (clone contents)\n");
+        goto out;
+    }
+
+    // Writing the clone copies only the touched page
+    dst[100] = TEST_PATTERN_3;
+    vmm_translate((uint64_t)dst, &pa_dst);
+    if (src[100] != TEST_PATTERN_1 || dst[101] != TEST_PATTERN_1 ||
+        pa_dst == pa_src || pmm_page_refcount((void *)pa_src) != 1) {
+        printk(" FAIL (write to clone)\n");
+        goto out;
+    }
+    // Writing the source's sole-owner page needs no copy
+    src[100] = TEST_PATTERN_4;
+    vmm_translate((uint64_t)src, &pa_dst);
+    if (pa_dst != pa_src || dst[100] != TEST_PATTERN_3) {
+        printk(" FAIL (write to last sharer)\n");
+        goto out;
+    }
+    // Writing the source's still-shared page leaves the clone's intact
+    src[4096] = TEST_PATTERN_1;
+    if (dst[4096] != TEST_PATTERN_2) {
+        printk(" FAIL (write to source)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (dst)
+        vfree(dst, size);
+    vfree(src, size);
+    if (ret == 0 && pmm_free_pages_count() != free_before) {
+        printk(" FAIL (frames not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 16: Shared zero page
+static int test_zero_page(void) {
+    printk("  [16/21] Shared zero page for read faults...");
+
+    const uint64_t pages = 32;
+    vmm_zero_stats_t before, after;
+    vmm_zero_page_stats(&before);
+    size_t free_before = pmm_free_pages_count();
+    uint8_t *buf = vmalloc(pages * 4096);
+    if (!buf) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    // Reading every page maps the same frame and allocates none (beyond
+    // page tables)
+    int ret = -1;
+    uint64_t sum = 0, pa0, pa;
+    for (uint64_t i = 0; i < pages; i++)
+        sum += buf[i * 4096 + 7];
+    vmm_translate((uint64_t)buf, &pa0);
+    vmm_zero_page_stats(&after);
+    if (sum != 0 || free_before - pmm_free_pages_count() > 3 ||
+        after.read_faults - before.read_faults != pages ||
+        after.mapped - before.mapped != pages ||
+        vmm_translate((uint64_t)(buf + (pages - 1) * 4096), &pa) != 0 ||
+        pa != pa0) {
+        printk(" FAIL (read faults allocated)\n");
+        goto out;
+    }
+
+    // The first write swaps in a private zeroed frame for that page only
+    buf[5 * 4096 + 1] = TEST_PATTERN_1;
+    vmm_translate((uint64_t)(buf + 5 * 4096), &pa);
+    vmm_zero_page_stats(&after);
+    if (buf[5 * 4096 + 1] != TEST_PATTERN_1 || buf[5 * 4096] != 0 ||
+        pa == pa0 || buf[6 * 4096 + 1] != 0 ||
+        after.upgrades - before.upgrades != 1 ||
+        after.mapped - before.mapped != pages - 1) {
+        printk(" FAIL (write upgrade)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vfree(buf, pages * 4096);
+    vmm_zero_page_stats(&after);
+    if (ret == 0 && (pmm_free_pages_count() != free_before ||
+                     after.mapped != before.mapped)) {
+        printk(" FAIL (frames not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 17: ioremap memory types
+static int test_ioremap(void) {
+    printk("  [17/21] ioremap device/nc/wc mappings...");
+
+    // The UART is the one device every configuration has; its registers are
+    // only read here
+    uint64_t uart = 0x09000000ULL;
+    dtb_get_stdout_uart_base(&uart);
+
+    volatile uint32_t *fr = ioremap(uart + 0x18, 4);
+    volatile uint32_t *np = ioremap_nc(uart, 0x1000);
+    void *wc = ioremap_wc(uart, 0x1000);
+    int ret = -1;
+    vmm_area_t a_dev, a_np, a_wc;
+    uint64_t pa;
+    if (!fr || !np || !wc) {
+        printk(" FAIL (map)\n");
+        goto out;
+    }
+    if ((uint64_t)fr < IOREMAP_START || (uint64_t)fr >= IOREMAP_END ||
+        ((uint64_t)fr & 0xFFF) != 0x18 ||
+        vmm_translate((uint64_t)fr, &pa) != 0 || pa != uart + 0x18) {
+        printk(" FAIL (placement)\n");
+        goto out;
+    }
+    if (vmm_find_area((uint64_t)fr, &a_dev) != 0 ||
+        vmm_find_area((uint64_t)np, &a_np) != 0 ||
+        vmm_find_area((uint64_t)wc, &a_wc) != 0 ||
+        !(a_dev.attrs & VMM_ATTR_DEVICE) || (a_dev.attrs & VMM_ATTR_NP) ||
+        !(a_np.attrs & VMM_ATTR_NP) || !(a_wc.attrs & VMM_ATTR_WC) ||
+        !(a_wc.attrs & VMM_ATTR_PXN)) {
+        printk(" FAIL (attributes)\n");
+        goto out;
+    }
+    // Same frame, separate VMAs: the guard page keeps them from merging
+    if (a_np.va < a_dev.va + a_dev.size + 4096 || a_np.size != 4096) {
+        printk(" FAIL (guard gap)\n");
+        goto out;
+    }
+    (void)*fr;
+    (void)np[0x18 / 4];
+    ret = 0;
+
+out:
+    iounmap(wc);
+    iounmap((void *)np);
+    iounmap((void *)fr);
+    if (ret == 0 && fr && vmm_find_area((uint64_t)fr, &a_dev) == 0) {
+        printk(" FAIL (iounmap)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
 // Main test runner
+// Run the samepage scanner until it has completed nr full passes
+static void ksm_scan_passes(unsigned nr) {
+    ksm_stats_t st;
+    ksm_get_stats(&st);
+    uint64_t target = st.full_scans + nr;
+    for (int guard = 0; guard < 10000 && st.full_scans < target; guard++) {
+        ksm_scan(64);
+        ksm_get_stats(&st);
+    }
+}
+
+// Test 18: Samepage merging
+static int test_ksm(void) {
+    printk("  [18/21] Samepage merging...");
+
+    const uint64_t pages = 8;
+    size_t free_start = pmm_free_pages_count();
+    uint8_t *buf = vmalloc(pages * 4096);
+    if (!buf) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+
+    // Pages 0-3 and 4-5 are two sets of duplicates, page 6 is written with
+    // zeroes and page 7 is never touched
+    for (uint64_t i = 0; i < 4; i++)
+        memset(buf + i * 4096, TEST_PATTERN_1, 4096);
+    memset(buf + 4 * 4096, TEST_PATTERN_2, 2 * 4096);
+    memset(buf + 6 * 4096, 0, 4096);
+
+    int ret = -1;
+    ksm_stats_t before, after;
+    vmm_zero_stats_t zs_before, zs_after;
+    if (ksm_madvise(buf, pages * 4096, 1) != 0) {
+        printk(" FAIL (madvise)\n");
+        goto out;
+    }
+    ksm_get_stats(&before);
+    vmm_zero_page_stats(&zs_before);
+    size_t free_before = pmm_free_pages_count();
+    // The first pass may start part-way through the buffer
+    ksm_scan_passes(2);
+    ksm_get_stats(&after);
+    vmm_zero_page_stats(&zs_after);
+
+    uint64_t pa0, pa4, pa;
+    int shared = vmm_translate((uint64_t)buf, &pa0) == 0 &&
+                 vmm_translate((uint64_t)(buf + 4 * 4096), &pa4) == 0;
+    for (uint64_t i = 1; shared && i < 6; i++)
+        shared = vmm_translate((uint64_t)(buf + i * 4096), &pa) == 0 &&
+                 pa == (i < 4 ? pa0 : pa4);
+    // Four mappings plus the scanner's own reference, and two plus one
+    if (!shared || pa0 == pa4 || pmm_page_refcount((void *)pa0) != 5 ||
+        pmm_page_refcount((void *)pa4) != 3 ||
+        zs_after.mapped - zs_before.mapped != 1 ||
+        pmm_free_pages_count() - free_before != 5 ||
+        after.pages_merged - before.pages_merged != 5 ||
+        after.zero_merged - before.zero_merged != 1 ||
+        after.pages_shared - before.pages_shared != 2) {
+        printk(" FAIL (not merged)\n");
+        goto out;
+    }
+    if (buf[3 * 4096 + 9] != TEST_PATTERN_1 ||
+        buf[5 * 4096 + 9] != TEST_PATTERN_2 || buf[6 * 4096 + 9] != 0) {
+        printk(" FAIL (contents)\n");
+        goto out;
+    }
+
+    // Writing a merged page copies it; the other sharers keep the original
+    buf[4096 + 9] = TEST_PATTERN_3;
+    if (buf[9] != TEST_PATTERN_1 || buf[4096 + 10] != TEST_PATTERN_1 ||
+        vmm_translate((uint64_t)(buf + 4096), &pa) != 0 || pa == pa0 ||
+        pmm_page_refcount((void *)pa0) != 4) {
+        printk(" FAIL (write to merged page)\n");
+        goto out;
+    }
+
+    // Opting out of a range whose VMAs differ in protection clears only the
+    // flag: the read-only last page must not become writable
+    vmm_area_t rw_area, ro_area;
+    if (vmm_protect((uint64_t)(buf + 7 * 4096), 4096,
+                    VMM_ATTR_R | VMM_ATTR_NORMAL | VMM_ATTR_PXN) != 0 ||
+        ksm_madvise(buf, pages * 4096, 0) != 0 ||
+        vmm_find_area((uint64_t)buf, &rw_area) != 0 ||
+        vmm_find_area((uint64_t)(buf + 7 * 4096), &ro_area) != 0 ||
+        ((rw_area.attrs | ro_area.attrs) & VMM_ATTR_MERGEABLE) ||
+        !(rw_area.attrs & VMM_ATTR_W) || (ro_area.attrs & VMM_ATTR_W)) {
+        printk(" FAIL (madvise across protections)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vfree(buf, pages * 4096);
+    // Shared frames nobody maps any more are released at the end of a pass
+    ksm_scan_passes(1);
+    ksm_get_stats(&after);
+    if (ret == 0 && (pmm_free_pages_count() != free_start ||
+                     after.pages_shared != before.pages_shared)) {
+        printk(" FAIL (frames not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Page contents for the zram test: pages 0-13 compress well, page 14 is one
+// repeated byte and page 15 is noise that LZ4 cannot shrink.
+static uint8_t zram_test_byte(uint64_t page, uint64_t i, uint64_t *rng) {
+    static const char text[] = "arcline compressed swap test ";
+    if (page < 14)
+        return (uint8_t)text[(i + page) % (sizeof(text) - 1)] ^ (uint8_t)(i / 512);
+    if (page == 14)
+        return 0x5A;
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return (uint8_t)*rng;
+}
+
+static int zram_test_check(const uint8_t *buf, uint64_t pages) {
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    for (uint64_t p = 0; p < pages; p++)
+        for (uint64_t i = 0; i < 4096; i++)
+            if (buf[p * 4096 + i] != zram_test_byte(p, i, &rng))
+                return -1;
+    return 0;
+}
+
+// Test 19: Compressed swap
+static int test_zram_swap(void) {
+    printk("  [19/21] Compressed swap (zram)...");
+
+    const uint64_t pages = 16;
+    size_t free_start = pmm_free_pages_count();
+    uint8_t *buf = vmalloc(pages * 4096);
+    if (!buf) {
+        printk(" FAIL (alloc)\n");
+        return -1;
+    }
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    for (uint64_t p = 0; p < pages; p++)
+        for (uint64_t i = 0; i < 4096; i++)
+            buf[p * 4096 + i] = zram_test_byte(p, i, &rng);
+
+    int ret = -1;
+    zram_stats_t before, after;
+    zram_get_stats(&before);
+    size_t free_before = pmm_free_pages_count();
+    int swapped = vmm_swap_out((uint64_t)buf, pages * 4096);
+    zram_get_stats(&after);
+    uint64_t pool = after.pool_pages - before.pool_pages;
+    uint64_t pa;
+    // Everything but the noise page leaves RAM, and the compressed copies
+    // fit in a fraction of the frames that were freed
+    if (swapped != 15 || after.rejected - before.rejected != 1 ||
+        after.same_filled - before.same_filled != 1 ||
+        after.stored - before.stored != 15 || pool >= 4 ||
+        pmm_free_pages_count() - free_before != 15 - pool ||
+        vmm_translate((uint64_t)buf, &pa) == 0 ||
+        vmm_translate((uint64_t)(buf + 15 * 4096), &pa) != 0) {
+        printk(" FAIL (swap out: %d pages, %d pool frames)\n", swapped,
+               (int)pool);
+        goto out;
+    }
+
+    // Touching the pages faults them back in, intact
+    if (zram_test_check(buf, pages) != 0) {
+        printk(" FAIL (contents after swap-in)\n");
+        goto out;
+    }
+    zram_get_stats(&after);
+    if (after.loads - before.loads != 15 || after.stored != before.stored ||
+        pmm_free_pages_count() != free_before) {
+        printk(" FAIL (swap in)\n");
+        goto out;
+    }
+
+    // Freeing a buffer while it is swapped out releases its zram entries
+    if (vmm_swap_out((uint64_t)buf, pages * 4096) != 15) {
+        printk(" FAIL (second swap out)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vfree(buf, pages * 4096);
+    zram_get_stats(&after);
+    if (ret == 0 && (pmm_free_pages_count() != free_start ||
+                     after.stored != before.stored)) {
+        printk(" FAIL (entries not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 20: LRU aging and reclaim
+static int test_lru_reclaim(void) {
+    printk("  [20/21] LRU page aging and reclaim...");
+
+    const uint64_t pages = 12, hot = 4;
+    size_t free_start = pmm_free_pages_count();
+    lru_stats_t before, after;
+    lru_get_stats(&before);
+    uint8_t *buf = vmalloc(pages * 4096);
+    if (!buf || lru_madvise(buf, pages * 4096, 1) != 0) {
+        printk(" FAIL (alloc)\n");
+        if (buf)
+            vfree(buf, pages * 4096);
+        return -1;
+    }
+    uint64_t rng = 0;
+    for (uint64_t p = 0; p < pages; p++)
+        for (uint64_t i = 0; i < 4096; i++)
+            buf[p * 4096 + i] = zram_test_byte(p, i, &rng);
+
+    int ret = -1;
+    zram_stats_t zbefore, zafter;
+    zram_get_stats(&zbefore);
+
+    // Every page faulted in onto the active list. One aging pass clears all
+    // their Access Flags; they were just written, so none is demoted yet.
+    lru_get_stats(&after);
+    uint64_t listed = after.nr_active - before.nr_active;
+    lru_age((unsigned)pages);
+    lru_get_stats(&after);
+    if (listed != pages || after.deactivated != before.deactivated) {
+        printk(" FAIL (first aging pass)\n");
+        goto out;
+    }
+
+    // Use the first pages again (an Access flag fault each, unless the CPU
+    // sets AF itself); only the rest should be reclaimed
+    volatile uint8_t sink = 0;
+    for (uint64_t p = 0; p < hot; p++)
+        sink += buf[p * 4096];
+    (void)sink;
+
+    unsigned freed = lru_shrink((unsigned)(pages - hot));
+    lru_get_stats(&after);
+    zram_get_stats(&zafter);
+    uint64_t pa;
+    int resident = 0, cold_resident = 0;
+    for (uint64_t p = 0; p < pages; p++) {
+        if (vmm_translate((uint64_t)(buf + p * 4096), &pa) != 0)
+            continue;
+        resident++;
+        if (p >= hot)
+            cold_resident++;
+    }
+    if (freed != pages - hot || resident != (int)hot || cold_resident ||
+        after.reclaimed - before.reclaimed != pages - hot ||
+        zafter.stores - zbefore.stores != pages - hot) {
+        printk(" FAIL (reclaimed %u, %d resident, %d cold)\n", freed,
+               resident, cold_resident);
+        goto out;
+    }
+
+    // Reclaimed pages come back intact
+    if (zram_test_check(buf, pages) != 0) {
+        printk(" FAIL (contents after reclaim)\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    vfree(buf, pages * 4096);
+    zram_get_stats(&zafter);
+    if (ret == 0 && (pmm_free_pages_count() != free_start ||
+                     zafter.stored != zbefore.stored)) {
+        printk(" FAIL (frames not released)\n");
+        ret = -1;
+    }
+    if (ret == 0)
+        printk(" PASS\n");
+    return ret;
+}
+
+// Test 21: NUMA node-local allocation
+static int test_numa_alloc(void) {
+    printk("  [21/21] NUMA node-local allocation...");
+
+    int nodes = numa_nr_nodes();
+    int local = numa_node_id();
+    pmm_node_stats_t before, after;
+
+    // Every node with memory serves its own requests from its own pool
+    for (int n = 0; n < nodes; n++) {
+        if (pmm_get_node_stats(n, &before) != 0 || before.free < 4)
+            continue;
+        void *p = pmm_alloc_pages_node(n, 4);
+        pmm_get_node_stats(n, &after);
+        int ok = p && pmm_page_node(p) == n &&
+                 after.local == before.local + 1 &&
+                 after.free == before.free - 4;
+        if (p)
+            pmm_free_pages(p, 4);
+        if (!ok) {
+            printk(" FAIL (node %d)\n", n);
+            return -1;
+        }
+    }
+
+    // The default allocator stays on the CPU's node
+    void *p = pmm_alloc_page();
+    int node = pmm_page_node(p);
+    if (p)
+        pmm_free_page(p);
+    if (!p || (node != local && pmm_get_node_stats(local, &before) == 0)) {
+        printk(" FAIL (default node %d, CPU on %d)\n", node, local);
+        return -1;
+    }
+
+    // Fallback orders are validated, and the first node listed is tried
+    // first
+    int order[NUMA_MAX_NODES], saved[NUMA_MAX_NODES];
+    int nr = numa_fallback_order(local, saved);
+    order[0] = order[1] = local;
+    if (nr < 1 || saved[0] != local ||
+        numa_set_fallback_order(local, order, 2) != -1 ||
+        numa_set_fallback_order(nodes, saved, nr) != -1 ||
+        pmm_alloc_pages_node(nodes, 1) != NULL) {
+        printk(" FAIL (fallback order checks)\n");
+        return -1;
+    }
+    if (nr > 1) {
+        // Prefer the second-nearest node: the allocation is a miss there
+        // and foreign on the CPU's node
+        int other = saved[1];
+        pmm_node_stats_t ob, oa;
+        order[0] = other;
+        order[1] = local;
+        pmm_get_node_stats(local, &before);
+        pmm_get_node_stats(other, &ob);
+        numa_set_fallback_order(local, order, 2);
+        p = pmm_alloc_page();
+        numa_set_fallback_order(local, saved, nr);
+        pmm_get_node_stats(local, &after);
+        pmm_get_node_stats(other, &oa);
+        node = pmm_page_node(p);
+        if (p)
+            pmm_free_page(p);
+        if (ob.free && (node != other || oa.miss != ob.miss + 1 ||
+                        after.foreign != before.foreign + 1)) {
+            printk(" FAIL (fallback to node %d got node %d)\n", other, node);
+            return -1;
+        }
+    }
+
+    printk(" PASS (%d node%s)\n", nodes, nodes > 1 ? "s" : "");
+    return 0;
+}
+
 int run_memory_integration_tests(void) {
     printk("\n");
     printk("========================================\n");
@@ -378,6 +1122,17 @@ int run_memory_integration_tests(void) {
     if (test_memory_isolation() == 0) tests_passed++; else tests_failed++;
     if (test_large_allocation() == 0) tests_passed++; else tests_failed++;
     if (test_concurrent_allocation() == 0) tests_passed++; else tests_failed++;
+    if (test_vmm_translate() == 0) tests_passed++; else tests_failed++;
+    if (test_vmm_split_merge() == 0) tests_passed++; else tests_failed++;
+    if (test_vmm_find_gap() == 0) tests_passed++; else tests_failed++;
+    if (test_demand_paging() == 0) tests_passed++; else tests_failed++;
+    if (test_cow_clone() == 0) tests_passed++; else tests_failed++;
+    if (test_zero_page() == 0) tests_passed++; else tests_failed++;
+    if (test_ioremap() == 0) tests_passed++; else tests_failed++;
+    if (test_ksm() == 0) tests_passed++; else tests_failed++;
+    if (test_zram_swap() == 0) tests_passed++; else tests_failed++;
+    if (test_lru_reclaim() == 0) tests_passed++; else tests_failed++;
+    if (test_numa_alloc() == 0) tests_passed++; else tests_failed++;
 
     size_t free_after = pmm_free_pages_count();
     int leaked = (int)(free_before - free_after);
@@ -397,6 +1152,43 @@ int run_memory_integration_tests(void) {
     }
 
     vmalloc_stats();
+    vmm_zero_stats_t zs;
+    vmm_zero_page_stats(&zs);
+    printk("vmm: zero page served %llu read faults, %llu later written, "
+           "%llu frames saved now\n",
+           (unsigned long long)zs.read_faults,
+           (unsigned long long)zs.upgrades, (unsigned long long)zs.mapped);
+    ksm_stats_t ks;
+    ksm_get_stats(&ks);
+    printk("ksm: %llu pages scanned, %llu merged (%llu into the zero page), "
+           "%llu full scans\n",
+           (unsigned long long)ks.pages_scanned,
+           (unsigned long long)ks.pages_merged,
+           (unsigned long long)ks.zero_merged,
+           (unsigned long long)ks.full_scans);
+    zram_stats_t zr;
+    zram_get_stats(&zr);
+    printk("zram: %llu pages stored in %llu frames, %llu swapped out, "
+           "%llu read back, %llu incompressible\n",
+           (unsigned long long)zr.stored, (unsigned long long)zr.pool_pages,
+           (unsigned long long)zr.stores, (unsigned long long)zr.loads,
+           (unsigned long long)zr.rejected);
+    lru_stats_t ls;
+    lru_get_stats(&ls);
+    printk("lru: %llu active, %llu inactive, %llu aged, %llu reclaimed, "
+           "%llu stale\n",
+           (unsigned long long)ls.nr_active, (unsigned long long)ls.nr_inactive,
+           (unsigned long long)ls.scanned, (unsigned long long)ls.reclaimed,
+           (unsigned long long)ls.stale);
+    for (int n = 0; n < numa_nr_nodes(); n++) {
+        pmm_node_stats_t ns;
+        if (pmm_get_node_stats(n, &ns) != 0)
+            continue;
+        printk("node %d: %d/%d pages free, %llu local, %llu miss, "
+               "%llu foreign\n",
+               n, (int)ns.free, (int)ns.total, (unsigned long long)ns.local,
+               (unsigned long long)ns.miss, (unsigned long long)ns.foreign);
+    }
 
     printk("\n");
 
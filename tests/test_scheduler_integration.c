@@ -1,9 +1,35 @@
+#include <kernel/mutex.h>
 #include <kernel/printk.h>
+#include <kernel/rcu.h>
+#include <kernel/rwlock.h>
+#include <kernel/sched/completion.h>
+#include <kernel/seqlock.h>
+#include <kernel/smp.h>
+#include <kernel/sched/eevdf.h>
+#include <kernel/sched/kstack.h>
 #include <kernel/sched/task.h>
 #include <kernel/syscall.h>
 #include <drivers/timer.h>
 #include <string.h>
 
+// Tests look at the tasks they create after those exited (state, runtime,
+// stack), while creating more tasks reaps the dead ones. Hold a reference
+// on each until the test is done with it, so its task_t is not freed.
+static task_t *spawn(void (*entry)(int argc, char **argv, char **envp),
+                     int priority, task_args *args) {
+    task_t *task = task_create(entry, priority, args);
+    if (task)
+        task_get(task);
+    return task;
+}
+
+static void release(task_t **tasks, int n) {
+    for (int i = 0; i < n; i++) {
+        if (tasks[i])
+            task_put(tasks[i]);
+    }
+}
+
 // Test 1: Timer Preemption Test
 // Creates two tasks that increment counters and verifies both make progress
 
@@ -54,11 +80,12 @@ void test_timer_preemption(void) {
     test_complete = 0;
     
     // Create two tasks
-    task_t *task_a = task_create(task_a_entry, 0, NULL);
-    task_t *task_b = task_create(task_b_entry, 0, NULL);
+    task_t *tasks[2] = {spawn(task_a_entry, 0, NULL), spawn(task_b_entry, 0, NULL)};
+    task_t *task_a = tasks[0], *task_b = tasks[1];
     
     if (!task_a || !task_b) {
         printk("[TEST] FAILED: Could not create tasks\n");
+        release(tasks, 2);
         return;
     }
     
@@ -74,10 +101,7 @@ void test_timer_preemption(void) {
         wait_iterations++;
         
         // Check task states
-        task_t *ta = task_find_by_pid(pid_a);
-        task_t *tb = task_find_by_pid(pid_b);
-        
-        if (ta && tb && ta->state == TASK_ZOMBIE && tb->state == TASK_ZOMBIE) {
+        if (task_a->state == TASK_ZOMBIE && task_b->state == TASK_ZOMBIE) {
             break;
         }
         
@@ -97,6 +121,7 @@ void test_timer_preemption(void) {
         printk("[TEST] FAILED: counter_a=%d, counter_b=%d (no preemption?)\n", 
                counter_a, counter_b);
     }
+    release(tasks, 2);
     
     printk("=== END TEST ===\n\n");
 }
@@ -131,7 +156,7 @@ void test_task_termination(void) {
     termination_counter = 0;
     
     // Create a task that will exit
-    task_t *task = task_create(terminating_task_entry, 0, NULL);
+    task_t *task = spawn(terminating_task_entry, 0, NULL);
     
     if (!task) {
         printk("[TEST] FAILED: Could not create task\n");
@@ -149,20 +174,23 @@ void test_task_termination(void) {
     }
     
     // Check task state
+    printk("[TEST] Task state: %d (0=RUNNING, 1=READY, 2=BLOCKED, 3=ZOMBIE)\n", 
+           task->state);
+    if (task->state == TASK_ZOMBIE) {
+        printk("[TEST] PASSED: Task became zombie\n");
+    } else {
+        printk("[TEST] FAILED: Task state is %d, expected ZOMBIE (3)\n", 
+               task->state);
+    }
+
+    // Its PID is free again: a lookup must not find the zombie
+    rcu_read_lock();
     task_t *found = task_find_by_pid(pid);
+    rcu_read_unlock();
     if (found) {
-        printk("[TEST] Task state: %d (0=RUNNING, 1=READY, 2=BLOCKED, 3=ZOMBIE)\n", 
-               found->state);
-        
-        if (found->state == TASK_ZOMBIE) {
-            printk("[TEST] PASSED: Task became zombie\n");
-        } else {
-            printk("[TEST] FAILED: Task state is %d, expected ZOMBIE (3)\n", 
-                   found->state);
-        }
-    } else {
-        printk("[TEST] Task not found (may have been cleaned up)\n");
+        printk("[TEST] FAILED: Lookup of exited PID %d found a task\n", pid);
     }
+    task_put(task);
     
     // Verify counter didn't increase beyond expected
     printk("[TEST] Final counter value: %d (expected 5)\n", termination_counter);
@@ -237,12 +265,14 @@ void test_killing_current_task(void) {
     other_task_counter = 0;
     
     // Create task that will kill itself
-    task_t *kill_task = task_create(kill_self_task_entry, 0, NULL);
-    // Create another task to verify system continues
-    task_t *other_task = task_create(other_task_entry, 0, NULL);
+    task_t *tasks[2] = {spawn(kill_self_task_entry, 0, NULL),
+                        // Create another task to verify system continues
+                        spawn(other_task_entry, 0, NULL)};
+    task_t *kill_task = tasks[0], *other_task = tasks[1];
     
     if (!kill_task || !other_task) {
         printk("[TEST] FAILED: Could not create tasks\n");
+        release(tasks, 2);
         return;
     }
     
@@ -276,15 +306,23 @@ void test_killing_current_task(void) {
     }
     
     // Check task state
-    task_t *found = task_find_by_pid(kill_pid);
-    if (found && found->state == TASK_ZOMBIE) {
+    if (kill_task->state == TASK_ZOMBIE) {
         printk("[TEST] PASSED: Kill-self task is zombie\n");
-    } else if (found) {
+    } else {
         printk("[TEST] FAILED: Kill-self task state is %d, expected ZOMBIE (3)\n", 
-               found->state);
+               kill_task->state);
+    }
+
+    // Its PID is free again, so sys_kill() of it finds nothing and fails
+    rcu_read_lock();
+    task_t *found = task_find_by_pid(kill_pid);
+    rcu_read_unlock();
+    if (found) {
+        printk("[TEST] FAILED: Lookup of killed PID %d found a task\n", kill_pid);
     } else {
-        printk("[TEST] Kill-self task not found (may have been cleaned up)\n");
+        printk("[TEST] PASSED: Killed PID no longer resolves\n");
     }
+    release(tasks, 2);
     
     printk("=== END TEST ===\n\n");
 }
@@ -332,10 +370,11 @@ void test_stress(void) {
     
     for (int i = 0; i < STRESS_TEST_TASKS; i++) {
         task_args args = { .argc = i, .argv = NULL, .envp = NULL };
-        tasks[i] = task_create(stress_task_entry, 0, &args);
+        tasks[i] = spawn(stress_task_entry, 0, &args);
         
         if (!tasks[i]) {
             printk("[TEST] FAILED: Could not create task %d\n", i);
+            release(tasks, i);
             return;
         }
         
@@ -356,11 +395,13 @@ void test_stress(void) {
     // Kill tasks in various orders (every other task first)
     printk("[TEST] Killing every other task...\n");
     for (int i = 0; i < STRESS_TEST_TASKS; i += 2) {
+        rcu_read_lock();
         task_t *task = task_find_by_pid(pids[i]);
         if (task) {
             printk("[TEST] Killing task %d (PID %d)\n", i, pids[i]);
             task_kill(task);
         }
+        rcu_read_unlock();
     }
     
     // Let remaining tasks run
@@ -372,11 +413,13 @@ void test_stress(void) {
     // Kill remaining tasks
     printk("[TEST] Killing remaining tasks...\n");
     for (int i = 1; i < STRESS_TEST_TASKS; i += 2) {
+        rcu_read_lock();
         task_t *task = task_find_by_pid(pids[i]);
         if (task) {
             printk("[TEST] Killing task %d (PID %d)\n", i, pids[i]);
             task_kill(task);
         }
+        rcu_read_unlock();
     }
     
     // Wait a bit more
@@ -404,13 +447,13 @@ void test_stress(void) {
     // Verify all tasks are zombies
     int all_zombies = 1;
     for (int i = 0; i < STRESS_TEST_TASKS; i++) {
-        task_t *task = task_find_by_pid(pids[i]);
-        if (task && task->state != TASK_ZOMBIE) {
+        if (tasks[i]->state != TASK_ZOMBIE) {
             printk("[TEST] Task %d (PID %d) is not zombie (state=%d)\n", 
-                   i, pids[i], task->state);
+                   i, pids[i], tasks[i]->state);
             all_zombies = 0;
         }
     }
+    release(tasks, STRESS_TEST_TASKS);
     
     if (all_zombies) {
         printk("[TEST] PASSED: All tasks are zombies\n");
@@ -423,6 +466,1022 @@ void test_stress(void) {
 }
 
 
+// Test 5: Kernel Stack Recycling
+// Verifies a reaped task's stack goes to the next task created, times stack
+// acquisition from the cache against the vmalloc path, and checks a task can
+// grow its demand-paged stack with IRQs masked
+
+static void short_task_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+}
+
+#define DEEP_STACK_BYTES (10 * 1024)
+
+static volatile uint64_t deep_stack_sum;
+
+static void deep_stack_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    // Masked, the new stack pages come from the fault reserve
+    volatile uint8_t buf[DEEP_STACK_BYTES];
+    uint64_t flags = local_irq_save();
+    for (int i = 0; i < DEEP_STACK_BYTES; i++)
+        buf[i] = (uint8_t)i;
+    local_irq_restore(flags);
+    uint64_t sum = 0;
+    for (int i = 0; i < DEEP_STACK_BYTES; i++)
+        sum += buf[i];
+    deep_stack_sum = sum;
+}
+
+void test_stack_recycling(void) {
+    printk("\n=== TEST: Kernel Stack Recycling ===\n");
+
+    task_t *task = spawn(short_task_entry, 0, NULL);
+    if (!task) {
+        printk("[TEST] FAILED: Could not create task\n");
+        return;
+    }
+    void *stack = task->kernel_stack;
+
+    extern void schedule(void);
+    for (int i = 0; i < 100 && task->state != TASK_ZOMBIE; i++)
+        schedule();
+    task_reap();
+    int reclaimed = task->state == TASK_ZOMBIE && !task->kernel_stack;
+    int state = task->state;
+    task_put(task);
+    if (!reclaimed) {
+        printk("[TEST] FAILED: Stack not reclaimed (state=%d)\n", state);
+        return;
+    }
+
+    task_t *next = spawn(short_task_entry, 0, NULL);
+    if (!next) {
+        printk("[TEST] FAILED: Could not create second task\n");
+        return;
+    }
+    if (next->kernel_stack == stack) {
+        printk("[TEST] PASSED: Reaped stack reused by next task\n");
+    } else {
+        printk("[TEST] FAILED: Next task got %p, expected %p\n",
+               next->kernel_stack, stack);
+    }
+    task_kill(next);
+    task_reap();
+    task_put(next);
+
+    // Drain the cache so the first round misses, then refill it from that
+    // round so the second round hits
+    void *held[KSTACK_CACHE_SIZE], *round[KSTACK_CACHE_SIZE];
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        held[i] = kstack_alloc();
+
+    uint64_t t0 = get_ns();
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        round[i] = kstack_alloc();
+    uint64_t miss_ns = get_ns() - t0;
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        kstack_free(round[i]);
+
+    t0 = get_ns();
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        round[i] = kstack_alloc();
+    uint64_t hit_ns = get_ns() - t0;
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        kstack_free(round[i]);
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        kstack_free(held[i]);
+
+    // A stack fresh from vmalloc has only its top page: drain the cache so
+    // the deep task gets one
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        held[i] = kstack_alloc();
+    kstack_stats_t st;
+    kstack_get_stats(&st);
+    uint64_t faults = st.faults;
+    uint64_t expect = 0;
+    for (int i = 0; i < DEEP_STACK_BYTES; i++)
+        expect += (uint8_t)i;
+    deep_stack_sum = 0;
+    task_t *deep = spawn(deep_stack_entry, 0, NULL);
+    for (int i = 0; deep && i < 100 && deep->state != TASK_ZOMBIE; i++)
+        schedule();
+    for (int i = 0; i < KSTACK_CACHE_SIZE; i++)
+        kstack_free(held[i]);
+    kstack_get_stats(&st);
+    if (!deep) {
+        printk("[TEST] FAILED: Could not create deep-stack task\n");
+    } else if (deep_stack_sum != expect || st.faults - faults < 2) {
+        printk("[TEST] FAILED: Deep stack sum %llu (expected %llu), %llu "
+               "stack faults\n",
+               (unsigned long long)deep_stack_sum,
+               (unsigned long long)expect,
+               (unsigned long long)(st.faults - faults));
+    } else {
+        printk("[TEST] PASSED: Stack grew by %llu pages on demand\n",
+               (unsigned long long)(st.faults - faults));
+    }
+    if (deep) {
+        task_reap();
+        task_put(deep);
+    }
+
+    printk("[TEST] Stack alloc: %llu ns uncached, %llu ns cached\n",
+           (unsigned long long)(miss_ns / KSTACK_CACHE_SIZE),
+           (unsigned long long)(hit_ns / KSTACK_CACHE_SIZE));
+    printk("[TEST] kstack: %llu hits, %llu misses, %llu recycled, "
+           "%llu released, %llu faults\n",
+           (unsigned long long)st.hits, (unsigned long long)st.misses,
+           (unsigned long long)st.recycled, (unsigned long long)st.released,
+           (unsigned long long)st.faults);
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 6: Many Tasks
+// Queues more tasks than the runqueue's old 64-node pool held and checks
+// every one runs to completion and leaves the queue
+
+#define MANY_TASKS 96
+
+static volatile int many_ran[MANY_TASKS];
+
+static void many_task_entry(int argc, char **argv, char **envp) {
+    (void)argv;
+    (void)envp;
+    many_ran[argc]++;
+}
+
+void test_many_tasks(void) {
+    printk("\n=== TEST: Many Tasks ===\n");
+
+    static task_t *tasks[MANY_TASKS];
+    for (int i = 0; i < MANY_TASKS; i++) {
+        many_ran[i] = 0;
+        task_args args = {.argc = i, .argv = NULL, .envp = NULL};
+        tasks[i] = spawn(many_task_entry, 0, &args);
+        if (!tasks[i]) {
+            printk("[TEST] FAILED: Could not create task %d\n", i);
+            for (int j = 0; j < i; j++)
+                task_kill(tasks[j]);
+            release(tasks, i);
+            return;
+        }
+        if (!eevdf_is_queued(tasks[i])) {
+            printk("[TEST] FAILED: Task %d not queued after create\n", i);
+            release(tasks, i + 1);
+            return;
+        }
+    }
+    printk("[TEST] Created and queued %d tasks\n", MANY_TASKS);
+
+    extern void schedule(void);
+    int done = 0;
+    for (int round = 0; round < 1000 && done < MANY_TASKS; round++) {
+        schedule();
+        done = 0;
+        for (int i = 0; i < MANY_TASKS; i++)
+            if (tasks[i]->state == TASK_ZOMBIE)
+                done++;
+    }
+
+    int ran = 0, queued = 0;
+    for (int i = 0; i < MANY_TASKS; i++) {
+        if (many_ran[i] == 1)
+            ran++;
+        if (eevdf_is_queued(tasks[i]))
+            queued++;
+    }
+    task_reap();
+    release(tasks, MANY_TASKS);
+
+    if (ran == MANY_TASKS && done == MANY_TASKS && queued == 0) {
+        printk("[TEST] PASSED: All %d tasks ran once and left the queue\n",
+               MANY_TASKS);
+    } else {
+        printk("[TEST] FAILED: %d ran, %d exited, %d still queued\n", ran,
+               done, queued);
+    }
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 7: EEVDF Short Requests
+// A task asking for short slices competes with two CPU hogs on default
+// slices; earliest-deadline picking should keep its wait between runs to a
+// couple of ticks while all three still share the CPU
+
+#define LATENCY_TEST_NS (300 * 1000000ULL)
+#define LATENCY_BOUND_NS (5 * EEVDF_TICK_NS)
+
+static volatile int latency_done = 0;
+static volatile uint64_t latency_max_gap = 0;
+static volatile uint64_t latency_runs = 0;
+static volatile uint64_t hog_counters[2];
+
+static void latency_task_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    uint64_t end = get_ns() + LATENCY_TEST_NS;
+    uint64_t last = get_ns();
+    while (!latency_done) {
+        uint64_t now = get_ns();
+        // A jump of more than a millisecond means we were preempted
+        if (now - last > 1000000ULL) {
+            latency_runs++;
+            if (now - last > latency_max_gap)
+                latency_max_gap = now - last;
+        }
+        last = now;
+        if (now > end)
+            latency_done = 1;
+    }
+}
+
+static void hog_task_entry(int argc, char **argv, char **envp) {
+    (void)argv;
+    (void)envp;
+    while (!latency_done)
+        hog_counters[argc]++;
+}
+
+void test_eevdf_latency(void) {
+    printk("\n=== TEST: EEVDF Short Requests ===\n");
+
+    latency_done = 0;
+    latency_max_gap = 0;
+    latency_runs = 0;
+    hog_counters[0] = hog_counters[1] = 0;
+
+    task_args a0 = {.argc = 0, .argv = NULL, .envp = NULL};
+    task_args a1 = {.argc = 1, .argv = NULL, .envp = NULL};
+    task_t *hog0 = spawn(hog_task_entry, 0, &a0);
+    task_t *hog1 = spawn(hog_task_entry, 0, &a1);
+    task_t *lat = spawn(latency_task_entry, 0, NULL);
+    task_t *all[3] = {hog0, hog1, lat};
+    if (!hog0 || !hog1 || !lat) {
+        printk("[TEST] FAILED: Could not create tasks\n");
+        latency_done = 1;
+        release(all, 3);
+        return;
+    }
+    eevdf_set_slice(lat, EEVDF_MIN_GRANULARITY);
+
+    extern void schedule(void);
+    while (!latency_done)
+        schedule();
+    for (int i = 0; i < 100 && (hog0->state != TASK_ZOMBIE ||
+                                hog1->state != TASK_ZOMBIE ||
+                                lat->state != TASK_ZOMBIE);
+         i++)
+        schedule();
+    task_reap();
+    release(all, 3);
+
+    printk("[TEST] Short-request task: %llu preemptions, max wait %llu us\n",
+           (unsigned long long)latency_runs,
+           (unsigned long long)(latency_max_gap / 1000));
+    printk("[TEST] Hogs: %llu / %llu iterations\n",
+           (unsigned long long)hog_counters[0],
+           (unsigned long long)hog_counters[1]);
+
+    if (!hog_counters[0] || !hog_counters[1]) {
+        printk("[TEST] FAILED: A hog never ran\n");
+    } else if (latency_max_gap > LATENCY_BOUND_NS) {
+        printk("[TEST] FAILED: Max wait above %llu us\n",
+               (unsigned long long)(LATENCY_BOUND_NS / 1000));
+    } else {
+        printk("[TEST] PASSED: Wait bounded, all tasks ran\n");
+    }
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 8: Nice Shares
+// Three CPU hogs at different nice levels run for a fixed time; the CPU time
+// each accumulates should be in the ratio of their weights
+
+#define SHARE_TASKS 3
+#define SHARE_TEST_NS (600 * 1000000ULL)
+
+static const int share_nice[SHARE_TASKS] = {-3, 0, 3};
+static task_t *share_tasks[SHARE_TASKS];
+static uint64_t share_runtime[SHARE_TASKS];
+static volatile uint64_t share_end = 0;
+static volatile int share_done = 0;
+
+static void share_task_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    while (!share_done) {
+        uint64_t now = get_ns();
+        if (now < share_end)
+            continue;
+        // First to see the end snapshots everyone, itself included up to now
+        for (int i = 0; i < SHARE_TASKS; i++) {
+            share_runtime[i] = share_tasks[i]->se.sum_exec_runtime;
+            if (share_tasks[i] == task_current())
+                share_runtime[i] += now - share_tasks[i]->se.exec_start;
+        }
+        share_done = 1;
+    }
+}
+
+void test_nice_shares(void) {
+    printk("\n=== TEST: Nice Shares ===\n");
+
+    share_done = 0;
+    // No tick until all three exist, so they start together
+    uint64_t flags = local_irq_save();
+    for (int i = 0; i < SHARE_TASKS; i++) {
+        share_tasks[i] = spawn(share_task_entry, share_nice[i], NULL);
+        if (!share_tasks[i]) {
+            printk("[TEST] FAILED: Could not create task %d\n", i);
+            share_done = 1;
+            local_irq_restore(flags);
+            release(share_tasks, i);
+            return;
+        }
+    }
+    share_end = get_ns() + SHARE_TEST_NS;
+    local_irq_restore(flags);
+
+    extern void schedule(void);
+    while (!share_done)
+        schedule();
+    for (int i = 0; i < 100; i++)
+        schedule();
+    task_reap();
+
+    uint64_t total_weight = 0, total_runtime = 0;
+    for (int i = 0; i < SHARE_TASKS; i++) {
+        total_weight += share_tasks[i]->se.weight;
+        total_runtime += share_runtime[i];
+    }
+
+    int ok = total_runtime > 0;
+    for (int i = 0; i < SHARE_TASKS; i++) {
+        uint64_t expect = total_runtime * share_tasks[i]->se.weight /
+                          total_weight;
+        uint64_t diff = share_runtime[i] > expect ? share_runtime[i] - expect
+                                                  : expect - share_runtime[i];
+        printk("[TEST]   nice %d: %llu ms, expected %llu ms\n", share_nice[i],
+               (unsigned long long)(share_runtime[i] / 1000000),
+               (unsigned long long)(expect / 1000000));
+        // Within 20%, or two ticks for the smallest share
+        if (diff > expect / 5 && diff > 2 * EEVDF_TICK_NS)
+            ok = 0;
+    }
+    release(share_tasks, SHARE_TASKS);
+
+    if (ok) {
+        printk("[TEST] PASSED: CPU time follows the nice weights\n");
+    } else {
+        printk("[TEST] FAILED: CPU time does not follow the nice weights\n");
+    }
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 9: Slice Timer
+// Two hogs with a 20 ms request, twice the tick period, should each run for
+// about 20 ms at a time: the preemption timer follows the slice, and the
+// ticks in between do not switch tasks
+
+#define SLICE_TEST_SLICE_NS (20 * 1000000ULL)
+#define SLICE_TEST_NS (400 * 1000000ULL)
+#define SLICE_GAP_NS 500000ULL // longer than any IRQ, shorter than a slice
+
+static volatile uint64_t slice_end_ns = 0;
+static volatile uint64_t slice_runs[2];
+static volatile uint64_t slice_run_ns[2];
+
+static void slice_task_entry(int argc, char **argv, char **envp) {
+    (void)argv;
+    (void)envp;
+    uint64_t start = get_ns(), last = start;
+    for (;;) {
+        uint64_t now = get_ns();
+        if (now - last > SLICE_GAP_NS) {
+            // Switched out at last, back now: one complete run
+            slice_runs[argc]++;
+            slice_run_ns[argc] += last - start;
+            start = now;
+        }
+        last = now;
+        if (now > slice_end_ns)
+            break;
+    }
+}
+
+void test_slice_timer(void) {
+    printk("\n=== TEST: Slice Timer ===\n");
+
+    timer_stats_t before, after;
+    timer_get_stats(&before);
+
+    task_t *tasks[2];
+    uint64_t flags = local_irq_save();
+    for (int i = 0; i < 2; i++) {
+        slice_runs[i] = slice_run_ns[i] = 0;
+        task_args args = {.argc = i, .argv = NULL, .envp = NULL};
+        tasks[i] = spawn(slice_task_entry, 0, &args);
+        if (!tasks[i]) {
+            printk("[TEST] FAILED: Could not create task %d\n", i);
+            slice_end_ns = 0;
+            local_irq_restore(flags);
+            release(tasks, i);
+            return;
+        }
+        eevdf_set_slice(tasks[i], SLICE_TEST_SLICE_NS);
+    }
+    slice_end_ns = get_ns() + SLICE_TEST_NS;
+    local_irq_restore(flags);
+
+    extern void schedule(void);
+    for (int i = 0; i < 1000 && (tasks[0]->state != TASK_ZOMBIE ||
+                                 tasks[1]->state != TASK_ZOMBIE);
+         i++)
+        schedule();
+    task_reap();
+    release(tasks, 2);
+    timer_get_stats(&after);
+
+    uint64_t runs = slice_runs[0] + slice_runs[1];
+    uint64_t avg = runs ? (slice_run_ns[0] + slice_run_ns[1]) / runs : 0;
+    printk("[TEST] %llu runs, average %llu us (slice %llu us)\n",
+           (unsigned long long)runs, (unsigned long long)(avg / 1000),
+           (unsigned long long)(SLICE_TEST_SLICE_NS / 1000));
+    printk("[TEST] Timer IRQs: %llu ticks, %llu preemptions\n",
+           (unsigned long long)(after.ticks - before.ticks),
+           (unsigned long long)(after.preemptions - before.preemptions));
+
+    // A run ends at the slice; only the first may be half a request
+    if (runs >= 4 && avg > SLICE_TEST_SLICE_NS * 3 / 4 &&
+        avg < SLICE_TEST_SLICE_NS * 5 / 4) {
+        printk("[TEST] PASSED: Tasks run for their slice\n");
+    } else {
+        printk("[TEST] FAILED: Runs do not match the slice\n");
+    }
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 10: NO_HZ Idle
+// Stops the tick the way the idle loop does, waits across several tick
+// periods with IRQs masked, and checks the timer never came due and jiffies
+// are caught up afterwards
+
+#define NOHZ_TEST_NS (50 * 1000000ULL)
+
+void test_nohz_idle(void) {
+    printk("\n=== TEST: NO_HZ Idle ===\n");
+
+    timer_stats_t before, after;
+    timer_get_stats(&before);
+
+    uint64_t flags = local_irq_save();
+    uint64_t jiffies0 = timer_get_ticks();
+    timer_nohz_enter();
+    uint64_t end = get_ns() + NOHZ_TEST_NS;
+    while (get_ns() < end)
+        ;
+    uint64_t ctl;
+    __asm__ volatile("mrs %0, cntp_ctl_el0" : "=r"(ctl));
+    timer_nohz_exit();
+    uint64_t jiffies1 = timer_get_ticks();
+    local_irq_restore(flags);
+
+    timer_get_stats(&after);
+    uint64_t expect = NOHZ_TEST_NS / EEVDF_TICK_NS;
+    printk("[TEST] Tick stopped for %llu us, jiffies +%llu (expected %llu)\n",
+           (unsigned long long)((after.idle_ns - before.idle_ns) / 1000),
+           (unsigned long long)(jiffies1 - jiffies0),
+           (unsigned long long)expect);
+
+    if (ctl & (1 << 2)) {
+        printk("[TEST] FAILED: Timer fired with the tick stopped\n");
+    } else if (jiffies1 - jiffies0 < expect ||
+               jiffies1 - jiffies0 > expect + 1) {
+        printk("[TEST] FAILED: jiffies not caught up\n");
+    } else {
+        printk("[TEST] PASSED: No timer event while idle, jiffies caught up\n");
+    }
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 11: Wait Queues
+// A task sleeping on the timer is blocked and off the runqueue until its
+// wakeup, a completion hands an event from one task to another, and
+// wake_up_all() releases every waiter on a queue
+
+#define WAIT_TEST_SLEEP_NS (30 * 1000000ULL)
+#define WAIT_TEST_WAITERS 3
+
+static volatile uint64_t sleeper_slept_ns;
+static completion_t wait_test_done = COMPLETION_INIT;
+static volatile int completion_seen;
+static wait_queue_t wait_test_wq = WAIT_QUEUE_INIT;
+static volatile int wait_test_go;
+static volatile int wait_test_released;
+
+static void sleeper_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    uint64_t start = get_ns();
+    task_sleep_ns(WAIT_TEST_SLEEP_NS);
+    sleeper_slept_ns = get_ns() - start;
+}
+
+static void completion_waiter_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    wait_for_completion(&wait_test_done);
+    completion_seen = 1;
+}
+
+static void completer_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    task_sleep_ns(10 * 1000000ULL);
+    complete(&wait_test_done);
+}
+
+static void wq_waiter_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    wait_event(&wait_test_wq, wait_test_go);
+    __atomic_add_fetch(&wait_test_released, 1, __ATOMIC_RELAXED);
+}
+
+// Run other tasks until every one of tasks has exited or timeout_ns passed
+static int wait_for_exit(task_t **tasks, int n, uint64_t timeout_ns) {
+    uint64_t end = get_ns() + timeout_ns;
+    for (;;) {
+        int alive = 0;
+        for (int i = 0; i < n; i++)
+            alive += tasks[i]->state != TASK_ZOMBIE;
+        if (!alive)
+            return 0;
+        if (get_ns() > end)
+            return -1;
+        schedule();
+    }
+}
+
+void test_wait_queues(void) {
+    printk("\n=== TEST: Wait Queues ===\n");
+    int failed = 0;
+
+    // Timed sleep
+    task_t *sleeper = spawn(sleeper_entry, 0, NULL);
+    if (!sleeper) {
+        printk("[TEST] FAILED: Could not create sleeper\n");
+        return;
+    }
+    schedule();
+    if (sleeper->state != TASK_BLOCKED || eevdf_is_queued(sleeper)) {
+        printk("[TEST] FAILED: Sleeper not blocked off the runqueue\n");
+        failed = 1;
+    }
+    if (wait_for_exit(&sleeper, 1, 10 * WAIT_TEST_SLEEP_NS) != 0 ||
+        sleeper_slept_ns < WAIT_TEST_SLEEP_NS) {
+        printk("[TEST] FAILED: Sleeper woke after %llu us\n",
+               (unsigned long long)(sleeper_slept_ns / 1000));
+        failed = 1;
+    } else {
+        printk("[TEST] Sleeper woke after %llu us\n",
+               (unsigned long long)(sleeper_slept_ns / 1000));
+    }
+    task_put(sleeper);
+
+    // Completion
+    init_completion(&wait_test_done);
+    completion_seen = 0;
+    task_t *pair[2];
+    pair[0] = spawn(completion_waiter_entry, 0, NULL);
+    pair[1] = spawn(completer_entry, 0, NULL);
+    if (!pair[0] || !pair[1] ||
+        wait_for_exit(pair, 2, 100 * 1000000ULL) != 0 || !completion_seen) {
+        printk("[TEST] FAILED: Completion did not reach its waiter\n");
+        failed = 1;
+    }
+    release(pair, 2);
+
+    // wake_up_all
+    wait_test_go = 0;
+    wait_test_released = 0;
+    task_t *waiters[WAIT_TEST_WAITERS];
+    for (int i = 0; i < WAIT_TEST_WAITERS; i++) {
+        waiters[i] = spawn(wq_waiter_entry, 0, NULL);
+        if (!waiters[i]) {
+            printk("[TEST] FAILED: Could not create waiter %d\n", i);
+            task_reap();
+            release(waiters, i);
+            return;
+        }
+    }
+    // Let them all block
+    for (int i = 0; i < 10; i++) {
+        int blocked = 0;
+        for (int j = 0; j < WAIT_TEST_WAITERS; j++)
+            blocked += waiters[j]->state == TASK_BLOCKED;
+        if (blocked == WAIT_TEST_WAITERS)
+            break;
+        schedule();
+    }
+    wait_test_go = 1;
+    int woken = wake_up_all(&wait_test_wq);
+    if (wait_for_exit(waiters, WAIT_TEST_WAITERS, 100 * 1000000ULL) != 0 ||
+        woken != WAIT_TEST_WAITERS ||
+        wait_test_released != WAIT_TEST_WAITERS) {
+        printk("[TEST] FAILED: wake_up_all woke %d, %d released\n", woken,
+               wait_test_released);
+        failed = 1;
+    }
+    task_reap();
+    release(waiters, WAIT_TEST_WAITERS);
+
+    if (!failed)
+        printk("[TEST] PASSED: Sleep, completion and wake_up_all\n");
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 12: Mutex
+// Tasks that sleep while holding a mutex force the others to queue on it;
+// the count they update under it must come out exact. Then a task that
+// re-takes a mutex right after every release must not starve a waiter: the
+// waiter asks for a handoff and gets the mutex on the next unlock.
+
+#define MUTEX_TEST_TASKS 4
+#define MUTEX_TEST_ROUNDS 25
+#define MUTEX_HOG_NS (200 * 1000000ULL)
+#define MUTEX_HOG_HOLD_NS (1000000ULL)
+
+static mutex_t mutex_test_lock = MUTEX_INIT;
+static volatile int mutex_test_count;
+static volatile int mutex_test_contended;
+static volatile uint64_t mutex_waiter_start;
+static volatile uint64_t mutex_waiter_wait_ns;
+
+static void mutex_counter_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    for (int i = 0; i < MUTEX_TEST_ROUNDS; i++) {
+        if (mutex_is_locked(&mutex_test_lock))
+            __atomic_add_fetch(&mutex_test_contended, 1, __ATOMIC_RELAXED);
+        mutex_lock(&mutex_test_lock);
+        int count = mutex_test_count;
+        task_sleep_ns(100000);
+        mutex_test_count = count + 1;
+        mutex_unlock(&mutex_test_lock);
+    }
+}
+
+static void mutex_hog_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    uint64_t end = get_ns() + MUTEX_HOG_NS;
+    while (get_ns() < end) {
+        mutex_lock(&mutex_test_lock);
+        uint64_t hold = get_ns() + MUTEX_HOG_HOLD_NS;
+        while (get_ns() < hold)
+            ;
+        mutex_unlock(&mutex_test_lock);
+    }
+}
+
+static void mutex_waiter_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    mutex_waiter_start = get_ns();
+    mutex_lock(&mutex_test_lock);
+    mutex_waiter_wait_ns = get_ns() - mutex_waiter_start;
+    mutex_unlock(&mutex_test_lock);
+}
+
+void test_mutex(void) {
+    printk("\n=== TEST: Mutex ===\n");
+    int failed = 0;
+
+    // Mutual exclusion across sleeps
+    mutex_test_count = 0;
+    mutex_test_contended = 0;
+    task_t *tasks[MUTEX_TEST_TASKS];
+    for (int i = 0; i < MUTEX_TEST_TASKS; i++) {
+        tasks[i] = spawn(mutex_counter_entry, 0, NULL);
+        if (!tasks[i]) {
+            printk("[TEST] FAILED: Could not create task %d\n", i);
+            release(tasks, i);
+            return;
+        }
+    }
+    if (wait_for_exit(tasks, MUTEX_TEST_TASKS, 1000 * 1000000ULL) != 0 ||
+        mutex_test_count != MUTEX_TEST_TASKS * MUTEX_TEST_ROUNDS ||
+        mutex_is_locked(&mutex_test_lock)) {
+        printk("[TEST] FAILED: Count %d, expected %d\n", mutex_test_count,
+               MUTEX_TEST_TASKS * MUTEX_TEST_ROUNDS);
+        failed = 1;
+    } else {
+        printk("[TEST] Count %d, mutex found held %d times\n",
+               mutex_test_count, mutex_test_contended);
+    }
+    release(tasks, MUTEX_TEST_TASKS);
+
+    // Handoff
+    mutex_waiter_wait_ns = 0;
+    task_t *pair[2];
+    pair[0] = spawn(mutex_hog_entry, 0, NULL);
+    if (!pair[0]) {
+        printk("[TEST] FAILED: Could not create hog\n");
+        return;
+    }
+    // Let the hog get going before the waiter shows up
+    for (int i = 0; i < 10 && !mutex_is_locked(&mutex_test_lock); i++)
+        schedule();
+    pair[1] = spawn(mutex_waiter_entry, 0, NULL);
+    if (!pair[1]) {
+        printk("[TEST] FAILED: Could not create waiter\n");
+        wait_for_exit(pair, 1, 2 * MUTEX_HOG_NS);
+        task_put(pair[0]);
+        return;
+    }
+    if (wait_for_exit(pair, 2, 4 * MUTEX_HOG_NS) != 0 ||
+        !mutex_waiter_wait_ns || mutex_waiter_wait_ns > MUTEX_HOG_NS / 2) {
+        printk("[TEST] FAILED: Waiter starved (%llu us)\n",
+               (unsigned long long)(mutex_waiter_wait_ns / 1000));
+        failed = 1;
+    } else {
+        printk("[TEST] Waiter got the mutex after %llu us\n",
+               (unsigned long long)(mutex_waiter_wait_ns / 1000));
+    }
+    task_reap();
+    release(pair, 2);
+
+    if (!failed)
+        printk("[TEST] PASSED: Mutual exclusion and handoff\n");
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 13: Reader-Writer Locks and Seqlocks
+// A writer that queues behind a reader gets the lock before a reader that
+// arrives after it (writer preference), readers share the lock, and a
+// seqlock reader overlapping a write is told to retry
+
+#define RW_TEST_HOLD_NS (30 * 1000000ULL)
+
+static rwlock_t rw_test_lock = RWLOCK_INIT;
+static volatile int rw_first_in;
+static volatile int rw_order[2];
+static volatile int rw_order_len;
+
+static void rw_first_reader_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    read_lock(&rw_test_lock);
+    rw_first_in = 1;
+    uint64_t end = get_ns() + RW_TEST_HOLD_NS;
+    while (get_ns() < end)
+        ;
+    read_unlock(&rw_test_lock);
+}
+
+static void rw_writer_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    while (!rw_first_in)
+        schedule();
+    write_lock(&rw_test_lock);
+    rw_order[rw_order_len++] = 'W';
+    write_unlock(&rw_test_lock);
+}
+
+static void rw_late_reader_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    // Arrive once the writer is queued
+    while (!(rw_test_lock.cnts & ~RW_READER_MASK))
+        schedule();
+    read_lock(&rw_test_lock);
+    rw_order[rw_order_len++] = 'R';
+    read_unlock(&rw_test_lock);
+}
+
+void test_rwlock_seqlock(void) {
+    printk("\n=== TEST: Reader-Writer Locks and Seqlocks ===\n");
+    int failed = 0;
+
+    // Readers share
+    read_lock(&rw_test_lock);
+    read_lock(&rw_test_lock);
+    if ((rw_test_lock.cnts & RW_READER_MASK) != 2) {
+        printk("[TEST] FAILED: Two readers not admitted together\n");
+        failed = 1;
+    }
+    read_unlock(&rw_test_lock);
+    read_unlock(&rw_test_lock);
+
+    // Writer preference
+    rw_first_in = 0;
+    rw_order_len = 0;
+    task_t *tasks[3];
+    tasks[0] = spawn(rw_first_reader_entry, 0, NULL);
+    tasks[1] = spawn(rw_writer_entry, 0, NULL);
+    tasks[2] = spawn(rw_late_reader_entry, 0, NULL);
+    if (!tasks[0] || !tasks[1] || !tasks[2]) {
+        printk("[TEST] FAILED: Could not create tasks\n");
+        release(tasks, 3);
+        return;
+    }
+    if (wait_for_exit(tasks, 3, 20 * RW_TEST_HOLD_NS) != 0 ||
+        rw_order_len != 2 || rw_order[0] != 'W' || rw_order[1] != 'R' ||
+        rw_test_lock.cnts != 0) {
+        printk("[TEST] FAILED: Late reader was not held back by the writer\n");
+        failed = 1;
+    }
+    task_reap();
+    release(tasks, 3);
+
+    // Seqlock
+    seqlock_t sl = SEQLOCK_INIT;
+    uint32_t seq = read_seqbegin(&sl);
+    int clean = !read_seqretry(&sl, seq);
+    uint64_t flags = write_seqlock_irqsave(&sl);
+    write_sequnlock_irqrestore(&sl, flags);
+    if (!clean || !read_seqretry(&sl, seq)) {
+        printk("[TEST] FAILED: Seqlock retry not signalled correctly\n");
+        failed = 1;
+    }
+
+    if (!failed)
+        printk("[TEST] PASSED: Shared readers, writer preference, seqlock retry\n");
+
+    printk("=== END TEST ===\n\n");
+}
+
+
+// Test 14: RCU
+// A call_rcu() callback runs once a grace period has passed,
+// synchronize_rcu() in a writer does not return while a reader that was
+// preempted inside its read-side section can still see the old object, and
+// reaped tasks leave the task list and drop their own reference a grace
+// period later
+
+#define RCU_TEST_HOLD_NS (30 * 1000000ULL)
+
+typedef struct {
+    volatile int alive;
+} rcu_test_obj_t;
+
+static rcu_test_obj_t rcu_obj_a, rcu_obj_b;
+static rcu_test_obj_t *rcu_test_ptr;
+static volatile int rcu_cb_ran;
+static volatile int rcu_reader_in;
+static volatile int rcu_reader_done;
+static volatile int rcu_reader_saw_freed;
+static volatile int rcu_writer_early;
+
+static void rcu_test_cb(rcu_head_t *head) {
+    (void)head;
+    rcu_cb_ran = 1;
+}
+
+static void rcu_reader_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    rcu_read_lock();
+    rcu_test_obj_t *obj = rcu_dereference(rcu_test_ptr);
+    rcu_reader_in = 1;
+    uint64_t end = get_ns() + RCU_TEST_HOLD_NS;
+    while (get_ns() < end)
+        ;
+    if (!obj->alive)
+        rcu_reader_saw_freed = 1;
+    rcu_reader_done = 1;
+    rcu_read_unlock();
+}
+
+static void rcu_writer_entry(int argc, char **argv, char **envp) {
+    (void)argc;
+    (void)argv;
+    (void)envp;
+    while (!rcu_reader_in)
+        schedule();
+    rcu_test_obj_t *old = rcu_test_ptr;
+    rcu_assign_pointer(rcu_test_ptr, &rcu_obj_b);
+    synchronize_rcu();
+    if (!rcu_reader_done)
+        rcu_writer_early = 1;
+    old->alive = 0;
+}
+
+void test_rcu(void) {
+    printk("\n=== TEST: RCU ===\n");
+    int failed = 0;
+    task_t *self = task_current();
+
+    // Nesting
+    rcu_read_lock();
+    rcu_read_lock();
+    int depth = self->rcu_nesting;
+    rcu_read_unlock();
+    rcu_read_unlock();
+    if (depth != 2 || self->rcu_nesting != 0) {
+        printk("[TEST] FAILED: Read-side sections do not nest\n");
+        failed = 1;
+    }
+
+    // Callback after a grace period
+    rcu_stats_t before, after;
+    rcu_get_stats(&before);
+    rcu_head_t head;
+    rcu_cb_ran = 0;
+    call_rcu(&head, rcu_test_cb);
+    uint64_t end = get_ns() + RCU_TEST_HOLD_NS;
+    while (!rcu_cb_ran && get_ns() < end)
+        schedule();
+    rcu_get_stats(&after);
+    if (!rcu_cb_ran || after.gp_completed == before.gp_completed) {
+        printk("[TEST] FAILED: call_rcu() callback did not run\n");
+        failed = 1;
+    }
+
+    // Preempted reader holds up synchronize_rcu()
+    rcu_obj_a.alive = rcu_obj_b.alive = 1;
+    rcu_test_ptr = &rcu_obj_a;
+    rcu_reader_in = rcu_reader_done = 0;
+    rcu_reader_saw_freed = rcu_writer_early = 0;
+    task_t *tasks[2];
+    tasks[0] = spawn(rcu_reader_entry, 0, NULL);
+    tasks[1] = spawn(rcu_writer_entry, 0, NULL);
+    if (!tasks[0] || !tasks[1]) {
+        printk("[TEST] FAILED: Could not create tasks\n");
+        release(tasks, 2);
+        return;
+    }
+    rcu_read_lock();
+    task_t *found = task_find_by_pid(tasks[1]->pid);
+    rcu_read_unlock();
+    if (found != tasks[1]) {
+        printk("[TEST] FAILED: Lockless PID lookup missed a new task\n");
+        failed = 1;
+    }
+    if (wait_for_exit(tasks, 2, 20 * RCU_TEST_HOLD_NS) != 0 ||
+        rcu_writer_early || rcu_reader_saw_freed) {
+        printk("[TEST] FAILED: Grace period ended under a reader\n");
+        failed = 1;
+    }
+
+    // Reclaim: the reaped tasks' own references go in callbacks queued
+    // ahead of synchronize_rcu()'s, leaving only ours
+    task_reap();
+    synchronize_rcu();
+    if (tasks[0]->usage != 1 || tasks[1]->usage != 1) {
+        printk("[TEST] FAILED: Reaped tasks not released (usage %u/%u)\n",
+               tasks[0]->usage, tasks[1]->usage);
+        failed = 1;
+    }
+    release(tasks, 2);
+    rcu_get_stats(&after);
+    printk("[TEST] %llu grace periods, %llu readers preempted in a section\n",
+           (unsigned long long)(after.gp_completed - before.gp_completed),
+           (unsigned long long)(after.readers_blocked - before.readers_blocked));
+
+    if (!failed)
+        printk("[TEST] PASSED: Callbacks after a grace period, preempted readers waited for, tasks reclaimed\n");
+
+    printk("=== END TEST ===\n\n");
+}
+
+
 // Main test runner
 void run_scheduler_integration_tests(void) {
     printk("\n");
@@ -435,6 +1494,16 @@ void run_scheduler_integration_tests(void) {
     test_task_termination();
     test_killing_current_task();
     test_stress();
+    test_stack_recycling();
+    test_many_tasks();
+    test_eevdf_latency();
+    test_nice_shares();
+    test_slice_timer();
+    test_nohz_idle();
+    test_wait_queues();
+    test_mutex();
+    test_rwlock_seqlock();
+    test_rcu();
     
     printk("\n");
     printk("========================================\n");